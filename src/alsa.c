@@ -26,8 +26,10 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include <alsa/asoundlib.h>
 
@@ -37,29 +39,172 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "sample-cache.h"
+#include "dsp.h"
+#include "resampler.h"
+#include "remix.h"
+#include "idmap.h"
+#include "wakeup.h"
 #include "malloc.h"
 
 struct private;
 
+/* Sounds are played by a small, fixed number of worker threads,
+ * each multiplexing all of its streams in a single poll() loop */
+#define N_WORKERS 2
+
+#define BUFSIZE (16*1024)
+
+/* In software mixing mode we keep one stream open at this buffer
+ * and period size, and close it when nothing was played for a
+ * while */
+#define MIX_BUFFER_USEC (100000U)
+#define MIX_PERIOD_USEC (20000U)
+#define MIX_IDLE_USEC (5000000ULL)
+#define MIX_CHANNELS (2U)
+
+/* With KA_PROP_KANBERRA_LATENCY_MSEC set the buffer is split into
+ * this many periods */
+#define N_PERIODS (4U)
+
+/* Configured PCMs of finished sounds are kept open and prepared for
+ * a while, for the next sound in the same format to reuse */
+#define POOL_SIZE_MAX (4U)
+#define POOL_IDLE_USEC (5000000ULL)
+
+struct worker {
+        struct private *private;
+        pthread_t thread;
+        ka_bool_t running;
+        ka_bool_t quit;
+        unsigned n_streams;
+        ka_wakeup wakeup;
+
+        /* Only accessed from the worker thread */
+        struct pollfd *pfd;
+        struct outstanding **streams;
+        unsigned n_pfd_allocated, n_streams_allocated;
+};
+
 struct outstanding {
         KA_LLIST_FIELDS(struct outstanding);
-        ka_bool_t dead;
+
+        /* Set atomically by whoever ends the stream first, see
+         * outstanding_kill() */
+        int dead;
+
         uint32_t id;
+        ka_idmap_entry by_id;
         ka_finish_callback_t callback;
         void *userdata;
         ka_sound_file *file;
         snd_pcm_t *pcm;
-        int pipe_fd[2];
         ka_context *context;
+        struct worker *worker;
+        ka_bool_t mixed;
+
+        /* Linear software volume, applied when not unity */
+        float volume;
+        ka_resample_quality_t quality;
+
+        /* The requested latency, 0 for the device's default */
+        unsigned latency;
+
+        ka_bool_t forced;
+        ka_channel_position_t force_channel;
+
+        /* Only accessed from the worker or mixer thread */
+        void *data;
+        void *raw;
+        const void *d;
+        size_t nbytes;
+        ka_bool_t mapped;
+        ka_bool_t draining;
+        unsigned rate;
+        size_t frame_size;
+        snd_pcm_uframes_t period_size;
+        unsigned pfd_index, n_pfd;
+
+        /* What to file the PCM under when it is given back to the
+         * pool, unless it is set up for this file only */
+        ka_sample_type_t pool_type;
+        unsigned pool_generation;
+        ka_bool_t no_pool;
+
+        /* The channels after remixing, which is what the resampler
+         * and the device get */
+        unsigned channels;
+        ka_remix *remix;
+        int16_t *remixed;
+        size_t remixed_size;
+
+        /* Set if the device runs at a rate other than the file's */
+        ka_resampler *resampler;
+        int16_t *resampled;
+        size_t resampled_size;
+        const int16_t *rd;
+        size_t n_resampled;
+};
+
+struct mixer {
+        struct private *private;
+        pthread_t thread;
+        ka_bool_t running;
+        ka_bool_t quit;
+        ka_wakeup wakeup;
+
+        /* Changed with both mixer_mutex and outstanding_mutex held */
+        snd_pcm_t *pcm;
+        unsigned rate;
+        snd_pcm_uframes_t period_size;
+        ka_bool_t stale; /* pcm is for the device we switched away from */
+
+        /* Only accessed from the mixer thread while pcm is set */
+        float *sum;
+        int16_t *buffer;
+        int16_t *scratch;
+        struct pollfd *pfd;
+        unsigned n_pfd_allocated;
+        struct outstanding **voices;
+        unsigned n_voices_allocated;
+};
+
+struct pooled_pcm {
+        KA_LLIST_FIELDS(struct pooled_pcm);
+        snd_pcm_t *pcm;
+        uint64_t timestamp;
+
+        /* The key: what we would write without resampling, at the
+         * file's rate. If the device runs at another rate the PCM
+         * is configured for S16NE. */
+        ka_sample_type_t type;
+        unsigned rate;
+        unsigned nchannels;
+        unsigned latency;
+
+        unsigned device_rate;
+        snd_pcm_uframes_t period_size;
 };
 
 struct private {
         ka_theme_data *theme;
+        ka_sample_cache *samples;
         ka_mutex *outstanding_mutex;
-        ka_bool_t signal_semaphore;
-        sem_t semaphore;
-        ka_bool_t semaphore_allocated;
+        struct worker workers[N_WORKERS];
         KA_LLIST_HEAD(struct outstanding, outstanding);
+
+        ka_idmap *ids;
+
+        ka_bool_t software_mix;
+        ka_mutex *mixer_mutex;
+        struct mixer mixer;
+
+        /* Bumped whenever the device changes, so that PCMs on the old
+         * one don't end up in the pool */
+        ka_mutex *pool_mutex;
+        KA_LLIST_HEAD(struct pooled_pcm, pool);
+        unsigned n_pool;
+        unsigned pool_generation;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -67,23 +212,193 @@ struct private {
 static void outstanding_free(struct outstanding *o) {
         ka_assert(o);
 
-        if (o->pipe_fd[1] >= 0)
-                close(o->pipe_fd[1]);
-
-        if (o->pipe_fd[0] >= 0)
-                close(o->pipe_fd[0]);
-
         if (o->file)
                 ka_sound_file_close(o->file);
 
         if (o->pcm)
                 snd_pcm_close(o->pcm);
 
+        if (o->resampler)
+                ka_resampler_free(o->resampler);
+
+        if (o->remix)
+                ka_remix_free(o->remix);
+
+        ka_free(o->data);
+        ka_free(o->raw);
+        ka_free(o->resampled);
+        ka_free(o->remixed);
         ka_free(o);
 }
 
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+/* Closes the pooled PCMs that have been idle for too long, or all of
+ * them if all is TRUE */
+static void pool_evict(struct private *p, ka_bool_t all) {
+        struct pooled_pcm *e, *next;
+        KA_LLIST_HEAD(struct pooled_pcm, evicted);
+        uint64_t now = now_usec();
+
+        KA_LLIST_HEAD_INIT(struct pooled_pcm, evicted);
+
+        ka_mutex_lock(p->pool_mutex);
+
+        for (e = p->pool; e; e = next) {
+                next = e->next;
+
+                if (!all && e->timestamp + POOL_IDLE_USEC > now)
+                        continue;
+
+                KA_LLIST_REMOVE(struct pooled_pcm, p->pool, e);
+                KA_LLIST_PREPEND(struct pooled_pcm, evicted, e);
+                p->n_pool--;
+        }
+
+        ka_mutex_unlock(p->pool_mutex);
+
+        /* Closing may take a while, so not with the lock held */
+        while ((e = evicted)) {
+                KA_LLIST_REMOVE(struct pooled_pcm, evicted, e);
+                snd_pcm_close(e->pcm);
+                ka_free(e);
+        }
+}
+
+/* Returns the time in ms until the next pooled PCM is to be evicted,
+ * or -1 if there is none */
+static int pool_timeout(struct private *p) {
+        struct pooled_pcm *e;
+        uint64_t oldest = 0, now;
+
+        ka_mutex_lock(p->pool_mutex);
+
+        for (e = p->pool; e; e = e->next)
+                if (oldest <= 0 || e->timestamp < oldest)
+                        oldest = e->timestamp;
+
+        ka_mutex_unlock(p->pool_mutex);
+
+        if (oldest <= 0)
+                return -1;
+
+        now = now_usec();
+
+        if (oldest + POOL_IDLE_USEC <= now)
+                return 0;
+
+        return (int) ((oldest + POOL_IDLE_USEC - now) / 1000ULL) + 1;
+}
+
+/* Takes a prepared PCM for the given key out of the pool, if there
+ * is one */
+static struct pooled_pcm *pool_get(struct private *p, ka_sample_type_t type, unsigned rate, unsigned nchannels, unsigned latency) {
+        struct pooled_pcm *e;
+
+        ka_mutex_lock(p->pool_mutex);
+
+        for (e = p->pool; e; e = e->next)
+                if (e->type == type &&
+                    e->rate == rate &&
+                    e->nchannels == nchannels &&
+                    e->latency == latency) {
+
+                        KA_LLIST_REMOVE(struct pooled_pcm, p->pool, e);
+                        p->n_pool--;
+                        break;
+                }
+
+        ka_mutex_unlock(p->pool_mutex);
+
+        return e;
+}
+
+/* Gives the PCM of a stream that is done back to the pool, prepared
+ * for the next sound. If that is not possible out->pcm is left for
+ * outstanding_free() to close. */
+static void pool_put(struct private *p, struct outstanding *out) {
+        struct pooled_pcm *e;
+        snd_pcm_state_t state;
+
+        if (!out->pcm || out->no_pool)
+                return;
+
+        state = snd_pcm_state(out->pcm);
+
+        if (state != SND_PCM_STATE_SETUP && state != SND_PCM_STATE_PREPARED)
+                if (snd_pcm_drop(out->pcm) < 0)
+                        return;
+
+        if (state != SND_PCM_STATE_PREPARED)
+                if (snd_pcm_prepare(out->pcm) < 0)
+                        return;
+
+        if (!(e = ka_new(struct pooled_pcm, 1)))
+                return;
+
+        e->pcm = out->pcm;
+        e->timestamp = now_usec();
+        e->type = out->pool_type;
+        e->rate = ka_sound_file_get_rate(out->file);
+        e->nchannels = ka_sound_file_get_nchannels(out->file);
+        e->latency = out->latency;
+        e->device_rate = out->rate;
+        e->period_size = out->period_size;
+
+        ka_mutex_lock(p->pool_mutex);
+
+        if (out->pool_generation != p->pool_generation || p->n_pool >= POOL_SIZE_MAX) {
+                ka_mutex_unlock(p->pool_mutex);
+                ka_free(e);
+                return;
+        }
+
+        KA_LLIST_PREPEND(struct pooled_pcm, p->pool, e);
+        p->n_pool++;
+
+        ka_mutex_unlock(p->pool_mutex);
+
+        out->pcm = NULL;
+}
+
+/* Ends the stream. Of all callers, which might race each other
+ * from the application's and the worker threads, exactly one gets
+ * TRUE and needs to call the callback. The worker notices on its
+ * next wakeup and frees the stream. */
+static ka_bool_t outstanding_kill(struct outstanding *out) {
+        return ka_atomic_cmpxchg(&out->dead, FALSE, TRUE);
+}
+
+static ka_bool_t outstanding_dead(struct outstanding *out) {
+        return ka_atomic_load(&out->dead);
+}
+
+/* Who handles the stream. Needs to be called with outstanding_mutex
+ * held, but the result may be signalled without. */
+static ka_wakeup *outstanding_wakeup(struct private *p, struct outstanding *out) {
+        return out->mixed ? &p->mixer.wakeup : &out->worker->wakeup;
+}
+
+static ka_bool_t get_software_mix(ka_proplist *p) {
+        const char *t;
+        ka_bool_t b;
+
+        ka_proplist_lock(p);
+        t = ka_proplist_gets_atom_unlocked(p, KA_ATOM_KANBERRA_SOFTWARE_MIX);
+        b = t && ka_streq(t, "1");
+        ka_proplist_unlock(p);
+
+        return b;
+}
+
 int driver_open(ka_context *c) {
         struct private *p;
+        unsigned i;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(!c->driver || ka_streq(c->driver, "alsa"), KA_ERROR_NODRIVER);
@@ -92,17 +407,54 @@ int driver_open(ka_context *c) {
         if (!(c->private = p = ka_new0(struct private, 1)))
                 return KA_ERROR_OOM;
 
-        if (!(p->outstanding_mutex = ka_mutex_new())) {
+        for (i = 0; i < N_WORKERS; i++) {
+                p->workers[i].private = p;
+                p->workers[i].wakeup.fd[0] = p->workers[i].wakeup.fd[1] = -1;
+        }
+
+        p->mixer.private = p;
+        p->mixer.wakeup.fd[0] = p->mixer.wakeup.fd[1] = -1;
+
+        if (!(p->outstanding_mutex = ka_mutex_new()) ||
+            !(p->mixer_mutex = ka_mutex_new()) ||
+            !(p->pool_mutex = ka_mutex_new())) {
                 driver_destroy(c);
                 return KA_ERROR_OOM;
         }
 
-        if (sem_init(&p->semaphore, 0, 0) < 0) {
+        if (ka_idmap_new(&p->ids) < 0) {
                 driver_destroy(c);
                 return KA_ERROR_OOM;
         }
 
-        p->semaphore_allocated = TRUE;
+        for (i = 0; i < N_WORKERS; i++) {
+                struct worker *w = &p->workers[i];
+
+                w->n_pfd_allocated = w->n_streams_allocated = 8;
+
+                if (!(w->pfd = ka_new(struct pollfd, w->n_pfd_allocated)) ||
+                    !(w->streams = ka_new(struct outstanding*, w->n_streams_allocated))) {
+                        driver_destroy(c);
+                        return KA_ERROR_OOM;
+                }
+
+                if (ka_wakeup_init(&w->wakeup) < 0) {
+                        driver_destroy(c);
+                        return KA_ERROR_SYSTEM;
+                }
+        }
+
+        if (ka_wakeup_init(&p->mixer.wakeup) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_SYSTEM;
+        }
+
+        p->software_mix = get_software_mix(c->props);
+
+        if (ka_sample_cache_new(&p->samples, KA_SAMPLE_CACHE_SIZE_MAX) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_OOM;
+        }
 
         return KA_SUCCESS;
 }
@@ -110,6 +462,7 @@ int driver_open(ka_context *c) {
 int driver_destroy(ka_context *c) {
         struct private *p;
         struct outstanding *out;
+        unsigned i;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -119,43 +472,80 @@ int driver_destroy(ka_context *c) {
         if (p->outstanding_mutex) {
                 ka_mutex_lock(p->outstanding_mutex);
 
-                /* Tell all player threads to terminate */
+                /* Tell all streams to terminate */
                 for (out = p->outstanding; out; out = out->next) {
 
-                        if (out->dead)
+                        if (!outstanding_kill(out))
                                 continue;
 
-                        out->dead = TRUE;
-
                         if (out->callback)
                                 out->callback(c, out->id, KA_ERROR_DESTROYED, out->userdata);
-
-                        /* This will cause the thread to wakeup and terminate */
-                        if (out->pipe_fd[1] >= 0) {
-                                close(out->pipe_fd[1]);
-                                out->pipe_fd[1] = -1;
-                        }
                 }
 
-                if (p->semaphore_allocated) {
-                        /* Now wait until all players are destroyed */
-                        p->signal_semaphore = TRUE;
-                        while (p->outstanding) {
-                                ka_mutex_unlock(p->outstanding_mutex);
-                                sem_wait(&p->semaphore);
-                                ka_mutex_lock(p->outstanding_mutex);
-                        }
+                /* This will cause the workers to wakeup, free their
+                 * streams and terminate */
+                for (i = 0; i < N_WORKERS; i++) {
+                        p->workers[i].quit = TRUE;
+
+                        if (p->workers[i].running)
+                                ka_wakeup_signal(&p->workers[i].wakeup);
                 }
 
+                p->mixer.quit = TRUE;
+
+                if (p->mixer.running)
+                        ka_wakeup_signal(&p->mixer.wakeup);
+
                 ka_mutex_unlock(p->outstanding_mutex);
+
+                for (i = 0; i < N_WORKERS; i++)
+                        if (p->workers[i].running)
+                                pthread_join(p->workers[i].thread, NULL);
+
+                if (p->mixer.running)
+                        pthread_join(p->mixer.thread, NULL);
+
+                ka_assert(!p->outstanding);
+
                 ka_mutex_free(p->outstanding_mutex);
         }
 
+        if (p->ids)
+                ka_idmap_free(p->ids);
+
+        for (i = 0; i < N_WORKERS; i++) {
+                if (p->workers[i].wakeup.fd[0] >= 0)
+                        ka_wakeup_done(&p->workers[i].wakeup);
+
+                ka_free(p->workers[i].pfd);
+                ka_free(p->workers[i].streams);
+        }
+
+        if (p->mixer.wakeup.fd[0] >= 0)
+                ka_wakeup_done(&p->mixer.wakeup);
+
+        if (p->mixer.pcm)
+                snd_pcm_close(p->mixer.pcm);
+
+        ka_free(p->mixer.sum);
+        ka_free(p->mixer.buffer);
+        ka_free(p->mixer.scratch);
+        ka_free(p->mixer.pfd);
+        ka_free(p->mixer.voices);
+
+        if (p->mixer_mutex)
+                ka_mutex_free(p->mixer_mutex);
+
+        if (p->pool_mutex) {
+                pool_evict(p, TRUE);
+                ka_mutex_free(p->pool_mutex);
+        }
+
         if (p->theme)
                 ka_theme_data_free(p->theme);
 
-        if (p->semaphore_allocated)
-                sem_destroy(&p->semaphore);
+        if (p->samples)
+                ka_sample_cache_free(p->samples);
 
         ka_free(p);
 
@@ -169,9 +559,31 @@ int driver_destroy(ka_context *c) {
 int driver_change_device (ka_context *c,
 			  const char *device GNUC_UNUSED)
 {
+        struct private *p;
+
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
 
+        p = PRIVATE(c);
+
+        /* The pooled PCMs are for the old device */
+        ka_mutex_lock(p->pool_mutex);
+        p->pool_generation++;
+        ka_mutex_unlock(p->pool_mutex);
+
+        pool_evict(p, TRUE);
+
+        /* So is the mixer's stream. The mixer thread closes it once
+         * the sounds on it are through, so that the next sound
+         * opens it again on the new device. */
+        ka_mutex_lock(p->mixer_mutex);
+        ka_mutex_lock(p->outstanding_mutex);
+        p->mixer.stale = !!p->mixer.pcm;
+        ka_mutex_unlock(p->outstanding_mutex);
+        ka_mutex_unlock(p->mixer_mutex);
+
+        ka_wakeup_signal(&p->mixer.wakeup);
+
         return KA_SUCCESS;
 }
 
@@ -179,15 +591,97 @@ int driver_change_props(ka_context *c, ka_proplist *changed, ka_proplist *merged
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(changed, KA_ERROR_INVALID);
         ka_return_val_if_fail(merged, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        PRIVATE(c)->software_mix = get_software_mix(merged);
 
         return KA_SUCCESS;
 }
 
+static int get_force_channel(ka_proplist *proplist, ka_bool_t *forced, ka_channel_position_t *position) {
+        const char *t;
+        int ret = KA_SUCCESS;
+
+        *forced = FALSE;
+
+        ka_mutex_lock(proplist->mutex);
+
+        if ((t = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_FORCE_CHANNEL)))
+                if ((ret = ka_parse_channel_position(position, t)) >= 0)
+                        *forced = TRUE;
+
+        ka_mutex_unlock(proplist->mutex);
+
+        return ret;
+}
+
+static int get_cache_control(ka_proplist *proplist, ka_cache_control_t *control) {
+        const char *ct;
+        int ret = KA_SUCCESS;
+
+        ka_mutex_lock(proplist->mutex);
+
+        if ((ct = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_CACHE_CONTROL)))
+                ret = ka_parse_cache_control(control, ct);
+
+        ka_mutex_unlock(proplist->mutex);
+
+        return ret;
+}
+
 int driver_cache(ka_context *c, ka_proplist *proplist) {
+        struct private *p;
+        ka_cache_control_t cache_control = KA_CACHE_CONTROL_PERMANENT;
+        ka_sound_file *f;
+        char *sp;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        if ((ret = get_cache_control(proplist, &cache_control)) < 0)
+                return ret;
+
+        if (cache_control != KA_CACHE_CONTROL_PERMANENT)
+                return KA_ERROR_INVALID;
+
+        if ((ret = ka_lookup_sound(&f, &sp, &p->theme, c->props, proplist)) < 0)
+                return ret;
+
+        /* Files passed via media.filename don't tell us their path */
+        if (sp)
+                ret = ka_sample_cache_get(p->samples, &f, sp, cache_control);
+        else
+                ret = KA_ERROR_NOTSUPPORTED;
+
+        if (f)
+                ka_sound_file_close(f);
+
+        ka_free(sp);
+
+        return ret;
+}
+
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        int ret;
+
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        /* We only decode into our own memory, which is quick enough
+         * to do right away */
+        if ((ret = driver_cache(c, proplist)) < 0)
+                return ret;
 
-        return KA_ERROR_NOTSUPPORTED;
+        if (cb)
+                cb(c, KA_SUCCESS, userdata);
+
+        return KA_SUCCESS;
 }
 
 static int translate_error(int error) {
@@ -225,21 +719,142 @@ static const snd_pcm_format_t sample_type_table[] = {
         [KA_SAMPLE_U8] = SND_PCM_FORMAT_U8
 };
 
+#ifdef SND_CHMAP_API_VERSION
+static const unsigned chmap_table[_KA_CHANNEL_POSITION_MAX] = {
+        [KA_CHANNEL_MONO] = SND_CHMAP_MONO,
+        [KA_CHANNEL_FRONT_LEFT] = SND_CHMAP_FL,
+        [KA_CHANNEL_FRONT_RIGHT] = SND_CHMAP_FR,
+        [KA_CHANNEL_FRONT_CENTER] = SND_CHMAP_FC,
+        [KA_CHANNEL_REAR_LEFT] = SND_CHMAP_RL,
+        [KA_CHANNEL_REAR_RIGHT] = SND_CHMAP_RR,
+        [KA_CHANNEL_REAR_CENTER] = SND_CHMAP_RC,
+        [KA_CHANNEL_LFE] = SND_CHMAP_LFE,
+        [KA_CHANNEL_FRONT_LEFT_OF_CENTER] = SND_CHMAP_FLC,
+        [KA_CHANNEL_FRONT_RIGHT_OF_CENTER] = SND_CHMAP_FRC,
+        [KA_CHANNEL_SIDE_LEFT] = SND_CHMAP_SL,
+        [KA_CHANNEL_SIDE_RIGHT] = SND_CHMAP_SR,
+        [KA_CHANNEL_TOP_CENTER] = SND_CHMAP_TC,
+        [KA_CHANNEL_TOP_FRONT_LEFT] = SND_CHMAP_TFL,
+        [KA_CHANNEL_TOP_FRONT_RIGHT] = SND_CHMAP_TFR,
+        [KA_CHANNEL_TOP_FRONT_CENTER] = SND_CHMAP_TFC,
+        [KA_CHANNEL_TOP_REAR_LEFT] = SND_CHMAP_TRL,
+        [KA_CHANNEL_TOP_REAR_RIGHT] = SND_CHMAP_TRR,
+        [KA_CHANNEL_TOP_REAR_CENTER] = SND_CHMAP_TRC
+};
+
+/* Reads the layout the device is configured for. Returns FALSE if it
+ * doesn't tell or uses positions we don't know. */
+static ka_bool_t get_device_map(snd_pcm_t *pcm, unsigned nchannels, ka_channel_position_t *map) {
+        snd_pcm_chmap_t *cm;
+        ka_bool_t good = FALSE;
+        unsigned i, k;
+
+        if (!(cm = snd_pcm_get_chmap(pcm)))
+                return FALSE;
+
+        if (cm->channels != nchannels)
+                goto finish;
+
+        for (i = 0; i < nchannels; i++) {
+                for (k = 0; k < _KA_CHANNEL_POSITION_MAX; k++)
+                        if (chmap_table[k] == cm->pos[i])
+                                break;
+
+                if (k >= _KA_CHANNEL_POSITION_MAX)
+                        goto finish;
+
+                map[i] = (ka_channel_position_t) k;
+        }
+
+        good = TRUE;
+
+finish:
+        free(cm);
+
+        return good;
+}
+
+/* Asks the device to take the channels in the given order */
+static ka_bool_t set_device_map(snd_pcm_t *pcm, unsigned nchannels, const ka_channel_position_t *map) {
+        snd_pcm_chmap_t *cm;
+        ka_bool_t good;
+        unsigned i;
+
+        if (!(cm = ka_malloc(sizeof(snd_pcm_chmap_t) + sizeof(unsigned) * nchannels)))
+                return FALSE;
+
+        cm->channels = nchannels;
+        for (i = 0; i < nchannels; i++)
+                cm->pos[i] = chmap_table[map[i]];
+
+        good = snd_pcm_set_chmap(pcm, cm) >= 0;
+        ka_free(cm);
+
+        return good;
+}
+#endif
+
+/* The smallest of the usual layouts that has the position */
+static unsigned channels_for_position(ka_channel_position_t position) {
+        static const unsigned layouts[] = { 2, 4, 5, 6, 8 };
+        unsigned i, k;
+
+        for (i = 0; i < KA_ELEMENTSOF(layouts); i++) {
+                const ka_channel_position_t *map = ka_channel_map_default(layouts[i]);
+
+                for (k = 0; k < layouts[i]; k++)
+                        if (map[k] == position)
+                                return layouts[i];
+        }
+
+        return 2;
+}
+
 static int open_alsa(ka_context *c, struct outstanding *out) {
         int ret;
         snd_pcm_hw_params_t *hwparams;
-        unsigned rate;
+        snd_pcm_sw_params_t *swparams;
+        ka_sample_type_t type;
+        unsigned rate, nchannels;
+        ka_bool_t resample, remix, force_s16 = FALSE;
+        struct pooled_pcm *e;
+        const ka_channel_position_t *file_map;
+        ka_channel_position_t *device_map = NULL;
 
         snd_pcm_hw_params_alloca(&hwparams);
+        snd_pcm_sw_params_alloca(&swparams);
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
         ka_return_val_if_fail(out, KA_ERROR_INVALID);
 
-        /* In ALSA we need to open different devices for doing
-         * multichannel audio. This cnnot be done in a backend-independant
-         * wa, hence we limit ourselves to mono/stereo only. */
-        ka_return_val_if_fail(ka_sound_file_get_nchannels(out->file) <= 2, KA_ERROR_NOTSUPPORTED);
+        rate = ka_sound_file_get_rate(out->file);
+        nchannels = ka_sound_file_get_nchannels(out->file);
+        file_map = ka_sound_file_get_channel_map(out->file);
+
+        /* With software volume we write converted S16NE data */
+        out->pool_type = ka_dsp_volume_is_unity(out->volume) ? ka_sound_file_get_sample_type(out->file) : KA_SAMPLE_S16NE;
+
+        ka_mutex_lock(PRIVATE(c)->pool_mutex);
+        out->pool_generation = PRIVATE(c)->pool_generation;
+        ka_mutex_unlock(PRIVATE(c)->pool_mutex);
+
+        /* Negotiating the hardware parameters is slow, so reuse a
+         * configured PCM if we can. Pooled PCMs are all configured
+         * for the file's channels as they are. */
+        if (!out->forced && (e = pool_get(PRIVATE(c), out->pool_type, rate, nchannels, out->latency))) {
+                out->pcm = e->pcm;
+                out->rate = e->device_rate;
+                out->period_size = e->period_size;
+                out->channels = nchannels;
+                resample = e->device_rate != rate;
+                ka_free(e);
+
+                type = resample ? KA_SAMPLE_S16NE : out->pool_type;
+                goto configured;
+        }
+
+reopen:
 
         if ((ret = snd_pcm_open(&out->pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
                 goto finish;
@@ -250,187 +865,1072 @@ static int open_alsa(ka_context *c, struct outstanding *out) {
         if ((ret = snd_pcm_hw_params_set_access(out->pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
                 goto finish;
 
-        if ((ret = snd_pcm_hw_params_set_format(out->pcm, hwparams, sample_type_table[ka_sound_file_get_sample_type(out->file)])) < 0)
+        /* We'd rather resample ourselves than have a plug PCM do
+         * it, so that the device can stay at its native rate */
+        if ((ret = snd_pcm_hw_params_set_rate_resample(out->pcm, hwparams, 0)) < 0)
                 goto finish;
 
-        rate = ka_sound_file_get_rate(out->file);
-        if ((ret = snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &rate, 0)) < 0)
-                goto finish;
+        out->no_pool = out->forced || force_s16;
 
-        if ((ret = snd_pcm_hw_params_set_channels(out->pcm, hwparams, ka_sound_file_get_nchannels(out->file))) < 0)
-                goto finish;
+        /* A forced channel needs a layout that has it, otherwise we
+         * take what the device can do closest to the file and remix
+         * if that's not the same */
+        out->channels = out->forced ? channels_for_position(out->force_channel) : nchannels;
 
-        if ((ret = snd_pcm_hw_params(out->pcm, hwparams)) < 0)
+        if ((ret = snd_pcm_hw_params_set_channels_near(out->pcm, hwparams, &out->channels)) < 0)
                 goto finish;
 
-        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
-                goto finish;
+        remix = out->forced || out->channels != nchannels;
 
-        return KA_SUCCESS;
+        resample = snd_pcm_hw_params_test_rate(out->pcm, hwparams, rate, 0) < 0;
 
-finish:
+        /* Resampling and remixing need S16NE data too */
+        type = resample || remix || force_s16 ? KA_SAMPLE_S16NE : out->pool_type;
 
-        return translate_error(ret);
-}
+        if ((ret = snd_pcm_hw_params_set_format(out->pcm, hwparams, sample_type_table[type])) < 0)
+                goto finish;
 
-#define BUFSIZE (16*1024)
+        out->rate = rate;
 
-static void* thread_func(void *userdata) {
-        struct outstanding *out = userdata;
-        int ret;
-        void *data, *d = NULL;
-        size_t fs, data_size;
-        size_t nbytes = 0;
-        struct pollfd *pfd = NULL;
-        nfds_t n_pfd;
-        struct private *p;
+        if (resample)
+                ret = snd_pcm_hw_params_set_rate_near(out->pcm, hwparams, &out->rate, 0);
+        else
+                ret = snd_pcm_hw_params_set_rate(out->pcm, hwparams, rate, 0);
 
-        p = PRIVATE(out->context);
+        if (ret < 0)
+                goto finish;
 
-        pthread_detach(pthread_self());
+        /* Without a latency asked for we stay with the device's
+         * default buffer, which can be rather large */
+        if (out->latency > 0) {
+                unsigned buffer_time = out->latency, period_time = out->latency / N_PERIODS;
 
-        fs = ka_sound_file_frame_size(out->file);
-        data_size = (BUFSIZE/fs)*fs;
+                if ((ret = snd_pcm_hw_params_set_buffer_time_near(out->pcm, hwparams, &buffer_time, 0)) < 0)
+                        goto finish;
 
-        if (!(data = ka_malloc(data_size))) {
-                ret = KA_ERROR_OOM;
-                goto finish;
+                if ((ret = snd_pcm_hw_params_set_period_time_near(out->pcm, hwparams, &period_time, 0)) < 0)
+                        goto finish;
         }
 
-        if ((ret = snd_pcm_poll_descriptors_count(out->pcm)) < 0) {
-                ret = translate_error(ret);
+        if ((ret = snd_pcm_hw_params(out->pcm, hwparams)) < 0)
                 goto finish;
-        }
 
-        n_pfd = (nfds_t) ret + 1;
-        if (!(pfd = ka_new(struct pollfd, n_pfd))) {
-                ret = KA_ERROR_OOM;
+        if ((ret = snd_pcm_hw_params_get_period_size(hwparams, &out->period_size, 0)) < 0)
                 goto finish;
-        }
 
-        if ((ret = snd_pcm_poll_descriptors(out->pcm, pfd+1, (unsigned) n_pfd-1)) < 0) {
-                ret = translate_error(ret);
+        if (!(device_map = ka_new(ka_channel_position_t, out->channels))) {
+                ret = -ENOMEM;
                 goto finish;
         }
 
-        pfd[0].fd = out->pipe_fd[0];
-        pfd[0].events = POLLIN;
-        pfd[0].revents = 0;
-
-        for (;;) {
-                unsigned short revents;
-                snd_pcm_sframes_t sframes;
+#ifdef SND_CHMAP_API_VERSION
+        if (!get_device_map(out->pcm, out->channels, device_map)) {
+                ka_free(device_map);
+                device_map = NULL;
+        }
 
-                if (out->dead)
-                        break;
+        /* If the device lays out the channels differently, we first
+         * try to make it use the file's layout, and otherwise
+         * reorder them ourselves. Remixing needs S16NE data, and
+         * since the format is fixed by now we need to start over
+         * for that. */
+        if (!remix && file_map && device_map &&
+            memcmp(file_map, device_map, sizeof(ka_channel_position_t) * nchannels) != 0) {
+
+                if (set_device_map(out->pcm, nchannels, file_map))
+                        out->no_pool = TRUE;
+                else if (type == KA_SAMPLE_S16NE)
+                        remix = TRUE;
+                else {
+                        ka_free(device_map);
+                        device_map = NULL;
+
+                        snd_pcm_close(out->pcm);
+                        out->pcm = NULL;
+
+                        force_s16 = TRUE;
+                        goto reopen;
+                }
+        }
+#else
+        ka_free(device_map);
+        device_map = NULL;
+#endif
 
-                if (poll(pfd, n_pfd, -1) < 0) {
-                        ret = KA_ERROR_SYSTEM;
-                        goto finish;
+        if (remix) {
+                if ((ret = ka_remix_new(&out->remix, nchannels, file_map, out->channels, device_map, out->forced ? &out->force_channel : NULL)) < 0) {
+                        ka_free(device_map);
+                        return ret;
                 }
 
-                /* We have been asked to shut down */
-                if (pfd[0].revents)
-                        break;
+                if (ka_remix_is_identity(out->remix)) {
+                        ka_remix_free(out->remix);
+                        out->remix = NULL;
+                } else
+                        out->no_pool = TRUE;
+        }
+
+        ka_free(device_map);
 
-                if ((ret = snd_pcm_poll_descriptors_revents(out->pcm, pfd+1, (unsigned) n_pfd-1, &revents)) < 0) {
-                        ret = translate_error(ret);
+        /* With a latency asked for, start playback as soon as the
+         * first period is written. Otherwise keep the device's
+         * default. */
+        if (out->latency > 0) {
+                if ((ret = snd_pcm_sw_params_current(out->pcm, swparams)) < 0)
                         goto finish;
-                }
 
-                if (revents != POLLOUT) {
+                if ((ret = snd_pcm_sw_params_set_start_threshold(out->pcm, swparams, out->period_size)) < 0)
+                        goto finish;
 
-                        switch (snd_pcm_state(out->pcm)) {
+                if ((ret = snd_pcm_sw_params(out->pcm, swparams)) < 0)
+                        goto finish;
+        }
 
-                        case SND_PCM_STATE_XRUN:
+        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
+                goto finish;
 
-                                if ((ret = snd_pcm_recover(out->pcm, -EPIPE, 1)) != 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
+        /* The worker serves many streams at once, so none of them
+         * may block it */
+        if ((ret = snd_pcm_nonblock(out->pcm, 1)) < 0)
+                goto finish;
 
-                        case SND_PCM_STATE_SUSPENDED:
+configured:
 
-                                if ((ret = snd_pcm_recover(out->pcm, -ESTRPIPE, 1)) != 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
+        out->frame_size = type == KA_SAMPLE_S16NE ? sizeof(int16_t) * out->channels : ka_sound_file_frame_size(out->file);
 
-                        default:
+        if (resample && out->rate != rate)
+                if ((ret = ka_resampler_new(&out->resampler, out->channels, rate, out->rate, out->quality)) < 0)
+                        return ret;
 
-                                snd_pcm_drop(out->pcm);
+        return KA_SUCCESS;
 
-                                if ((ret = snd_pcm_prepare(out->pcm)) < 0) {
-                                        ret = translate_error(ret);
-                                        goto finish;
-                                }
-                                break;
-                        }
+finish:
 
-                        continue;
+        return translate_error(ret);
+}
+
+/* Runs n_in S16NE frames through the resampler into
+ * out->rd/out->n_resampled. With n_in 0 the resampler is drained
+ * instead. */
+static int resample(struct outstanding *out, const int16_t *in, size_t n_in) {
+        unsigned nchannels = out->channels;
+        size_t n;
+        int ret;
+
+        n = ka_resampler_max_out(out->resampler, n_in);
+
+        if (n > out->resampled_size) {
+                ka_free(out->resampled);
+                out->resampled_size = 0;
+
+                if (!(out->resampled = ka_new(int16_t, n * nchannels)))
+                        return KA_ERROR_OOM;
+
+                out->resampled_size = n;
+        }
+
+        if (n_in > 0)
+                ret = ka_resampler_run(out->resampler, in, n_in, out->resampled, &n);
+        else
+                ret = ka_resampler_drain(out->resampler, out->resampled, &n);
+
+        if (ret < 0)
+                return ret;
+
+        out->rd = out->resampled;
+        out->n_resampled = n;
+
+        return KA_SUCCESS;
+}
+
+/* Gets the next chunk of data to write into out->d/out->nbytes,
+ * converting, scaling and resampling it if needed */
+static int fill_buffer(struct outstanding *out) {
+        size_t fs, data_size;
+        ka_sample_type_t type;
+        ka_bool_t convert;
+        int ret;
+
+        fs = ka_sound_file_frame_size(out->file);
+
+        /* With a low latency we read a period at a time, so that we
+         * don't spend longer reading than the device plays */
+        if (out->latency > 0 && out->period_size > 0 && out->period_size < BUFSIZE/fs)
+                data_size = out->period_size*fs;
+        else
+                data_size = (BUFSIZE/fs)*fs;
+
+        type = ka_sound_file_get_sample_type(out->file);
+        convert = !ka_dsp_volume_is_unity(out->volume) || out->resampler || out->remix;
+
+        for (;;) {
+                const void *src = NULL;
+                size_t n;
+
+                out->nbytes = data_size;
+
+                /* If possible, take the data straight from the file's
+                 * memory, avoiding a copy into our own buffer */
+                if (out->mapped) {
+                        if ((ret = ka_sound_file_map(out->file, &src, &out->nbytes)) == KA_ERROR_NOTSUPPORTED)
+                                out->mapped = FALSE;
+                        else if (ret < 0)
+                                return ret;
+                }
+
+                if (!out->mapped) {
+                        void **buf = convert ? &out->raw : &out->data;
+
+                        if (!*buf && !(*buf = ka_malloc(data_size)))
+                                return KA_ERROR_OOM;
+
+                        out->nbytes = data_size;
+
+                        if ((ret = ka_sound_file_read_arbitrary(out->file, *buf, &out->nbytes)) < 0)
+                                return ret;
+
+                        src = *buf;
                 }
 
-                if (nbytes <= 0) {
+                if (!convert) {
+                        out->d = src;
+                        return KA_SUCCESS;
+                }
 
-                        nbytes = data_size;
+                /* The device was opened for S16NE in this case */
+                if (type == KA_SAMPLE_U8) {
+                        if (!out->data && !(out->data = ka_malloc(BUFSIZE * sizeof(int16_t))))
+                                return KA_ERROR_OOM;
 
-                        if ((ret = ka_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
-                                goto finish;
+                        ka_dsp_to_s16ne(out->data, src, type, out->nbytes);
+                        out->nbytes *= sizeof(int16_t);
+                } else {
+                        if (!out->data && !(out->data = ka_malloc(BUFSIZE)))
+                                return KA_ERROR_OOM;
 
-                        d = data;
+                        ka_dsp_to_s16ne(out->data, src, type, out->nbytes / sizeof(int16_t));
                 }
 
-                if (nbytes <= 0) {
-                        snd_pcm_drain(out->pcm);
+                if (!ka_dsp_volume_is_unity(out->volume))
+                        ka_dsp_volume_s16(out->data, out->data, out->volume, out->nbytes / sizeof(int16_t));
+
+                out->d = out->data;
+                n = out->nbytes / (sizeof(int16_t) * ka_sound_file_get_nchannels(out->file));
+
+                if (out->remix) {
+                        if (n > out->remixed_size) {
+                                ka_free(out->remixed);
+                                out->remixed_size = 0;
+
+                                if (!(out->remixed = ka_new(int16_t, n * out->channels)))
+                                        return KA_ERROR_OOM;
+
+                                out->remixed_size = n;
+                        }
+
+                        ka_remix_run(out->remix, out->remixed, out->data, n);
+
+                        out->d = out->remixed;
+                        out->nbytes = n * out->frame_size;
+                }
+
+                if (!out->resampler)
+                        return KA_SUCCESS;
+
+                if ((ret = resample(out, out->d, n)) < 0)
+                        return ret;
+
+                out->d = out->rd;
+                out->nbytes = out->n_resampled * out->frame_size;
+
+                /* The resampler might have kept everything for
+                 * itself, in which case we need to read more */
+                if (out->nbytes > 0 || n <= 0)
+                        return KA_SUCCESS;
+        }
+}
+
+/* Returns 1 if the stream shall continue, KA_SUCCESS when it
+ * finished playing or an error code */
+static int stream_process(struct outstanding *out, struct pollfd *pfd) {
+        unsigned short revents;
+        snd_pcm_sframes_t sframes;
+        size_t fs;
+        int ret;
+
+        if (out->draining)
+                return snd_pcm_state(out->pcm) == SND_PCM_STATE_DRAINING ? 1 : KA_SUCCESS;
+
+        if ((ret = snd_pcm_poll_descriptors_revents(out->pcm, pfd, out->n_pfd, &revents)) < 0)
+                return translate_error(ret);
+
+        if (!revents)
+                return 1;
+
+        if (revents != POLLOUT) {
+
+                switch (snd_pcm_state(out->pcm)) {
+
+                case SND_PCM_STATE_XRUN:
+
+                        if ((ret = snd_pcm_recover(out->pcm, -EPIPE, 1)) != 0)
+                                return translate_error(ret);
+                        break;
+
+                case SND_PCM_STATE_SUSPENDED:
+
+                        if ((ret = snd_pcm_recover(out->pcm, -ESTRPIPE, 1)) != 0)
+                                return translate_error(ret);
+                        break;
+
+                default:
+
+                        snd_pcm_drop(out->pcm);
+
+                        if ((ret = snd_pcm_prepare(out->pcm)) < 0)
+                                return translate_error(ret);
                         break;
                 }
 
-                if ((sframes = snd_pcm_writei(out->pcm, d, nbytes/fs)) < 0) {
+                return 1;
+        }
+
+        fs = out->frame_size;
+
+        if (out->nbytes <= 0)
+                if ((ret = fill_buffer(out)) < 0)
+                        return ret;
+
+        if (out->nbytes <= 0) {
+
+                /* In non-blocking mode this only starts draining,
+                 * we check for completion on the next wakeups */
+                if ((ret = snd_pcm_drain(out->pcm)) == -EAGAIN) {
+                        out->draining = TRUE;
+                        return 1;
+                }
+
+                return ret < 0 ? translate_error(ret) : KA_SUCCESS;
+        }
+
+        if ((sframes = snd_pcm_writei(out->pcm, out->d, out->nbytes/fs)) < 0) {
+
+                if (sframes == -EAGAIN)
+                        return 1;
+
+                if ((ret = snd_pcm_recover(out->pcm, (int) sframes, 1)) < 0)
+                        return translate_error(ret);
+
+                return 1;
+        }
+
+        out->nbytes -= (size_t) sframes*fs;
+        out->d = (const uint8_t*) out->d + (size_t) sframes*fs;
+
+        return 1;
+}
+
+static int drain_timeout(struct outstanding *out) {
+        snd_pcm_sframes_t delay;
+
+        /* Not all PCMs wake us up when draining is complete, so we
+         * wake up ourselves when the remaining data should have
+         * been played */
+        if (snd_pcm_delay(out->pcm, &delay) < 0 || delay <= 0 || out->rate <= 0)
+                return 10;
+
+        return (int) ((uint64_t) delay * 1000 / out->rate) + 1;
+}
+
+static void stream_finish(struct private *p, struct outstanding *out, int ret) {
+        ka_bool_t call;
+
+        ka_mutex_lock(p->outstanding_mutex);
+        KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
+
+        if (out->worker)
+                out->worker->n_streams--;
+
+        ka_mutex_unlock(p->outstanding_mutex);
+
+        call = outstanding_kill(out);
+
+        if (call && out->callback)
+                out->callback(out->context, out->id, ret, out->userdata);
+
+        if (ret == KA_SUCCESS)
+                pool_put(p, out);
+
+        outstanding_free(out);
+}
+
+static int worker_reserve(struct worker *w, unsigned n_pfd, unsigned n_streams) {
+
+        if (n_pfd > w->n_pfd_allocated) {
+                struct pollfd *np;
+                unsigned k = n_pfd * 2;
 
-                        if ((ret = snd_pcm_recover(out->pcm, (int) sframes, 1)) < 0) {
-                                ret = translate_error(ret);
-                                goto finish;
+                if (!(np = ka_new(struct pollfd, k)))
+                        return KA_ERROR_OOM;
+
+                if (w->n_pfd_allocated > 0)
+                        memcpy(np, w->pfd, sizeof(struct pollfd) * w->n_pfd_allocated);
+
+                ka_free(w->pfd);
+                w->pfd = np;
+                w->n_pfd_allocated = k;
+        }
+
+        if (n_streams > w->n_streams_allocated) {
+                struct outstanding **ns;
+                unsigned k = n_streams * 2;
+
+                if (!(ns = ka_new(struct outstanding*, k)))
+                        return KA_ERROR_OOM;
+
+                if (w->n_streams_allocated > 0)
+                        memcpy(ns, w->streams, sizeof(struct outstanding*) * w->n_streams_allocated);
+
+                ka_free(w->streams);
+                w->streams = ns;
+                w->n_streams_allocated = k;
+        }
+
+        return KA_SUCCESS;
+}
+
+static void* worker_func(void *userdata) {
+        struct worker *w = userdata;
+        struct private *p = w->private;
+
+        for (;;) {
+                struct outstanding *out, *next;
+                KA_LLIST_HEAD(struct outstanding, dead);
+                unsigned n_pfd = 1, n_streams = 0, i;
+                int timeout = -1, ret;
+                ka_bool_t quit;
+
+                KA_LLIST_HEAD_INIT(struct outstanding, dead);
+
+                ka_mutex_lock(p->outstanding_mutex);
+
+                for (out = p->outstanding; out; out = next) {
+                        unsigned n;
+
+                        next = out->next;
+
+                        if (out->worker != w)
+                                continue;
+
+                        /* Canceled streams already had their
+                         * callback called, we just free them */
+                        if (outstanding_dead(out)) {
+                                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
+                                KA_LLIST_PREPEND(struct outstanding, dead, out);
+                                w->n_streams--;
+                                continue;
+                        }
+
+                        if ((ret = snd_pcm_poll_descriptors_count(out->pcm)) < 0)
+                                ret = 0;
+
+                        n = (unsigned) ret;
+
+                        if (worker_reserve(w, n_pfd + n, n_streams + 1) < 0) {
+
+                                if (outstanding_kill(out) && out->callback)
+                                        out->callback(out->context, out->id, KA_ERROR_OOM, out->userdata);
+
+                                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
+                                KA_LLIST_PREPEND(struct outstanding, dead, out);
+                                w->n_streams--;
+                                continue;
                         }
 
+                        if ((ret = snd_pcm_poll_descriptors(out->pcm, w->pfd + n_pfd, n)) < 0)
+                                ret = 0;
+
+                        out->pfd_index = n_pfd;
+                        out->n_pfd = (unsigned) ret;
+                        n_pfd += (unsigned) ret;
+                        w->streams[n_streams++] = out;
+
+                        if (out->draining) {
+                                int t = drain_timeout(out);
+
+                                if (timeout < 0 || t < timeout)
+                                        timeout = t;
+                        }
+                }
+
+                quit = w->quit;
+
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                while ((out = dead)) {
+                        KA_LLIST_REMOVE(struct outstanding, dead, out);
+                        pool_put(p, out);
+                        outstanding_free(out);
+                }
+
+                if (quit)
+                        break;
+
+                /* We also take care of closing unused pooled PCMs */
+                if ((ret = pool_timeout(p)) >= 0)
+                        if (timeout < 0 || ret < timeout)
+                                timeout = ret;
+
+                w->pfd[0].fd = ka_wakeup_fd(&w->wakeup);
+                w->pfd[0].events = POLLIN;
+                w->pfd[0].revents = 0;
+
+                if (poll(w->pfd, n_pfd, timeout) < 0) {
+
+                        if (errno == EINTR)
+                                continue;
+
+                        for (i = 0; i < n_streams; i++)
+                                stream_finish(p, w->streams[i], KA_ERROR_SYSTEM);
+
                         continue;
                 }
 
-                nbytes -= (size_t) sframes*fs;
-                d = (uint8_t*) d + (size_t) sframes*fs;
+                /* Somebody added or canceled a stream, or asked
+                 * us to terminate */
+                if (w->pfd[0].revents)
+                        ka_wakeup_clear(&w->wakeup);
+
+                pool_evict(p, FALSE);
+
+                for (i = 0; i < n_streams; i++) {
+                        out = w->streams[i];
+
+                        /* Don't feed streams that were canceled
+                         * while we slept, we free them right away */
+                        if (outstanding_dead(out))
+                                continue;
+
+                        if ((ret = stream_process(out, w->pfd + out->pfd_index)) <= 0)
+                                stream_finish(p, out, ret);
+                }
+        }
+
+        return NULL;
+}
+
+/* Picks the least loaded worker and makes sure it is running. Needs
+ * to be called with outstanding_mutex held */
+static int get_worker(struct private *p, struct worker **_w) {
+        struct worker *w = NULL;
+        unsigned i;
+
+        for (i = 0; i < N_WORKERS; i++)
+                if (!w || p->workers[i].n_streams < w->n_streams)
+                        w = &p->workers[i];
+
+        if (!w->running) {
+                if (pthread_create(&w->thread, NULL, worker_func, w) != 0)
+                        return KA_ERROR_OOM;
+
+                w->running = TRUE;
         }
 
-        ret = KA_SUCCESS;
+        *_w = w;
+        return KA_SUCCESS;
+}
 
-finish:
+/* Needs to be called with mixer_mutex held */
+static int mixer_open(ka_context *c, struct mixer *m, unsigned rate) {
+        struct private *p = m->private;
+        snd_pcm_t *pcm = NULL;
+        snd_pcm_hw_params_t *hwparams;
+        snd_pcm_uframes_t period_size;
+        unsigned buffer_time = MIX_BUFFER_USEC, period_time = MIX_PERIOD_USEC, r = rate, latency;
+        int ret;
 
-        ka_free(data);
-        ka_free(pfd);
+        snd_pcm_hw_params_alloca(&hwparams);
 
-        if (!out->dead)
-                if (out->callback)
-                        out->callback(out->context, out->id, ret, out->userdata);
+        /* The stream is shared, so only the context's latency
+         * counts */
+        if (ka_get_latency(c, NULL, &latency) >= 0 && latency > 0) {
+                buffer_time = latency;
+                period_time = latency / N_PERIODS;
+        }
+
+        if ((ret = snd_pcm_open(&pcm, c->device ? c->device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_any(pcm, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_format(pcm, hwparams, sample_type_table[KA_SAMPLE_S16NE])) < 0)
+                goto finish;
+
+        /* Sounds in other rates are resampled by us */
+        if ((ret = snd_pcm_hw_params_set_rate_resample(pcm, hwparams, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_rate_near(pcm, hwparams, &r, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_channels(pcm, hwparams, MIX_CHANNELS)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_buffer_time_near(pcm, hwparams, &buffer_time, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_set_period_time_near(pcm, hwparams, &period_time, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params(pcm, hwparams)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_hw_params_get_period_size(hwparams, &period_size, 0)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_prepare(pcm)) < 0)
+                goto finish;
+
+        if ((ret = snd_pcm_nonblock(pcm, 1)) < 0)
+                goto finish;
+
+        if (period_size != m->period_size || !m->sum) {
+                ka_free(m->sum);
+                ka_free(m->buffer);
+                ka_free(m->scratch);
+
+                m->sum = ka_new(float, period_size * MIX_CHANNELS);
+                m->buffer = ka_new(int16_t, period_size * MIX_CHANNELS);
+                m->scratch = ka_new(int16_t, period_size * MIX_CHANNELS);
+
+                if (!m->sum || !m->buffer || !m->scratch) {
+                        ka_free(m->sum);
+                        ka_free(m->buffer);
+                        ka_free(m->scratch);
+                        m->sum = NULL;
+                        m->buffer = m->scratch = NULL;
+
+                        snd_pcm_close(pcm);
+                        return KA_ERROR_OOM;
+                }
+        }
 
         ka_mutex_lock(p->outstanding_mutex);
+        m->pcm = pcm;
+        m->rate = r;
+        m->period_size = period_size;
+        ka_mutex_unlock(p->outstanding_mutex);
 
-        KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        return KA_SUCCESS;
 
-        if (!p->outstanding && p->signal_semaphore)
-                sem_post(&p->semaphore);
+finish:
 
-        outstanding_free(out);
+        if (pcm)
+                snd_pcm_close(pcm);
+
+        return translate_error(ret);
+}
+
+/* Closes the stream if no sound was added in the meantime. Returns
+ * TRUE if it was closed. */
+static ka_bool_t mixer_close_idle(struct mixer *m) {
+        struct private *p = m->private;
+        struct outstanding *out;
+        snd_pcm_t *pcm = NULL;
+
+        ka_mutex_lock(p->mixer_mutex);
+        ka_mutex_lock(p->outstanding_mutex);
+
+        for (out = p->outstanding; out; out = out->next)
+                if (out->mixed)
+                        break;
+
+        if (!out) {
+                pcm = m->pcm;
+                m->pcm = NULL;
+                m->stale = FALSE;
+        }
 
         ka_mutex_unlock(p->outstanding_mutex);
+        ka_mutex_unlock(p->mixer_mutex);
+
+        if (!pcm)
+                return FALSE;
+
+        snd_pcm_close(pcm);
+        return TRUE;
+}
+
+static int mixer_reserve(struct mixer *m, unsigned n_pfd, unsigned n_voices) {
+
+        if (n_pfd > m->n_pfd_allocated) {
+                struct pollfd *np;
+                unsigned k = n_pfd * 2;
+
+                if (!(np = ka_new(struct pollfd, k)))
+                        return KA_ERROR_OOM;
+
+                if (m->n_pfd_allocated > 0)
+                        memcpy(np, m->pfd, sizeof(struct pollfd) * m->n_pfd_allocated);
+
+                ka_free(m->pfd);
+                m->pfd = np;
+                m->n_pfd_allocated = k;
+        }
+
+        if (n_voices > m->n_voices_allocated) {
+                struct outstanding **nv;
+                unsigned k = n_voices * 2;
+
+                if (!(nv = ka_new(struct outstanding*, k)))
+                        return KA_ERROR_OOM;
+
+                if (m->n_voices_allocated > 0)
+                        memcpy(nv, m->voices, sizeof(struct outstanding*) * m->n_voices_allocated);
+
+                ka_free(m->voices);
+                m->voices = nv;
+                m->n_voices_allocated = k;
+        }
+
+        return KA_SUCCESS;
+}
+
+/* Adds up to n frames of the sound to the mix. Returns the number of
+ * frames added, which is less than n at the end of the file, or an
+ * error code. */
+static int mix_voice(struct mixer *m, struct outstanding *out, size_t n) {
+        unsigned nchannels = ka_sound_file_get_nchannels(out->file);
+        ka_sample_type_t type = ka_sound_file_get_sample_type(out->file);
+        size_t done = 0;
+
+        while (done < n) {
+                const int16_t *s;
+                size_t k, i;
+                int ret;
+
+                if (out->n_resampled > 0) {
+
+                        /* Resampled data is left from last time */
+                        k = KA_MIN(out->n_resampled, n - done);
+                        s = out->rd;
+
+                        out->rd += k * nchannels;
+                        out->n_resampled -= k;
+                } else {
+                        k = (n - done) * nchannels;
+
+                        if (type == KA_SAMPLE_U8)
+                                ret = ka_sound_file_read_uint8(out->file, (uint8_t*) m->scratch, &k);
+                        else
+                                ret = ka_sound_file_read_int16(out->file, m->scratch, &k);
+
+                        if (ret < 0)
+                                return ret;
+
+                        if (k > 0)
+                                ka_dsp_to_s16ne(m->buffer, m->scratch, type, k);
+
+                        k /= nchannels;
+
+                        if (out->resampler) {
+                                if ((ret = resample(out, m->buffer, k)) < 0)
+                                        return ret;
+
+                                if (k <= 0 && out->n_resampled <= 0)
+                                        break;
+
+                                continue;
+                        }
+
+                        if (k <= 0)
+                                break;
+
+                        s = m->buffer;
+                }
+
+                /* Upmix, back to front so that it works in place */
+                if (nchannels == 1) {
+                        for (i = k; i > 0; i--)
+                                m->buffer[i*2-1] = m->buffer[i*2-2] = s[i-1];
+
+                        s = m->buffer;
+                }
+
+                ka_dsp_mix_s16(m->sum + done * MIX_CHANNELS, s, out->volume, k * MIX_CHANNELS);
+
+                done += k;
+        }
+
+        return (int) done;
+}
+
+static void mixer_write(struct mixer *m, unsigned n_voices) {
+        struct private *p = m->private;
+        snd_pcm_sframes_t avail, sframes;
+        size_t n;
+        unsigned j;
+
+        if ((avail = snd_pcm_avail_update(m->pcm)) < 0) {
+                snd_pcm_recover(m->pcm, (int) avail, 1);
+                return;
+        }
+
+        if ((n = (size_t) avail) > m->period_size)
+                n = m->period_size;
+
+        if (n <= 0)
+                return;
+
+        memset(m->sum, 0, sizeof(float) * n * MIX_CHANNELS);
+
+        for (j = 0; j < n_voices; j++) {
+                struct outstanding *out = m->voices[j];
+                int ret;
+
+                /* Canceled since we collected the voices, the
+                 * application has been told already */
+                if (outstanding_dead(out))
+                        continue;
+
+                /* A sound is reported as finished when its last
+                 * samples have been mixed, not when they have been
+                 * played back. */
+                if ((ret = mix_voice(m, out, n)) < 0)
+                        stream_finish(p, out, ret);
+                else if ((size_t) ret < n)
+                        stream_finish(p, out, KA_SUCCESS);
+        }
+
+        ka_dsp_f32_to_s16(m->buffer, m->sum, n * MIX_CHANNELS);
+
+        if ((sframes = snd_pcm_writei(m->pcm, m->buffer, n)) < 0 && sframes != -EAGAIN)
+                snd_pcm_recover(m->pcm, (int) sframes, 1);
+}
+
+static void* mixer_func(void *userdata) {
+        struct mixer *m = userdata;
+        struct private *p = m->private;
+        uint64_t idle_since = 0;
+
+        for (;;) {
+                struct outstanding *out, *next;
+                KA_LLIST_HEAD(struct outstanding, dead);
+                unsigned n_pfd = 1, n_voices = 0, n;
+                unsigned short revents;
+                int timeout = -1, ret;
+                ka_bool_t quit, stale;
+                snd_pcm_t *pcm;
+
+                KA_LLIST_HEAD_INIT(struct outstanding, dead);
+
+                ka_mutex_lock(p->outstanding_mutex);
+
+                for (out = p->outstanding; out; out = next) {
+                        next = out->next;
+
+                        if (!out->mixed)
+                                continue;
+
+                        if (!outstanding_dead(out) && mixer_reserve(m, 1, n_voices + 1) < 0) {
+
+                                if (outstanding_kill(out) && out->callback)
+                                        out->callback(out->context, out->id, KA_ERROR_OOM, out->userdata);
+                        }
+
+                        /* Canceled sounds already had their callback
+                         * called, we just free them */
+                        if (outstanding_dead(out)) {
+                                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
+                                KA_LLIST_PREPEND(struct outstanding, dead, out);
+                                continue;
+                        }
+
+                        m->voices[n_voices++] = out;
+                }
+
+                quit = m->quit;
+                pcm = m->pcm;
+                stale = m->stale;
+
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                while ((out = dead)) {
+                        KA_LLIST_REMOVE(struct outstanding, dead, out);
+                        outstanding_free(out);
+                }
+
+                if (quit)
+                        break;
+
+                if (pcm && n_voices <= 0) {
+                        uint64_t now = now_usec();
+
+                        if (idle_since <= 0)
+                                idle_since = now;
+
+                        /* A stream on the old device we close right
+                         * away */
+                        if (stale || now >= idle_since + MIX_IDLE_USEC) {
+                                if (mixer_close_idle(m))
+                                        idle_since = 0;
+                                continue;
+                        }
+
+                        timeout = (int) ((idle_since + MIX_IDLE_USEC - now) / 1000ULL) + 1;
+                } else
+                        idle_since = 0;
+
+                /* While nothing is playing we let the stream run
+                 * dry and only wait for new sounds */
+                if (pcm && n_voices > 0) {
+                        if ((ret = snd_pcm_poll_descriptors_count(pcm)) < 0)
+                                ret = 0;
+
+                        n = (unsigned) ret;
+
+                        if (mixer_reserve(m, n_pfd + n, 0) >= 0 &&
+                            (ret = snd_pcm_poll_descriptors(pcm, m->pfd + 1, n)) > 0)
+                                n_pfd += (unsigned) ret;
+                } else if (mixer_reserve(m, 1, 0) < 0) {
+                        usleep(MIX_PERIOD_USEC);
+                        continue;
+                }
+
+                m->pfd[0].fd = ka_wakeup_fd(&m->wakeup);
+                m->pfd[0].events = POLLIN;
+                m->pfd[0].revents = 0;
+
+                /* Don't hang if the stream gave us nothing to wait on */
+                if (n_pfd <= 1 && n_voices > 0)
+                        timeout = (int) (MIX_PERIOD_USEC / 1000U);
+
+                if (poll(m->pfd, n_pfd, timeout) < 0) {
+
+                        if (errno == EINTR)
+                                continue;
+
+                        for (n = 0; n < n_voices; n++)
+                                stream_finish(p, m->voices[n], KA_ERROR_SYSTEM);
+
+                        continue;
+                }
+
+                /* Somebody added or canceled a sound, or asked us to
+                 * terminate */
+                if (m->pfd[0].revents)
+                        ka_wakeup_clear(&m->wakeup);
+
+                if (n_pfd <= 1)
+                        continue;
+
+                if (snd_pcm_poll_descriptors_revents(pcm, m->pfd + 1, n_pfd - 1, &revents) < 0 || !revents)
+                        continue;
+
+                if (revents != POLLOUT) {
+
+                        /* Most likely the stream ran dry while we
+                         * were idle */
+                        switch (snd_pcm_state(pcm)) {
+
+                        case SND_PCM_STATE_XRUN:
+                                snd_pcm_recover(pcm, -EPIPE, 1);
+                                break;
+
+                        case SND_PCM_STATE_SUSPENDED:
+                                snd_pcm_recover(pcm, -ESTRPIPE, 1);
+                                break;
+
+                        default:
+                                snd_pcm_drop(pcm);
+                                snd_pcm_prepare(pcm);
+                                break;
+                        }
+
+                        continue;
+                }
+
+                mixer_write(m, n_voices);
+        }
+
+        /* Let the last sounds play out before we close the stream */
+        if (m->pcm) {
+                snd_pcm_nonblock(m->pcm, 0);
+                snd_pcm_drain(m->pcm);
+        }
 
         return NULL;
 }
 
+/* Hands the sound to the mixer, opening the stream if needed. Returns
+ * KA_ERROR_NOTSUPPORTED if the sound needs to be played on a stream
+ * of its own. */
+static int mixer_add(ka_context *c, struct outstanding *out) {
+        struct private *p = PRIVATE(c);
+        struct mixer *m = &p->mixer;
+        unsigned rate;
+        int ret;
+
+        /* Forced channels are remixed on a stream of their own */
+        if (ka_sound_file_get_nchannels(out->file) > MIX_CHANNELS || out->forced)
+                return KA_ERROR_NOTSUPPORTED;
+
+        rate = ka_sound_file_get_rate(out->file);
+        out->channels = ka_sound_file_get_nchannels(out->file);
+
+        ka_mutex_lock(p->mixer_mutex);
+
+        /* Until the stream on the old device is closed, sounds get
+         * streams of their own on the new one */
+        if (m->stale) {
+                ret = KA_ERROR_NOTSUPPORTED;
+                goto finish;
+        }
+
+        if (!m->pcm)
+                if ((ret = mixer_open(c, m, rate)) < 0)
+                        goto finish;
+
+        /* The stream stays at the rate it was opened at */
+        if (m->rate != rate)
+                if ((ret = ka_resampler_new(&out->resampler, ka_sound_file_get_nchannels(out->file), rate, m->rate, out->quality)) < 0)
+                        goto finish;
+
+        if (!m->running) {
+                if (pthread_create(&m->thread, NULL, mixer_func, m) != 0) {
+                        ret = KA_ERROR_OOM;
+                        goto finish;
+                }
+
+                m->running = TRUE;
+        }
+
+        ka_mutex_lock(p->outstanding_mutex);
+        out->mixed = TRUE;
+        KA_IDMAP_LINK(struct outstanding, p->outstanding, p->ids, out);
+        ka_mutex_unlock(p->outstanding_mutex);
+
+        ka_wakeup_signal(&m->wakeup);
+
+        ret = KA_SUCCESS;
+
+finish:
+        ka_mutex_unlock(p->mixer_mutex);
+
+        return ret;
+}
+
 int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_callback_t cb, void *userdata) {
         struct private *p;
         struct outstanding *out = NULL;
+        ka_cache_control_t cache_control = KA_CACHE_CONTROL_NEVER;
+        ka_wakeup *w;
+        char *sp;
         int ret;
-        pthread_t thread;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
@@ -448,34 +1948,63 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
         out->id = id;
         out->callback = cb;
         out->userdata = userdata;
-        out->pipe_fd[0] = out->pipe_fd[1] = -1;
+        out->mapped = TRUE;
 
-        if (pipe(out->pipe_fd) < 0) {
-                ret = KA_ERROR_SYSTEM;
+        if ((ret = get_cache_control(proplist, &cache_control)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_volume(c, proplist, &out->volume)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_resample_quality(c, proplist, &out->quality)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_latency(c, proplist, &out->latency)) < 0)
+                goto finish;
+
+        if ((ret = get_force_channel(proplist, &out->forced, &out->force_channel)) < 0)
                 goto finish;
-        }
 
-        if ((ret = ka_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
+        if ((ret = ka_lookup_sound(&out->file, &sp, &p->theme, c->props, proplist)) < 0)
                 goto finish;
 
+        /* Play from the decoded sample cache if we are allowed to */
+        if (sp && cache_control != KA_CACHE_CONTROL_NEVER) {
+                ret = ka_sample_cache_get(p->samples, &out->file, sp, cache_control);
+                ka_free(sp);
+
+                /* Whatever kept the sound out of the cache, we can
+                 * still stream it, unless the file couldn't even be
+                 * opened again */
+                if (ret < 0 && !out->file)
+                        goto finish;
+        } else
+                ka_free(sp);
+
+        if (p->software_mix) {
+                if ((ret = mixer_add(c, out)) != KA_ERROR_NOTSUPPORTED)
+                        goto finish;
+        }
+
         if ((ret = open_alsa(c, out)) < 0)
                 goto finish;
 
-        /* OK, we're ready to go, so let's add this to our list */
+        /* OK, we're ready to go, so let's hand this to a worker */
         ka_mutex_lock(p->outstanding_mutex);
-        KA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
-        ka_mutex_unlock(p->outstanding_mutex);
-
-        if (pthread_create(&thread, NULL, thread_func, out) < 0) {
-                ret = KA_ERROR_OOM;
 
-                ka_mutex_lock(p->outstanding_mutex);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        if ((ret = get_worker(p, &out->worker)) < 0) {
                 ka_mutex_unlock(p->outstanding_mutex);
-
                 goto finish;
         }
 
+        KA_IDMAP_LINK(struct outstanding, p->outstanding, p->ids, out);
+        out->worker->n_streams++;
+        w = &out->worker->wakeup;
+
+        ka_mutex_unlock(p->outstanding_mutex);
+
+        ka_wakeup_signal(w);
+
         ret = KA_SUCCESS;
 
 finish:
@@ -489,7 +2018,9 @@ finish:
 
 int driver_cancel(ka_context *c, uint32_t id) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
+        ka_wakeup *wake[N_WORKERS + 1];
+        unsigned n_wake = 0, i;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -498,34 +2029,39 @@ int driver_cancel(ka_context *c, uint32_t id) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
+                ka_wakeup *w;
 
-                if (out->id != id)
+                if (!outstanding_kill(out))
                         continue;
 
-                if (out->dead)
-                        continue;
-
-                out->dead = TRUE;
-
                 if (out->callback)
                         out->callback(c, out->id, KA_ERROR_CANCELED, out->userdata);
 
-                /* This will cause the thread to wakeup and terminate */
-                if (out->pipe_fd[1] >= 0) {
-                        close(out->pipe_fd[1]);
-                        out->pipe_fd[1] = -1;
-                }
+                /* Remember whom to wake up, once for each of them */
+                w = outstanding_wakeup(p, out);
+
+                for (i = 0; i < n_wake; i++)
+                        if (wake[i] == w)
+                                break;
+
+                if (i >= n_wake)
+                        wake[n_wake++] = w;
         }
 
         ka_mutex_unlock(p->outstanding_mutex);
 
+        /* This will cause the workers to wakeup and free the streams */
+        for (i = 0; i < n_wake; i++)
+                ka_wakeup_signal(wake[i]);
+
         return KA_SUCCESS;
 }
 
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -537,10 +2073,9 @@ int driver_playing(ka_context *c, uint32_t id, int *playing) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
 
-                if (out->dead ||
-                    out->id != id)
+                if (outstanding_dead(KA_IDMAP_ITEM(e, struct outstanding, by_id)))
                         continue;
 
                 *playing = 1;
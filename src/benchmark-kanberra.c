@@ -0,0 +1,510 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kanberra.h"
+#include "macro.h"
+#include "malloc.h"
+#include "sound-theme-spec.h"
+
+/* Drives the play hot path against the null driver and a generated
+ * sound theme, so that the numbers reflect libkanberra itself and
+ * not the sound system behind it. */
+
+#define THEME_NAME "benchmark"
+#define N_SOUNDS_DEFAULT 16
+#define N_ITERATIONS_DEFAULT 100000
+
+#ifdef __GLIBC__
+
+/* Count allocations per thread by interposing the allocator. glibc
+ * routes its own internal allocations through these symbols too. */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread unsigned long n_allocs = 0;
+
+void *malloc(size_t size) {
+        n_allocs++;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+        n_allocs++;
+        return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+        n_allocs++;
+        return __libc_realloc(ptr, size);
+}
+
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long n_allocs = 0;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+struct benchmark;
+
+struct worker {
+        const struct benchmark *b;
+        unsigned index;
+        ka_theme_data *theme;
+        ka_proplist *cp;
+        ka_proplist *sp;
+        uint64_t *samples;
+        unsigned long allocs;
+        unsigned long failures;
+        int last_error;
+};
+
+struct benchmark {
+        const char *name;
+        int (*prepare)(struct worker *w);
+        int (*run)(struct worker *w, unsigned i);
+};
+
+static ka_context *context = NULL;
+static char *theme_dir = NULL;
+static unsigned n_sounds = N_SOUNDS_DEFAULT;
+static unsigned n_iterations = N_ITERATIONS_DEFAULT;
+static unsigned n_threads = 1;
+
+static uint64_t now_nsec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void sound_name(char *buf, size_t l, unsigned i) {
+        snprintf(buf, l, "benchmark-%u", i % n_sounds);
+}
+
+static uint32_t sound_id(const struct worker *w, unsigned i) {
+        return (w->index << 24) | (i & 0xFFFFFFU);
+}
+
+static int write_wav(const char *fn) {
+        /* A short 16 bit mono file, 10ms at 44.1kHz */
+        static const unsigned n_frames = 441;
+        uint8_t header[44];
+        uint32_t data_size = n_frames * 2;
+        FILE *f;
+        unsigned k;
+
+        memcpy(header, "RIFF", 4);
+        header[4] = (uint8_t) (36 + data_size); header[5] = (uint8_t) ((36 + data_size) >> 8);
+        header[6] = 0; header[7] = 0;
+        memcpy(header + 8, "WAVEfmt ", 8);
+        header[16] = 16; header[17] = 0; header[18] = 0; header[19] = 0;
+        header[20] = 1; header[21] = 0;                         /* PCM */
+        header[22] = 1; header[23] = 0;                         /* mono */
+        header[24] = 0x44; header[25] = 0xAC; header[26] = 0; header[27] = 0;   /* 44100 */
+        header[28] = 0x88; header[29] = 0x58; header[30] = 1; header[31] = 0;   /* 88200 */
+        header[32] = 2; header[33] = 0;                         /* block align */
+        header[34] = 16; header[35] = 0;                        /* bits */
+        memcpy(header + 36, "data", 4);
+        header[40] = (uint8_t) data_size; header[41] = (uint8_t) (data_size >> 8);
+        header[42] = 0; header[43] = 0;
+
+        if (!(f = fopen(fn, "w")))
+                return -1;
+
+        fwrite(header, sizeof(header), 1, f);
+        for (k = 0; k < n_frames; k++) {
+                int16_t s = (int16_t) ((k % 100) * 300 - 15000);
+                uint8_t b[2] = { (uint8_t) s, (uint8_t) ((uint16_t) s >> 8) };
+                fwrite(b, sizeof(b), 1, f);
+        }
+
+        if (fclose(f) != 0)
+                return -1;
+
+        return 0;
+}
+
+static int create_theme(void) {
+        char fn[PATH_MAX];
+        FILE *f;
+        unsigned i;
+
+        if (!(theme_dir = ka_strdup("/tmp/kanberra-benchmark-XXXXXX")))
+                return -1;
+
+        if (!mkdtemp(theme_dir))
+                return -1;
+
+        snprintf(fn, sizeof(fn), "%s/sounds", theme_dir);
+        if (mkdir(fn, 0755) < 0)
+                return -1;
+        snprintf(fn, sizeof(fn), "%s/sounds/" THEME_NAME, theme_dir);
+        if (mkdir(fn, 0755) < 0)
+                return -1;
+        snprintf(fn, sizeof(fn), "%s/sounds/" THEME_NAME "/stereo", theme_dir);
+        if (mkdir(fn, 0755) < 0)
+                return -1;
+
+        snprintf(fn, sizeof(fn), "%s/sounds/" THEME_NAME "/index.theme", theme_dir);
+        if (!(f = fopen(fn, "w")))
+                return -1;
+        fputs("[Sound Theme]\n"
+              "Name=Benchmark\n"
+              "Directories=stereo\n"
+              "\n"
+              "[stereo]\n"
+              "OutputProfile=stereo\n", f);
+        if (fclose(f) != 0)
+                return -1;
+
+        for (i = 0; i < n_sounds; i++) {
+                snprintf(fn, sizeof(fn), "%s/sounds/" THEME_NAME "/stereo/benchmark-%u.wav", theme_dir, i);
+                if (write_wav(fn) < 0)
+                        return -1;
+        }
+
+        /* Point all lookups and the lookup cache at the temporary
+         * tree, so that the results do not depend on what is
+         * installed on this machine. */
+        setenv("XDG_DATA_DIRS", theme_dir, 1);
+        snprintf(fn, sizeof(fn), "%s/home", theme_dir);
+        setenv("XDG_DATA_HOME", fn, 1);
+        snprintf(fn, sizeof(fn), "%s/cache", theme_dir);
+        setenv("XDG_CACHE_HOME", fn, 1);
+
+        return 0;
+}
+
+static int remove_one(const char *fn, const struct stat *st GNUC_UNUSED, int flag GNUC_UNUSED, struct FTW *ftw GNUC_UNUSED) {
+        return remove(fn);
+}
+
+static void remove_theme(void) {
+        if (!theme_dir)
+                return;
+
+        nftw(theme_dir, remove_one, 16, FTW_DEPTH|FTW_PHYS);
+        ka_free(theme_dir);
+        theme_dir = NULL;
+}
+
+static int prepare_lookup(struct worker *w) {
+        int ret;
+
+        if ((ret = ka_proplist_create(&w->cp)) < 0)
+                return ret;
+        if ((ret = ka_proplist_sets(w->cp, KA_PROP_KANBERRA_XDG_THEME_NAME, THEME_NAME)) < 0)
+                return ret;
+        if ((ret = ka_proplist_sets(w->cp, KA_PROP_KANBERRA_XDG_THEME_OUTPUT_PROFILE, "stereo")) < 0)
+                return ret;
+
+        return ka_proplist_create(&w->sp);
+}
+
+static int run_lookup(struct worker *w, unsigned i) {
+        ka_sound_file *f = NULL;
+        char *path = NULL;
+        char name[64];
+        int ret;
+
+        sound_name(name, sizeof(name), i);
+
+        if ((ret = ka_proplist_sets(w->sp, KA_PROP_EVENT_ID, name)) < 0)
+                return ret;
+
+        if ((ret = ka_lookup_sound(&f, &path, &w->theme, w->cp, w->sp)) < 0)
+                return ret;
+
+        ka_sound_file_close(f);
+        ka_free(path);
+
+        return KA_SUCCESS;
+}
+
+static int run_play(struct worker *w, unsigned i) {
+        char name[64];
+
+        sound_name(name, sizeof(name), i);
+
+        return ka_context_play(context, sound_id(w, i),
+                               KA_PROP_EVENT_ID, name,
+                               NULL);
+}
+
+static int run_cache(struct worker *w GNUC_UNUSED, unsigned i) {
+        char name[64];
+
+        sound_name(name, sizeof(name), i);
+
+        return ka_context_cache(context,
+                                KA_PROP_EVENT_ID, name,
+                                NULL);
+}
+
+static int run_cancel(struct worker *w, unsigned i) {
+        return ka_context_cancel(context, sound_id(w, i));
+}
+
+static const struct benchmark benchmarks[] = {
+        { "ka_lookup_sound",  prepare_lookup, run_lookup },
+        { "ka_context_play",  NULL,           run_play },
+        { "ka_context_cache", NULL,           run_cache },
+        { "ka_context_cancel", NULL,          run_cancel },
+};
+
+static void *worker_func(void *userdata) {
+        struct worker *w = userdata;
+        unsigned long allocs;
+        unsigned i;
+        int ret;
+
+        if (w->b->prepare && (ret = w->b->prepare(w)) < 0) {
+                w->last_error = ret;
+                w->failures = n_iterations;
+                return NULL;
+        }
+
+        /* Warm up caches once, outside of the measurement */
+        if ((ret = w->b->run(w, 0)) < 0)
+                w->last_error = ret;
+
+        allocs = n_allocs;
+
+        for (i = 0; i < n_iterations; i++) {
+                uint64_t start = now_nsec();
+
+                if ((ret = w->b->run(w, i)) < 0) {
+                        w->failures++;
+                        w->last_error = ret;
+                }
+
+                w->samples[i] = now_nsec() - start;
+        }
+
+        w->allocs = n_allocs - allocs;
+
+        return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+        return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int run_benchmark(const struct benchmark *b) {
+        struct worker *workers;
+        uint64_t *samples, start, elapsed;
+        unsigned long allocs = 0, failures = 0;
+        size_t n_samples = (size_t) n_iterations * n_threads;
+        int last_error = KA_SUCCESS, ret = -1;
+        unsigned i;
+
+        if (!(workers = ka_new0(struct worker, n_threads)))
+                return -1;
+
+        if (!(samples = ka_new(uint64_t, n_samples))) {
+                ka_free(workers);
+                return -1;
+        }
+
+        for (i = 0; i < n_threads; i++) {
+                workers[i].b = b;
+                workers[i].index = i;
+                workers[i].samples = samples + (size_t) i * n_iterations;
+        }
+
+        start = now_nsec();
+
+        if (n_threads == 1)
+                worker_func(workers);
+        else {
+                pthread_t *threads;
+
+                if (!(threads = ka_new(pthread_t, n_threads)))
+                        goto finish;
+
+                for (i = 0; i < n_threads; i++)
+                        if (pthread_create(&threads[i], NULL, worker_func, &workers[i]) != 0) {
+                                fprintf(stderr, "Failed to create thread.\n");
+                                abort();
+                        }
+
+                for (i = 0; i < n_threads; i++)
+                        pthread_join(threads[i], NULL);
+
+                ka_free(threads);
+        }
+
+        elapsed = now_nsec() - start;
+
+        for (i = 0; i < n_threads; i++) {
+                allocs += workers[i].allocs;
+                failures += workers[i].failures;
+                if (workers[i].last_error < 0)
+                        last_error = workers[i].last_error;
+        }
+
+        qsort(samples, n_samples, sizeof(uint64_t), compare_samples);
+
+        printf("%-18s %12.0f %10.3f %10.3f ",
+               b->name,
+               (double) n_samples * 1000000000.0 / (double) (elapsed > 0 ? elapsed : 1),
+               (double) samples[n_samples / 2] / 1000.0,
+               (double) samples[n_samples * 99 / 100] / 1000.0);
+
+        if (HAVE_ALLOC_COUNT)
+                printf("%10.2f", (double) allocs / (double) n_samples);
+        else
+                printf("%10s", "n/a");
+
+        if (failures > 0)
+                printf("  (%lu failed: %s)", failures, ka_strerror(last_error));
+
+        printf("\n");
+
+        ret = 0;
+
+finish:
+        for (i = 0; i < n_threads; i++) {
+                if (workers[i].theme)
+                        ka_theme_data_free(workers[i].theme);
+                if (workers[i].cp)
+                        ka_proplist_destroy(workers[i].cp);
+                if (workers[i].sp)
+                        ka_proplist_destroy(workers[i].sp);
+        }
+
+        ka_free(samples);
+        ka_free(workers);
+
+        return ret;
+}
+
+static void usage(const char *argv0) {
+        unsigned i;
+
+        fprintf(stderr,
+                "%s [-n ITERATIONS] [-t THREADS] [-s SOUNDS] [BENCHMARK...]\n\n"
+                "Available benchmarks:", argv0);
+
+        for (i = 0; i < KA_ELEMENTSOF(benchmarks); i++)
+                fprintf(stderr, " %s", benchmarks[i].name);
+
+        fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+        int ret, c, r = 1;
+        unsigned i;
+
+        while ((c = getopt(argc, argv, "n:t:s:h")) >= 0) {
+                switch (c) {
+                case 'n':
+                        n_iterations = (unsigned) strtoul(optarg, NULL, 10);
+                        break;
+                case 't':
+                        n_threads = (unsigned) strtoul(optarg, NULL, 10);
+                        break;
+                case 's':
+                        n_sounds = (unsigned) strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return c == 'h' ? 0 : 1;
+                }
+        }
+
+        if (n_iterations <= 0 || n_threads <= 0 || n_threads > 255 || n_sounds <= 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (create_theme() < 0) {
+                fprintf(stderr, "Failed to create sound theme: %s\n", strerror(errno));
+                goto finish;
+        }
+
+        if ((ret = ka_context_create(&context)) < 0) {
+                fprintf(stderr, "create: %s\n", ka_strerror(ret));
+                goto finish;
+        }
+
+        if ((ret = ka_context_set_driver(context, "null")) < 0 ||
+            (ret = ka_context_change_props(context,
+                                           KA_PROP_APPLICATION_NAME, "libkanberra benchmark",
+                                           KA_PROP_KANBERRA_XDG_THEME_NAME, THEME_NAME,
+                                           NULL)) < 0 ||
+            (ret = ka_context_open(context)) < 0) {
+                fprintf(stderr, "open: %s\n", ka_strerror(ret));
+                goto finish;
+        }
+
+        printf("%u iterations, %u thread(s), %u sound(s)\n\n", n_iterations, n_threads, n_sounds);
+        printf("%-18s %12s %10s %10s %10s\n", "benchmark", "ops/sec", "p50 (us)", "p99 (us)", "allocs/op");
+
+        for (i = 0; i < KA_ELEMENTSOF(benchmarks); i++) {
+                int k;
+
+                if (optind < argc) {
+                        for (k = optind; k < argc; k++)
+                                if (ka_streq(argv[k], benchmarks[i].name))
+                                        break;
+
+                        if (k >= argc)
+                                continue;
+                }
+
+                if (run_benchmark(&benchmarks[i]) < 0) {
+                        fprintf(stderr, "Out of memory.\n");
+                        goto finish;
+                }
+        }
+
+        r = 0;
+
+finish:
+        if (context)
+                ka_context_destroy(context);
+
+        remove_theme();
+
+        return r;
+}
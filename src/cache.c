@@ -32,26 +32,165 @@
 #include <pthread.h>
 #include <errno.h>
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#endif
+
 #include <tdb.h>
 
 #include "malloc.h"
 #include "macro.h"
 #include "mutex.h"
+#include "llist.h"
 #include "kanberra.h"
 #include "sound-theme-spec.h"
 #include "cache.h"
+#include "wakeup.h"
 
 #define FILENAME "event-sound-cache.tdb"
 #define UPDATE_INTERVAL 10
 
+#define N_FRONT_SHARDS 16
+#define N_FRONT_ENTRIES_MAX 64
+#define FRONT_PATH_MAX 1024
+#define WRITE_BACK_DELAY_USEC 200000
+
 /* This part is not portable due to pthread_once usage, should be abstracted
  * when we port this to platforms that do not have POSIX threading */
 
 static ka_mutex *mutex = NULL;
+static pid_t mutex_pid = 0;
+
+/* The database itself is protected by db_mutex, which is held while
+ * changes are written back. Lookups only ever try to take it, so that
+ * they never wait for the disk. */
+static ka_mutex *db_mutex = NULL;
 static struct tdb_context *database = NULL;
 
+/* Both protected by change_mutex */
+static ka_mutex *change_mutex = NULL;
+static time_t theme_last_check = 0, theme_last_change = 0;
+
+/* What get_last_change() found last, and until when that may be used
+ * without checking again. While the watch thread runs it keeps this
+ * valid forever. Both are accessed atomically, so that cache hits can
+ * read them without taking change_mutex. */
+static uint32_t published_change = 0, published_change_until = 0;
+
+#define LAST_CHANGE_FOREVER ((uint32_t) -1)
+
+/* Changes to the database are queued and written back in batches
+ * from a background thread, so that callers never wait for the disk.
+ * All of this is protected by mutex. The batch that is currently
+ * being written is kept in flushing, so that lookups can still see
+ * it. */
+
+typedef struct pending_write pending_write;
+
+struct pending_write {
+        KA_LLIST_FIELDS(pending_write);
+
+        /* Both point into the same allocation. data is NULL if the
+         * entry shall be removed. */
+        void *key;
+        size_t klen;
+        void *data;
+        size_t dlen;
+};
+
+static KA_LLIST_HEAD(pending_write, pending);
+static KA_LLIST_HEAD(pending_write, flushing);
+static ka_cond *writer_cond = NULL;
+static ka_bool_t writer_joinable = FALSE, writer_quit = FALSE;
+static pthread_t writer_thread_id;
+static pid_t writer_pid = 0;
+
+/* Recently used entries are kept in memory in front of the database,
+ * so that repeated lookups of the same sound need neither tdb nor any
+ * allocation. To keep lock contention low this is split into shards
+ * by key hash, each with its own lock and LRU list. */
+
+typedef struct front_entry front_entry;
+
+struct front_entry {
+        KA_LLIST_FIELDS(front_entry);
+
+        unsigned hash;
+        uint32_t timestamp;
+
+        /* Points into the same allocation, like the key built by
+         * build_key(). path is NULL for negative entries. */
+        char *key;
+        size_t klen;
+        char *path;
+};
+
+typedef struct front_shard {
+        ka_mutex *mutex;
+        KA_LLIST_HEAD(front_entry, entries);
+        unsigned n_entries;
+} front_shard;
+
+static front_shard front_shards[N_FRONT_SHARDS];
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void watch_atfork_child(void);
+#endif
+
 static void allocate_mutex_once(void) {
-        mutex = ka_mutex_new();
+        unsigned i;
+
+        if (!(mutex = ka_mutex_new()))
+                return;
+
+        if (!(db_mutex = ka_mutex_new()))
+                goto fail;
+
+        if (!(change_mutex = ka_mutex_new()))
+                goto fail;
+
+        if (!(writer_cond = ka_cond_new()))
+                goto fail;
+
+        for (i = 0; i < N_FRONT_SHARDS; i++)
+                if (!(front_shards[i].mutex = ka_mutex_new())) {
+
+                        while (i > 0) {
+                                ka_mutex_free(front_shards[--i].mutex);
+                                front_shards[i].mutex = NULL;
+                        }
+
+                        goto fail;
+                }
+
+#ifdef HAVE_SYS_INOTIFY_H
+        /* The watch thread doesn't survive a fork() */
+        pthread_atfork(NULL, NULL, watch_atfork_child);
+#endif
+
+        mutex_pid = getpid();
+        return;
+
+fail:
+        if (writer_cond) {
+                ka_cond_free(writer_cond);
+                writer_cond = NULL;
+        }
+
+        if (change_mutex) {
+                ka_mutex_free(change_mutex);
+                change_mutex = NULL;
+        }
+
+        if (db_mutex) {
+                ka_mutex_free(db_mutex);
+                db_mutex = NULL;
+        }
+
+        ka_mutex_free(mutex);
+        mutex = NULL;
 }
 
 static int allocate_mutex(void) {
@@ -66,6 +205,185 @@ static int allocate_mutex(void) {
         return 0;
 }
 
+static unsigned calc_key_hash(
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile) {
+
+        const char *k[4];
+        unsigned hash = 0, i;
+
+        k[0] = theme;
+        k[1] = name;
+        k[2] = locale;
+        k[3] = profile;
+
+        /* Hashes the same bytes build_key() would produce */
+        for (i = 0; i < KA_ELEMENTSOF(k); i++) {
+                const char *c;
+
+                for (c = k[i]; *c; c++)
+                        hash = 31 * hash + (unsigned) *c;
+
+                hash = 31 * hash;
+        }
+
+        return hash;
+}
+
+static ka_bool_t front_entry_matches(
+                front_entry *e,
+                unsigned hash,
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile) {
+
+        const char *k;
+
+        ka_assert(e);
+
+        if (e->hash != hash)
+                return FALSE;
+
+        k = e->key;
+
+        if (!ka_streq(k, theme))
+                return FALSE;
+        k += strlen(k)+1;
+
+        if (!ka_streq(k, name))
+                return FALSE;
+        k += strlen(k)+1;
+
+        if (!ka_streq(k, locale))
+                return FALSE;
+        k += strlen(k)+1;
+
+        return ka_streq(k, profile);
+}
+
+/* Needs to be called with the shard locked */
+static front_entry *front_find(
+                front_shard *sh,
+                unsigned hash,
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile) {
+
+        front_entry *e;
+
+        ka_assert(sh);
+
+        for (e = sh->entries; e; e = e->next)
+                if (front_entry_matches(e, hash, theme, name, locale, profile))
+                        return e;
+
+        return NULL;
+}
+
+static void front_remove(
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile) {
+
+        unsigned hash;
+        front_shard *sh;
+        front_entry *e;
+
+        if (allocate_mutex() < 0)
+                return;
+
+        hash = calc_key_hash(theme, name, locale, profile);
+        sh = front_shards + (hash % N_FRONT_SHARDS);
+
+        ka_mutex_lock(sh->mutex);
+
+        if ((e = front_find(sh, hash, theme, name, locale, profile))) {
+                KA_LLIST_REMOVE(front_entry, sh->entries, e);
+                sh->n_entries--;
+                ka_free(e);
+        }
+
+        ka_mutex_unlock(sh->mutex);
+}
+
+static void front_store(
+                const char *key,
+                size_t klen,
+                uint32_t timestamp,
+                const char *fname) {
+
+        const char *theme, *name, *locale, *profile;
+        unsigned hash;
+        size_t plen;
+        front_shard *sh;
+        front_entry *e, *old;
+
+        ka_assert(key);
+
+        if (allocate_mutex() < 0)
+                return;
+
+        theme = key;
+        name = theme + strlen(theme) + 1;
+        locale = name + strlen(name) + 1;
+        profile = locale + strlen(locale) + 1;
+
+        hash = calc_key_hash(theme, name, locale, profile);
+        sh = front_shards + (hash % N_FRONT_SHARDS);
+
+        plen = fname ? strlen(fname) + 1 : 0;
+
+        /* Lookups copy the path to the stack, so we don't keep
+         * anything that wouldn't fit there */
+        if (plen > FRONT_PATH_MAX) {
+                front_remove(theme, name, locale, profile);
+                return;
+        }
+
+        if (!(e = ka_malloc(KA_ALIGN(sizeof(front_entry)) + klen + plen)))
+                return;
+
+        e->hash = hash;
+        e->timestamp = timestamp;
+        e->key = (char*) e + KA_ALIGN(sizeof(front_entry));
+        e->klen = klen;
+        memcpy(e->key, key, klen);
+
+        if (fname) {
+                e->path = e->key + klen;
+                memcpy(e->path, fname, plen);
+        } else
+                e->path = NULL;
+
+        ka_mutex_lock(sh->mutex);
+
+        if ((old = front_find(sh, hash, theme, name, locale, profile))) {
+                KA_LLIST_REMOVE(front_entry, sh->entries, old);
+                sh->n_entries--;
+                ka_free(old);
+        }
+
+        /* Evict the least recently used entry if we are full */
+        if (sh->n_entries >= N_FRONT_ENTRIES_MAX) {
+                for (old = sh->entries; old->next; old = old->next)
+                        ;
+
+                KA_LLIST_REMOVE(front_entry, sh->entries, old);
+                sh->n_entries--;
+                ka_free(old);
+        }
+
+        KA_LLIST_PREPEND(front_entry, sh->entries, e);
+        sh->n_entries++;
+
+        ka_mutex_unlock(sh->mutex);
+}
+
 static int get_cache_home(char **e) {
         const char *env, *subdir;
         char *r;
@@ -150,250 +468,894 @@ static int get_machine_id(char **id) {
                 if (errno != EINVAL && errno != ENAMETOOLONG)
                         break;
 
-                l *= 2;
+                l *= 2;
+        }
+
+        /* Then we use the POSIX host id */
+
+        *id = ka_sprintf_malloc("%08lx", (unsigned long) gethostid());
+        return KA_SUCCESS;
+}
+
+/* Needs to be called with db_mutex locked */
+static int db_open(void) {
+        int ret;
+        char *c, *id, *pn;
+
+        if (database)
+                return KA_SUCCESS;
+
+        if ((ret = get_cache_home(&c)) < 0)
+                return ret;
+
+        if (!c)
+                return KA_ERROR_NOTFOUND;
+
+        /* Try to create, just in case it doesn't exist yet. We don't do
+         * this recursively however. */
+        mkdir(c, 0755);
+
+        if ((ret = get_machine_id(&id)) < 0) {
+                ka_free(c);
+                return ret;
+        }
+
+        /* This data is machine specific, hence we include some kind of
+         * stable machine id here in the name. Also, we don't want to care
+         * abouth endianess/packing issues, hence we include the compiler
+         * target in the name, too. */
+
+        pn = ka_sprintf_malloc("%s/" FILENAME ".%s." CANONICAL_HOST, c, id);
+        ka_free(c);
+        ka_free(id);
+
+        if (!pn)
+                return KA_ERROR_OOM;
+
+        /* We pass TDB_NOMMAP here as long as rhbz 460851 is not fixed in
+         * tdb. */
+        database = tdb_open(pn, 0, TDB_NOMMAP, O_RDWR|O_CREAT|O_NOCTTY
+#ifdef O_CLOEXEC
+                            | O_CLOEXEC
+#endif
+                            , 0644);
+        ka_free(pn);
+
+        if (!database)
+                return KA_ERROR_CORRUPT;
+
+        return KA_SUCCESS;
+}
+
+#ifdef KA_GCC_DESTRUCTOR
+
+static void db_close(void) KA_GCC_DESTRUCTOR;
+
+static void db_flush(void);
+static void stop_writer(void);
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void stop_watch(void);
+#endif
+
+static void db_close(void) {
+
+        /* In a forked child the locks might be held forever by
+         * threads of our parent that didn't come along, and the
+         * writer and watch threads are the parent's anyway. Whatever
+         * the child queued is lost. */
+        if (mutex && mutex_pid != getpid())
+                return;
+
+        /* We might be unloaded with the module that pulled us in, so
+         * our threads must not outlive us */
+#ifdef HAVE_SYS_INOTIFY_H
+        stop_watch();
+#endif
+
+        if (mutex) {
+                stop_writer();
+
+                /* Don't lose what hasn't been written back yet */
+                db_flush();
+        }
+
+        /* The rest is only here to make this valgrind clean */
+
+        if (!getenv("VALGRIND"))
+                return;
+
+        if (mutex) {
+                unsigned i;
+
+                for (i = 0; i < N_FRONT_SHARDS; i++) {
+                        front_shard *sh = front_shards + i;
+
+                        while (sh->entries) {
+                                front_entry *e = sh->entries;
+
+                                KA_LLIST_REMOVE(front_entry, sh->entries, e);
+                                ka_free(e);
+                        }
+
+                        sh->n_entries = 0;
+                }
+        }
+
+        if (mutex) {
+                unsigned i;
+
+                for (i = 0; i < N_FRONT_SHARDS; i++) {
+                        ka_mutex_free(front_shards[i].mutex);
+                        front_shards[i].mutex = NULL;
+                }
+
+                ka_cond_free(writer_cond);
+                writer_cond = NULL;
+                ka_mutex_free(change_mutex);
+                change_mutex = NULL;
+                ka_mutex_free(db_mutex);
+                db_mutex = NULL;
+                ka_mutex_free(mutex);
+                mutex = NULL;
+        }
+
+        if (database) {
+                tdb_close(database);
+                database = NULL;
+        }
+}
+
+#endif
+
+/* Needs to be called with mutex locked */
+static pending_write *pending_find(pending_write *l, const void *key, size_t klen) {
+        pending_write *w;
+
+        for (w = l; w; w = w->next)
+                if (w->klen == klen && memcmp(w->key, key, klen) == 0)
+                        return w;
+
+        return NULL;
+}
+
+static int db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
+        int ret;
+        TDB_DATA k, d;
+        pending_write *w;
+
+        ka_return_val_if_fail(key, KA_ERROR_INVALID);
+        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(data, KA_ERROR_INVALID);
+        ka_return_val_if_fail(dlen, KA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        /* What hasn't been written back yet supersedes what is in the
+         * database. The queue is ordered newest first. */
+        ka_mutex_lock(mutex);
+
+        if (!(w = pending_find(pending, key, klen)))
+                w = pending_find(flushing, key, klen);
+
+        if (w) {
+                if (!w->data)
+                        ret = KA_ERROR_NOTFOUND;
+                else if (!(*data = ka_memdup(w->data, w->dlen)))
+                        ret = KA_ERROR_OOM;
+                else {
+                        *dlen = w->dlen;
+                        ret = KA_SUCCESS;
+                }
+
+                ka_mutex_unlock(mutex);
+                return ret;
+        }
+
+        ka_mutex_unlock(mutex);
+
+        /* If the changes are being written back right now we treat
+         * this as a miss rather than waiting for the disk */
+        if (!ka_mutex_try_lock(db_mutex))
+                return KA_ERROR_NOTFOUND;
+
+        if ((ret = db_open()) < 0)
+                goto finish;
+
+        k.dptr = (void*) key;
+        k.dsize = klen;
+
+        ka_assert(database);
+        d = tdb_fetch(database, k);
+        if (!d.dptr) {
+                ret = KA_ERROR_NOTFOUND;
+                goto finish;
+        }
+
+        *data = d.dptr;
+        *dlen = d.dsize;
+
+finish:
+        ka_mutex_unlock(db_mutex);
+
+        return ret;
+}
+
+static void pending_write_free_all(pending_write *l) {
+
+        while (l) {
+                pending_write *w = l;
+
+                KA_LLIST_REMOVE(pending_write, l, w);
+                ka_free(w);
+        }
+}
+
+/* Needs to be called with db_mutex locked */
+static int write_entry(pending_write *w) {
+        TDB_DATA k, d;
+
+        k.dptr = w->key;
+        k.dsize = w->klen;
+
+        if (w->data) {
+                d.dptr = w->data;
+                d.dsize = w->dlen;
+
+                return tdb_store(database, k, d, TDB_REPLACE);
+        }
+
+        /* Removing what isn't there is fine */
+        if (tdb_delete(database, k) < 0 && tdb_error(database) != TDB_ERR_NOEXIST)
+                return -1;
+
+        return 0;
+}
+
+/* Needs to be called with db_mutex locked */
+static void write_batch(pending_write *l) {
+        pending_write *w;
+
+        ka_assert(database);
+
+        /* Writing everything in one transaction means taking the
+         * locks and syncing only once */
+        if (tdb_transaction_start(database) == 0) {
+
+                for (w = l; w; w = w->next)
+                        if (write_entry(w) < 0)
+                                break;
+
+                if (!w && tdb_transaction_commit(database) == 0)
+                        return;
+
+                /* A failed commit cancels the transaction by itself */
+                if (w)
+                        tdb_transaction_cancel(database);
+        }
+
+        /* If we cannot get a transaction, or it failed, we write the
+         * entries one by one, so that one bad entry doesn't take the
+         * others with it. What still fails is dropped, just like the
+         * synchronous code would have reported and dropped it. */
+        for (w = l; w; w = w->next)
+                if (write_entry(w) < 0)
+                        if (ka_debug())
+                                fprintf(stderr, "Failed to write back sound cache entry: %s\n", tdb_errorstr(database));
+}
+
+static void db_flush(void) {
+        pending_write *l;
+        int r;
+
+        if (allocate_mutex() < 0)
+                return;
+
+        /* Serializes us against other flushes, too */
+        ka_mutex_lock(db_mutex);
+
+        ka_mutex_lock(mutex);
+        l = flushing = pending;
+        pending = NULL;
+        ka_mutex_unlock(mutex);
+
+        if (!l) {
+                ka_mutex_unlock(db_mutex);
+                return;
+        }
+
+        /* If we cannot open the database there's nothing we can do
+         * about it, so let's drop it all */
+        if ((r = db_open()) >= 0)
+                write_batch(l);
+        else if (ka_debug())
+                fprintf(stderr, "Failed to open sound cache: %s\n", ka_strerror(r));
+
+        /* Lookups that find nothing in the queue any more have to
+         * find it in the database, so we only unlock it after this */
+        ka_mutex_lock(mutex);
+        flushing = NULL;
+        ka_mutex_unlock(mutex);
+
+        ka_mutex_unlock(db_mutex);
+
+        pending_write_free_all(l);
+}
+
+static void* writer_thread(void *userdata) {
+
+        ka_mutex_lock(mutex);
+
+        while (!writer_quit) {
+
+                if (!pending) {
+                        ka_cond_wait(writer_cond, mutex);
+                        continue;
+                }
+
+                /* Give a burst of changes the chance to pile up, so
+                 * that we can write it in one go. If we are asked to
+                 * quit in the meantime db_close() writes it. */
+                if (ka_cond_timedwait(writer_cond, mutex, WRITE_BACK_DELAY_USEC))
+                        continue;
+
+                ka_mutex_unlock(mutex);
+                db_flush();
+                ka_mutex_lock(mutex);
+        }
+
+        ka_mutex_unlock(mutex);
+
+        return NULL;
+}
+
+static void stop_writer(void) {
+        pthread_t thread;
+
+        ka_mutex_lock(mutex);
+
+        if (!writer_joinable || writer_pid != getpid()) {
+                ka_mutex_unlock(mutex);
+                return;
+        }
+
+        thread = writer_thread_id;
+        writer_joinable = FALSE;
+        writer_quit = TRUE;
+        ka_cond_signal(writer_cond);
+
+        ka_mutex_unlock(mutex);
+
+        pthread_join(thread, NULL);
+}
+
+static int db_queue(const void *key, size_t klen, const void *data, size_t dlen) {
+        int ret;
+        pending_write *w, *old;
+        ka_bool_t flush_now = FALSE, was_empty;
+
+        ka_return_val_if_fail(key, KA_ERROR_INVALID);
+        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        if (!(w = ka_malloc(KA_ALIGN(sizeof(pending_write)) + klen + dlen)))
+                return KA_ERROR_OOM;
+
+        w->key = (uint8_t*) w + KA_ALIGN(sizeof(pending_write));
+        w->klen = klen;
+        memcpy(w->key, key, klen);
+
+        if (data) {
+                w->data = (uint8_t*) w->key + klen;
+                w->dlen = dlen;
+                memcpy(w->data, data, dlen);
+        } else {
+                w->data = NULL;
+                w->dlen = 0;
+        }
+
+        ka_mutex_lock(mutex);
+
+        /* Only the last change to an entry matters */
+        if ((old = pending_find(pending, key, klen))) {
+                KA_LLIST_REMOVE(pending_write, pending, old);
+                ka_free(old);
+        }
+
+        was_empty = !pending;
+        KA_LLIST_PREPEND(pending_write, pending, w);
+
+        if (!writer_joinable || writer_pid != getpid()) {
+
+                /* The writer thread doesn't survive a fork(), and the
+                 * parent's might have been waiting on writer_cond,
+                 * which we hence cannot destroy. So we leave it
+                 * alone and start afresh. */
+                if (writer_pid != 0 && writer_pid != getpid()) {
+                        ka_cond *c;
+
+                        if ((c = ka_cond_new()))
+                                writer_cond = c;
+                }
+
+                writer_quit = FALSE;
+                writer_pid = getpid();
+                writer_joinable = pthread_create(&writer_thread_id, NULL, writer_thread, NULL) == 0;
+
+                flush_now = !writer_joinable;
+
+        } else if (was_empty)
+                /* Otherwise the writer is already on its way */
+                ka_cond_signal(writer_cond);
+
+        ka_mutex_unlock(mutex);
+
+        if (flush_now)
+                db_flush();
+
+        return KA_SUCCESS;
+}
+
+static int db_store(const void *key, size_t klen, const void *data, size_t dlen) {
+
+        ka_return_val_if_fail(key, KA_ERROR_INVALID);
+        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(data && dlen > 0, KA_ERROR_INVALID);
+
+        return db_queue(key, klen, data, dlen);
+}
+
+static int db_remove(const void *key, size_t klen) {
+
+        ka_return_val_if_fail(key, KA_ERROR_INVALID);
+        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
+
+        return db_queue(key, klen, NULL, 0);
+}
+
+static char *build_key(
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile,
+                size_t *klen) {
+
+        char *key, *k;
+        size_t tl, nl, ll, pl;
+
+        tl = strlen(theme);
+        nl = strlen(name);
+        ll = strlen(locale);
+        pl = strlen(profile);
+        *klen = tl+1+nl+1+ll+1+pl+1;
+
+        if (!(key = ka_new(char, *klen)))
+                return NULL;
+
+        k = key;
+        strcpy(k, theme);
+        k += tl+1;
+        strcpy(k, name);
+        k += nl+1;
+        strcpy(k, locale);
+        k += ll+1;
+        strcpy(k, profile);
+
+        return key;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* Instead of polling the mtimes of the sound directories we can watch
+ * the whole tree below them with inotify and learn about every change
+ * right away. If anything goes wrong with that we fall back to
+ * polling. */
+
+#define N_PARENT_WD_MAX 32
+#define WATCH_DEPTH_MAX 8
+
+#define WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+#define WATCH_PARENT_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+/* Protected by change_mutex */
+static int watch_fd = -1;
+static pid_t watch_pid = 0;
+static ka_bool_t watch_failed = FALSE;
+static ka_bool_t watch_joinable = FALSE;
+static pthread_t watch_thread_id;
+static ka_wakeup watch_wakeup = { { -1, -1 } };
+
+/* Only accessed by the watch thread once it is running */
+static int parent_wd[N_PARENT_WD_MAX];
+static unsigned n_parent_wd = 0;
+
+static int add_watch_recursive(int fd, const char *path, unsigned depth) {
+        DIR *d;
+        struct dirent *de;
+
+        ka_assert(fd >= 0);
+        ka_assert(path);
+
+        if (inotify_add_watch(fd, path, WATCH_MASK) < 0) {
+
+                /* Directories that are not there or that we may not
+                 * read don't matter to us anyway */
+                if (errno == ENOENT || errno == ENOTDIR || errno == EACCES)
+                        return 0;
+
+                return -1;
+        }
+
+        if (depth >= WATCH_DEPTH_MAX)
+                return 0;
+
+        if (!(d = opendir(path)))
+                return 0;
+
+        while ((de = readdir(d))) {
+                char *k;
+                struct stat st;
+                int r;
+
+                if (ka_streq(de->d_name, ".") || ka_streq(de->d_name, ".."))
+                        continue;
+
+                if (!(k = ka_sprintf_malloc("%s/%s", path, de->d_name))) {
+                        closedir(d);
+                        errno = ENOMEM;
+                        return -1;
+                }
+
+                if (stat(k, &st) < 0 || !S_ISDIR(st.st_mode)) {
+                        ka_free(k);
+                        continue;
+                }
+
+                r = add_watch_recursive(fd, k, depth+1);
+                ka_free(k);
+
+                if (r < 0) {
+                        closedir(d);
+                        return -1;
+                }
+        }
+
+        closedir(d);
+        return 0;
+}
+
+static int add_watch_root(int fd, const char *prefix, size_t l) {
+        char *k;
+        int wd, r;
+
+        ka_assert(fd >= 0);
+        ka_assert(prefix);
+
+        /* We watch the data directory itself only to notice the sounds
+         * directory being created or removed */
+        if (!(k = ka_strndup(prefix, l))) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        wd = inotify_add_watch(fd, k, WATCH_PARENT_MASK);
+        ka_free(k);
+
+        if (wd >= 0) {
+                if (n_parent_wd < N_PARENT_WD_MAX)
+                        parent_wd[n_parent_wd++] = wd;
+        } else if (errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+                return -1;
+
+        if (!(k = ka_new(char, l + sizeof("/sounds")))) {
+                errno = ENOMEM;
+                return -1;
         }
 
-        /* Then we use the POSIX host id */
+        memcpy(k, prefix, l);
+        strcpy(k+l, "/sounds");
 
-        *id = ka_sprintf_malloc("%08lx", (unsigned long) gethostid());
-        return KA_SUCCESS;
-}
+        r = add_watch_recursive(fd, k, 0);
+        ka_free(k);
 
-static int db_open(void) {
-        int ret;
-        char *c, *id, *pn;
+        return r;
+}
 
-        if ((ret = allocate_mutex()) < 0)
-                return ret;
+static int add_watches(int fd) {
+        char *e;
+        const char *g;
 
-        ka_mutex_lock(mutex);
+        ka_assert(fd >= 0);
 
-        if (database) {
-                ret = KA_SUCCESS;
-                goto finish;
-        }
+        /* Adding a watch for a directory a second time just returns
+         * the old watch descriptor, hence we can simply call this
+         * again whenever new directories show up. */
 
-        if ((ret = get_cache_home(&c)) < 0)
-                goto finish;
+        n_parent_wd = 0;
 
-        if (!c) {
-                ret = KA_ERROR_NOTFOUND;
-                goto finish;
+        if (ka_get_data_home(&e) < 0) {
+                errno = ENOMEM;
+                return -1;
         }
 
-        /* Try to create, just in case it doesn't exist yet. We don't do
-         * this recursively however. */
-        mkdir(c, 0755);
+        if (e) {
+                int r;
 
-        if ((ret = get_machine_id(&id)) < 0) {
-                ka_free(c);
-                goto finish;
+                r = add_watch_root(fd, e, strlen(e));
+                ka_free(e);
+
+                if (r < 0)
+                        return -1;
         }
 
-        /* This data is machine specific, hence we include some kind of
-         * stable machine id here in the name. Also, we don't want to care
-         * abouth endianess/packing issues, hence we include the compiler
-         * target in the name, too. */
+        g = ka_get_data_dirs();
 
-        pn = ka_sprintf_malloc("%s/" FILENAME ".%s." CANONICAL_HOST, c, id);
-        ka_free(c);
-        ka_free(id);
+        for (;;) {
+                size_t j = strcspn(g, ":");
 
-        if (!pn) {
-                ret = KA_ERROR_OOM;
-                goto finish;
-        }
+                if (g[0] == '/' && j > 0)
+                        if (add_watch_root(fd, g, j) < 0)
+                                return -1;
 
-        /* We pass TDB_NOMMAP here as long as rhbz 460851 is not fixed in
-         * tdb. */
-        database = tdb_open(pn, 0, TDB_NOMMAP, O_RDWR|O_CREAT|O_NOCTTY
-#ifdef O_CLOEXEC
-                            | O_CLOEXEC
-#endif
-                            , 0644);
-        ka_free(pn);
+                if (g[j] == 0)
+                        break;
 
-        if (!database) {
-                ret = KA_ERROR_CORRUPT;
-                goto finish;
+                g += j+1;
         }
 
-        ret = KA_SUCCESS;
+        return 0;
+}
 
-finish:
-        ka_mutex_unlock(mutex);
+static ka_bool_t is_parent_wd(int wd) {
+        unsigned i;
 
-        return ret;
+        for (i = 0; i < n_parent_wd; i++)
+                if (parent_wd[i] == wd)
+                        return TRUE;
+
+        return FALSE;
 }
 
-#ifdef KA_GCC_DESTRUCTOR
+static void* watch_thread(void *userdata) {
+        int fd = KA_PTR_TO_INT(userdata);
+        ka_bool_t failed = TRUE;
 
-static void db_close(void) KA_GCC_DESTRUCTOR;
+        for (;;) {
+                union {
+                        struct inotify_event event;
+                        char buf[4096];
+                } u;
+                struct pollfd pfd[2];
+                ssize_t l;
+                size_t i;
+                ka_bool_t changed = FALSE, rescan = FALSE;
+
+                memset(pfd, 0, sizeof(pfd));
+                pfd[0].fd = fd;
+                pfd[0].events = POLLIN;
+                pfd[1].fd = ka_wakeup_fd(&watch_wakeup);
+                pfd[1].events = POLLIN;
+
+                if (poll(pfd, 2, -1) < 0) {
+
+                        if (errno == EINTR)
+                                continue;
 
-static void db_close(void) {
-        /* Only here to make this valgrind clean */
+                        break;
+                }
 
-        if (!getenv("VALGRIND"))
-                return;
+                /* We are asked to quit */
+                if (pfd[1].revents) {
+                        failed = FALSE;
+                        break;
+                }
 
-        if (mutex) {
-                ka_mutex_free(mutex);
-                mutex = NULL;
-        }
+                if (!pfd[0].revents)
+                        continue;
 
-        if (database) {
-                tdb_close(database);
-                database = NULL;
-        }
-}
+                if ((l = read(fd, &u, sizeof(u))) < 0) {
 
-#endif
+                        if (errno == EINTR || errno == EAGAIN)
+                                continue;
 
-static int db_lookup(const void *key, size_t klen, void **data, size_t *dlen) {
-        int ret;
-        TDB_DATA k, d;
+                        break;
+                }
 
-        ka_return_val_if_fail(key, KA_ERROR_INVALID);
-        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
-        ka_return_val_if_fail(data, KA_ERROR_INVALID);
-        ka_return_val_if_fail(dlen, KA_ERROR_INVALID);
+                for (i = 0; i + sizeof(struct inotify_event) <= (size_t) l; ) {
+                        struct inotify_event *ev = (struct inotify_event*) (u.buf + i);
 
-        if ((ret = db_open()) < 0)
-                return ret;
+                        i += sizeof(struct inotify_event) + ev->len;
 
-        k.dptr = (void*) key;
-        k.dsize = klen;
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                changed = rescan = TRUE;
+                                continue;
+                        }
 
-        ka_mutex_lock(mutex);
+                        if (ev->mask & IN_IGNORED)
+                                continue;
 
-        ka_assert(database);
-        d = tdb_fetch(database, k);
-        if (!d.dptr) {
-                ret = KA_ERROR_NOTFOUND;
-                goto finish;
-        }
+                        if (is_parent_wd(ev->wd)) {
 
-        *data = d.dptr;
-        *dlen = d.dsize;
+                                /* Something unrelated changed in
+                                 * the data directory */
+                                if (ev->len <= 0 || !ka_streq(ev->name, "sounds"))
+                                        continue;
 
-finish:
-        ka_mutex_unlock(mutex);
+                                rescan = TRUE;
 
-        return ret;
-}
+                        } else if ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && (ev->mask & IN_ISDIR))
+                                rescan = TRUE;
 
-static int db_store(const void *key, size_t klen, const void *data, size_t dlen) {
-        int ret;
-        TDB_DATA k, d;
+                        changed = TRUE;
+                }
 
-        ka_return_val_if_fail(key, KA_ERROR_INVALID);
-        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
-        ka_return_val_if_fail(data || dlen == 0, KA_ERROR_INVALID);
+                if (rescan && add_watches(fd) < 0)
+                        break;
 
-        if ((ret = db_open()) < 0)
-                return ret;
+                if (changed) {
+                        time_t now;
 
-        k.dptr = (void*) key;
-        k.dsize = klen;
+                        ka_assert_se(time(&now) != (time_t) -1);
 
-        d.dptr = (void*) data;
-        d.dsize = dlen;
+                        ka_mutex_lock(change_mutex);
 
-        ka_mutex_lock(mutex);
+                        /* Entries are timestamped with a resolution of
+                         * one second only, and one stored in this very
+                         * second might still describe the old
+                         * state. */
+                        theme_last_change = now + 1;
+                        ka_atomic_store(&published_change, (uint32_t) theme_last_change);
 
-        ka_assert(database);
-        if (tdb_store(database, k, d, TDB_REPLACE) < 0) {
-                ret = KA_ERROR_CORRUPT;
-                goto finish;
+                        ka_mutex_unlock(change_mutex);
+                }
         }
 
-        ret = KA_SUCCESS;
+        ka_mutex_lock(change_mutex);
 
-finish:
-        ka_mutex_unlock(mutex);
+        ka_atomic_store(&published_change_until, 0U);
 
-        return ret;
+        if (watch_fd == fd) {
+                watch_fd = -1;
+                watch_pid = 0;
+                theme_last_check = 0;
+        }
+
+        /* Something went wrong, go back to polling */
+        if (failed)
+                watch_failed = TRUE;
+
+        ka_mutex_unlock(change_mutex);
+
+        close(fd);
+
+        return NULL;
 }
 
-static int db_remove(const void *key, size_t klen) {
-        int ret;
-        TDB_DATA k;
+static void watch_atfork_child(void) {
 
-        ka_return_val_if_fail(key, KA_ERROR_INVALID);
-        ka_return_val_if_fail(klen > 0, KA_ERROR_INVALID);
+        /* Only the forking thread came along, so there's nobody to
+         * keep published_change up-to-date and nothing to join. The
+         * descriptors are cleaned up by start_watch(). */
+        published_change_until = 0;
+        watch_joinable = FALSE;
+}
 
-        if ((ret = db_open()) < 0)
-                return ret;
+/* Needs to be called with change_mutex locked */
+static void start_watch(void) {
+        int fd;
 
-        k.dptr = (void*) key;
-        k.dsize = klen;
+        if (watch_failed)
+                return;
 
-        ka_mutex_lock(mutex);
+        /* We might have inherited these from our parent process, whose
+         * watch thread didn't come along when we forked */
+        if (watch_fd >= 0) {
+                close(watch_fd);
+                watch_fd = -1;
+        }
 
-        ka_assert(database);
-        if (tdb_delete(database, k) < 0) {
-                ret = KA_ERROR_CORRUPT;
-                goto finish;
+        ka_wakeup_done(&watch_wakeup);
+
+        watch_pid = 0;
+        theme_last_check = 0;
+
+        if (ka_wakeup_init(&watch_wakeup) < 0) {
+                watch_failed = TRUE;
+                return;
+        }
+
+        if ((fd = inotify_init1(IN_CLOEXEC|IN_NONBLOCK)) < 0) {
+                ka_wakeup_done(&watch_wakeup);
+                watch_failed = TRUE;
+                return;
         }
 
-        ret = KA_SUCCESS;
+        if (add_watches(fd) < 0) {
+                close(fd);
+                ka_wakeup_done(&watch_wakeup);
+                watch_failed = TRUE;
+                return;
+        }
 
-finish:
-        ka_mutex_unlock(mutex);
+        watch_fd = fd;
+        watch_pid = getpid();
 
-        return ret;
+        if (pthread_create(&watch_thread_id, NULL, watch_thread, KA_INT_TO_PTR(fd)) != 0) {
+                close(fd);
+                ka_wakeup_done(&watch_wakeup);
+                watch_fd = -1;
+                watch_pid = 0;
+                watch_failed = TRUE;
+                return;
+        }
+
+        watch_joinable = TRUE;
 }
 
-static char *build_key(
-                const char *theme,
-                const char *name,
-                const char *locale,
-                const char *profile,
-                size_t *klen) {
+static void stop_watch(void) {
+        pthread_t thread;
 
-        char *key, *k;
-        size_t tl, nl, ll, pl;
+        if (!change_mutex)
+                return;
 
-        tl = strlen(theme);
-        nl = strlen(name);
-        ll = strlen(locale);
-        pl = strlen(profile);
-        *klen = tl+1+nl+1+ll+1+pl+1;
+        ka_mutex_lock(change_mutex);
 
-        if (!(key = ka_new(char, *klen)))
-                return NULL;
+        if (!watch_joinable) {
+                ka_mutex_unlock(change_mutex);
+                return;
+        }
 
-        k = key;
-        strcpy(k, theme);
-        k += tl+1;
-        strcpy(k, name);
-        k += nl+1;
-        strcpy(k, locale);
-        k += ll+1;
-        strcpy(k, profile);
+        thread = watch_thread_id;
+        watch_joinable = FALSE;
+        ka_wakeup_signal(&watch_wakeup);
 
-        return key;
+        ka_mutex_unlock(change_mutex);
+
+        /* The thread takes change_mutex itself before it quits */
+        pthread_join(thread, NULL);
+
+        ka_wakeup_done(&watch_wakeup);
 }
 
+#endif
+
 static int get_last_change(time_t *t) {
         int ret;
         char *e, *k;
         struct stat st;
-        static time_t last_check = 0, last_change = 0;
         time_t now;
         const char *g;
+        uint32_t until;
 
         ka_return_val_if_fail(t, KA_ERROR_INVALID);
 
+        ka_assert_se(time(&now) != (time_t) -1);
+
+        /* Every cache hit comes here, so this must not take any
+         * lock. See below for the order of the stores. */
+        if ((uint32_t) now < ka_atomic_load(&published_change_until)) {
+                *t = (time_t) ka_atomic_load(&published_change);
+                return KA_SUCCESS;
+        }
+
         if ((ret = allocate_mutex()) < 0)
                 return ret;
 
-        ka_mutex_lock(mutex);
+        ka_mutex_lock(change_mutex);
 
-        ka_assert_se(time(&now) != (time_t) -1);
+#ifdef HAVE_SYS_INOTIFY_H
+        /* Once the watch is running we only need to check the
+         * directories once to catch up with what happened before it
+         * started. start_watch() makes sure we do. */
+        if (watch_pid != getpid())
+                start_watch();
+#endif
 
-        if (now < last_check + UPDATE_INTERVAL) {
-                *t = last_change;
+        if (now < theme_last_check + UPDATE_INTERVAL) {
+                *t = theme_last_change;
                 ret = KA_SUCCESS;
                 goto finish;
         }
@@ -447,18 +1409,113 @@ static int get_last_change(time_t *t) {
                 g += j+1;
         }
 
-        last_change = *t;
-        last_check = now;
+#ifdef HAVE_SYS_INOTIFY_H
+        if (watch_pid == getpid()) {
+
+                /* Don't go back behind what the watch thread has seen
+                 * in the meantime */
+                if (theme_last_change > *t)
+                        *t = theme_last_change;
+
+                until = LAST_CHANGE_FOREVER;
+        } else
+#endif
+                until = (uint32_t) (now + UPDATE_INTERVAL);
+
+        theme_last_change = *t;
+        theme_last_check = now;
+
+        /* The lockless readers load these in the opposite order, so
+         * they never see a new deadline with an old value */
+        ka_atomic_store(&published_change, (uint32_t) *t);
+        ka_atomic_store(&published_change_until, until);
 
         ret = 0;
 
 finish:
 
-        ka_mutex_unlock(mutex);
+        ka_mutex_unlock(change_mutex);
 
         return ret;
 }
 
+static int front_lookup(
+                ka_sound_file **f,
+                ka_sound_file_open_callback_t sfopen,
+                char **sound_path,
+                const char *theme,
+                const char *name,
+                const char *locale,
+                const char *profile) {
+
+        unsigned hash;
+        front_shard *sh;
+        front_entry *e;
+        char fn[FRONT_PATH_MAX];
+        ka_bool_t negative;
+        uint32_t timestamp;
+        time_t last_change, now;
+        int ret;
+
+        if ((ret = allocate_mutex()) < 0)
+                return ret;
+
+        hash = calc_key_hash(theme, name, locale, profile);
+        sh = front_shards + (hash % N_FRONT_SHARDS);
+
+        ka_mutex_lock(sh->mutex);
+
+        if (!(e = front_find(sh, hash, theme, name, locale, profile))) {
+                ka_mutex_unlock(sh->mutex);
+                return KA_ERROR_NOTFOUND;
+        }
+
+        timestamp = e->timestamp;
+
+        if (!(negative = !e->path))
+                strcpy(fn, e->path);
+
+        /* Move to the front of the LRU list */
+        KA_LLIST_REMOVE(front_entry, sh->entries, e);
+        KA_LLIST_PREPEND(front_entry, sh->entries, e);
+
+        ka_mutex_unlock(sh->mutex);
+
+        if ((ret = get_last_change(&last_change)) < 0)
+                return ret;
+
+        ka_assert_se(time(&now) != (time_t) -1);
+
+        /* Same checks as for the database entries, see below */
+        if ((time_t) timestamp < last_change || ((time_t) timestamp > now)) {
+                front_remove(theme, name, locale, profile);
+                return KA_ERROR_NOTFOUND;
+        }
+
+        if (negative) {
+                *f = NULL;
+                return KA_SUCCESS;
+        }
+
+        if (sound_path)
+                if (!(*sound_path = ka_strdup(fn)))
+                        return KA_ERROR_OOM;
+
+        if ((ret = sfopen(f, fn)) < 0) {
+
+                if (sound_path) {
+                        ka_free(*sound_path);
+                        *sound_path = NULL;
+                }
+
+                /* Let the database lookup deal with this */
+                front_remove(theme, name, locale, profile);
+                return KA_ERROR_NOTFOUND;
+        }
+
+        return KA_SUCCESS;
+}
+
 int ka_cache_lookup_sound(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
@@ -486,6 +1543,9 @@ int ka_cache_lookup_sound(
         if (sound_path)
                 *sound_path = NULL;
 
+        if ((ret = front_lookup(f, sfopen, sound_path, theme, name, locale, profile)) != KA_ERROR_NOTFOUND)
+                return ret;
+
         if (!(key = build_key(theme, name, locale, profile, &klen)))
                 return KA_ERROR_OOM;
 
@@ -539,6 +1599,9 @@ int ka_cache_lookup_sound(
 
 finish:
 
+        if (ret >= 0)
+                front_store(key, klen, timestamp, *f ? (const char*) data + sizeof(uint32_t) : NULL);
+
         if (remove_entry)
                 db_remove(key, klen);
 
@@ -585,6 +1648,8 @@ int ka_cache_store_sound(
         if (fname)
                 strcpy((char*) data + sizeof(uint32_t), fname);
 
+        front_store(key, klen, (uint32_t) now, fname);
+
         ret = db_store(key, klen, data, dlen);
 
         ka_free(key);
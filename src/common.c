@@ -24,7 +24,9 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #include "kanberra.h"
 #include "common.h"
@@ -33,6 +35,8 @@
 #include "proplist.h"
 #include "macro.h"
 #include "fork-detect.h"
+#include "sound-theme-spec.h"
+#include "dsp.h"
 
 /**
  * SECTION:kanberra
@@ -146,6 +150,8 @@ int ka_context_create(ka_context **_c) {
                 return ret;
         }
 
+        ka_proplist_freeze(c->props);
+
         if ((d = getenv("KANBERRA_DRIVER"))) {
                 if ((ret = ka_context_set_driver(c, d)) < 0) {
                         ka_context_destroy(c);
@@ -376,7 +382,7 @@ int ka_context_change_props(ka_context *c, ...)  {
 
 int ka_context_change_props_full(ka_context *c, ka_proplist *p) {
         int ret;
-        ka_proplist *merged;
+        ka_proplist *merged, *old;
 
         ka_return_val_if_fail(!ka_detect_fork(), KA_ERROR_FORKED);
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
@@ -387,11 +393,18 @@ int ka_context_change_props_full(ka_context *c, ka_proplist *p) {
         if ((ret = ka_proplist_merge(&merged, c->props, p)) < 0)
                 goto finish;
 
+        /* The context properties are never modified in place, instead
+         * we replace them by a new immutable snapshot. Whoever still
+         * holds a reference to the old one can continue to use it
+         * without locking. */
+        ka_proplist_freeze(merged);
+
         ret = c->opened ? driver_change_props(c, p, merged) : KA_SUCCESS;
 
         if (ret == KA_SUCCESS) {
-                ka_assert_se(ka_proplist_destroy(c->props) == KA_SUCCESS);
+                old = c->props;
                 c->props = merged;
+                ka_assert_se(ka_proplist_destroy(old) == KA_SUCCESS);
         } else
                 ka_assert_se(ka_proplist_destroy(merged) == KA_SUCCESS);
 
@@ -488,31 +501,41 @@ int ka_context_play(ka_context *c, uint32_t id, ...) {
 int ka_context_play_full(ka_context *c, uint32_t id, ka_proplist *p, ka_finish_callback_t cb, void *userdata) {
         int ret;
         const char *t;
-        ka_bool_t enabled = TRUE;
+        ka_bool_t enabled = TRUE, valid;
+        ka_proplist *cp;
 
         ka_return_val_if_fail(!ka_detect_fork(), KA_ERROR_FORKED);
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(p, KA_ERROR_INVALID);
         ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
 
+        /* Take a reference to the current property snapshot, so that
+         * we can check it without holding the context lock */
         ka_mutex_lock(c->mutex);
+        cp = ka_proplist_ref(c->props);
+        ka_mutex_unlock(c->mutex);
 
-        ka_return_val_if_fail_unlock(ka_proplist_contains(p, KA_PROP_EVENT_ID) ||
-                                     ka_proplist_contains(c->props, KA_PROP_EVENT_ID) ||
-                                     ka_proplist_contains(p, KA_PROP_MEDIA_FILENAME) ||
-                                     ka_proplist_contains(c->props, KA_PROP_MEDIA_FILENAME), KA_ERROR_INVALID, c->mutex);
+        valid =
+                ka_proplist_contains_atom(p, KA_ATOM_EVENT_ID) ||
+                ka_proplist_contains_atom(cp, KA_ATOM_EVENT_ID) ||
+                ka_proplist_contains_atom(p, KA_ATOM_MEDIA_FILENAME) ||
+                ka_proplist_contains_atom(cp, KA_ATOM_MEDIA_FILENAME);
 
-        ka_mutex_lock(c->props->mutex);
-        if ((t = ka_proplist_gets_unlocked(c->props, KA_PROP_KANBERRA_ENABLE)))
+        if ((t = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_KANBERRA_ENABLE)))
                 enabled = !ka_streq(t, "0");
-        ka_mutex_unlock(c->props->mutex);
+
+        ka_assert_se(ka_proplist_destroy(cp) == KA_SUCCESS);
+
+        ka_return_val_if_fail(valid, KA_ERROR_INVALID);
 
         ka_mutex_lock(p->mutex);
-        if ((t = ka_proplist_gets_unlocked(p, KA_PROP_KANBERRA_ENABLE)))
+        if ((t = ka_proplist_gets_atom_unlocked(p, KA_ATOM_KANBERRA_ENABLE)))
                 enabled = !ka_streq(t, "0");
         ka_mutex_unlock(p->mutex);
 
-        ka_return_val_if_fail_unlock(enabled, KA_ERROR_DISABLED, c->mutex);
+        ka_return_val_if_fail(enabled, KA_ERROR_DISABLED);
+
+        ka_mutex_lock(c->mutex);
 
         if ((ret = context_open_unlocked(c)) < 0)
                 goto finish;
@@ -620,8 +643,8 @@ int ka_context_cache_full(ka_context *c, ka_proplist *p) {
 
         ka_mutex_lock(c->mutex);
 
-        ka_return_val_if_fail_unlock(ka_proplist_contains(p, KA_PROP_EVENT_ID) ||
-                                     ka_proplist_contains(c->props, KA_PROP_EVENT_ID), KA_ERROR_INVALID, c->mutex);
+        ka_return_val_if_fail_unlock(ka_proplist_contains_atom(p, KA_ATOM_EVENT_ID) ||
+                                     ka_proplist_contains_atom(c->props, KA_ATOM_EVENT_ID), KA_ERROR_INVALID, c->mutex);
 
         if ((ret = context_open_unlocked(c)) < 0)
                 goto finish;
@@ -637,6 +660,231 @@ finish:
         return ret;
 }
 
+/**
+ * ka_context_cache_full_async:
+ * @c: The context to use for uploading.
+ * @p: The property list for this event sound.
+ * @cb: A callback to call when the sample has been cached or caching failed, or NULL.
+ * @userdata: Some arbitrary user data to pass to the callback.
+ *
+ * Start uploading the specified sample into the server, like
+ * ka_context_cache_full(), but return right away instead of waiting
+ * for the upload to finish. Playing the sound in the meantime works,
+ * but might not use the cached version yet.
+ *
+ * It is guaranteed that the callback is called exactly once if
+ * ka_context_cache_full_async() returns KA_SUCCESS. Backends that
+ * cache synchronously call it before returning.
+ *
+ * If the backend doesn't support caching sound samples this function
+ * will return KA_ERROR_NOTSUPPORTED.
+ *
+ * Returns: 0 on success, negative error code on error.
+ *
+ * Since: 0.32
+ */
+int ka_context_cache_full_async(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata) {
+        int ret;
+
+        ka_return_val_if_fail(!ka_detect_fork(), KA_ERROR_FORKED);
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(p, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+
+        ka_mutex_lock(c->mutex);
+
+        ka_return_val_if_fail_unlock(ka_proplist_contains_atom(p, KA_ATOM_EVENT_ID) ||
+                                     ka_proplist_contains_atom(c->props, KA_ATOM_EVENT_ID), KA_ERROR_INVALID, c->mutex);
+
+        if ((ret = context_open_unlocked(c)) < 0)
+                goto finish;
+
+        ka_assert(c->opened);
+
+        ret = driver_cache_async(c, p, cb, userdata);
+
+finish:
+
+        ka_mutex_unlock(c->mutex);
+
+        return ret;
+}
+
+struct cache_theme {
+        ka_context *context;
+        ka_proplist *props;
+        ka_cache_callback_t callback;
+        void *userdata;
+
+        ka_mutex *mutex;
+        unsigned n_pending;
+        unsigned n_started;
+        int error;
+};
+
+static void cache_theme_done(struct cache_theme *t, int error) {
+        ka_bool_t last;
+
+        ka_mutex_lock(t->mutex);
+
+        /* Sounds the user disabled are not worth complaining about */
+        if (error < 0 && error != KA_ERROR_DISABLED && t->error == KA_SUCCESS)
+                t->error = error;
+
+        last = --t->n_pending <= 0;
+
+        ka_mutex_unlock(t->mutex);
+
+        if (!last)
+                return;
+
+        if (t->callback)
+                t->callback(t->context, t->error, t->userdata);
+
+        ka_mutex_free(t->mutex);
+        ka_free(t);
+}
+
+static void cache_theme_cb(ka_context *c, int error_code, void *userdata) {
+        cache_theme_done(userdata, error_code);
+}
+
+static int cache_theme_event(const char *name, void *userdata) {
+        struct cache_theme *t = userdata;
+        int ret;
+
+        if ((ret = ka_proplist_sets(t->props, KA_PROP_EVENT_ID, name)) < 0)
+                return ret;
+
+        ka_mutex_lock(t->mutex);
+        t->n_pending++;
+        ka_mutex_unlock(t->mutex);
+
+        /* The drivers are done with the props when this returns, so
+         * we can reuse them for the next event */
+        if ((ret = driver_cache_async(t->context, t->props, cache_theme_cb, t)) < 0) {
+                cache_theme_done(t, ret);
+
+                /* No point in trying the rest */
+                return ret == KA_ERROR_NOTSUPPORTED ? ret : KA_SUCCESS;
+        }
+
+        t->n_started++;
+
+        return KA_SUCCESS;
+}
+
+/**
+ * ka_context_cache_theme:
+ * @c: The context to use for uploading.
+ * @p: The properties selecting the theme and output profile, may be empty.
+ * @cb: A callback to call when all samples have been cached, or NULL.
+ * @userdata: Some arbitrary user data to pass to the callback.
+ *
+ * Upload the sounds for all events of a sound theme into the server,
+ * e.g. at session start. The theme and output profile are taken from
+ * %KA_PROP_KANBERRA_XDG_THEME_NAME and
+ * %KA_PROP_KANBERRA_XDG_THEME_OUTPUT_PROFILE in @p or the context
+ * properties, just like ka_context_play() would. The other properties
+ * of @p are attached to each sample.
+ *
+ * The uploads are started all at once and this function returns
+ * without waiting for them. If it returns KA_SUCCESS the callback is
+ * called exactly once when all of them finished, with the first error
+ * that occured, or KA_SUCCESS.
+ *
+ * If the backend doesn't support caching sound samples this function
+ * will return KA_ERROR_NOTSUPPORTED.
+ *
+ * Returns: 0 on success, negative error code on error.
+ *
+ * Since: 0.32
+ */
+int ka_context_cache_theme(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata) {
+        struct cache_theme *t = NULL;
+        ka_proplist *o = NULL;
+        ka_theme_data *theme = NULL;
+        int ret;
+
+        ka_return_val_if_fail(!ka_detect_fork(), KA_ERROR_FORKED);
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(p, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+
+        ka_mutex_lock(c->mutex);
+
+        if ((ret = context_open_unlocked(c)) < 0)
+                goto finish;
+
+        ka_assert(c->opened);
+
+        if (!(t = ka_new0(struct cache_theme, 1))) {
+                ret = KA_ERROR_OOM;
+                goto finish;
+        }
+
+        t->context = c;
+        t->callback = cb;
+        t->userdata = userdata;
+
+        /* This one is ours, dropped when all events have been tried */
+        t->n_pending = 1;
+
+        if (!(t->mutex = ka_mutex_new())) {
+                ret = KA_ERROR_OOM;
+                goto finish;
+        }
+
+        if ((ret = ka_proplist_create(&o)) < 0)
+                goto finish;
+
+        if ((ret = ka_proplist_sets(o, KA_PROP_KANBERRA_CACHE_CONTROL, "permanent")) < 0)
+                goto finish;
+
+        if ((ret = ka_proplist_merge(&t->props, p, o)) < 0)
+                goto finish;
+
+        ret = ka_theme_foreach_event(&theme, c->props, p, cache_theme_event, t);
+
+        ka_proplist_destroy(t->props);
+        t->props = NULL;
+
+        /* Unless at least one upload got going there is nothing to
+         * call back for */
+        if (t->n_started <= 0) {
+                if (ret == KA_SUCCESS)
+                        ret = t->error != KA_SUCCESS ? t->error : KA_ERROR_NOTFOUND;
+
+                goto finish;
+        }
+
+        cache_theme_done(t, ret);
+        t = NULL;
+        ret = KA_SUCCESS;
+
+finish:
+
+        if (t) {
+                if (t->props)
+                        ka_proplist_destroy(t->props);
+
+                if (t->mutex)
+                        ka_mutex_free(t->mutex);
+
+                ka_free(t);
+        }
+
+        if (o)
+                ka_proplist_destroy(o);
+
+        if (theme)
+                ka_theme_data_free(theme);
+
+        ka_mutex_unlock(c->mutex);
+
+        return ret;
+}
+
 /**
  * ka_strerror:
  * @code: Numerical error code as returned by a libkanberra API function
@@ -692,6 +940,115 @@ int ka_parse_cache_control(ka_cache_control_t *control, const char *c) {
         return KA_SUCCESS;
 }
 
+int ka_parse_latency(unsigned *usec, const char *msec) {
+        unsigned long l;
+        char *e;
+
+        ka_return_val_if_fail(usec, KA_ERROR_INVALID);
+        ka_return_val_if_fail(msec, KA_ERROR_INVALID);
+
+        if (*msec < '0' || *msec > '9')
+                return KA_ERROR_INVALID;
+
+        errno = 0;
+        l = strtoul(msec, &e, 10);
+
+        if (errno != 0 || *e || l > KA_LATENCY_MSEC_MAX)
+                return KA_ERROR_INVALID;
+
+        *usec = (unsigned) l * 1000U;
+
+        return KA_SUCCESS;
+}
+
+/* Looks up a property that may be given to play() to override the
+ * context's. The proplist may be NULL, in which case only the
+ * context's properties are looked at. Returns a copy of the value in
+ * *t, or NULL if neither has it. */
+static int dup_override(ka_context *c, ka_proplist *proplist, ka_prop_atom a, char **t) {
+        const char *v;
+
+        *t = NULL;
+
+        if (proplist) {
+                ka_proplist_lock(proplist);
+
+                if ((v = ka_proplist_gets_atom_unlocked(proplist, a)))
+                        *t = ka_strdup(v);
+
+                ka_proplist_unlock(proplist);
+
+                if (v)
+                        return *t ? KA_SUCCESS : KA_ERROR_OOM;
+        }
+
+        ka_proplist_lock(c->props);
+
+        if ((v = ka_proplist_gets_atom_unlocked(c->props, a)))
+                *t = ka_strdup(v);
+
+        ka_proplist_unlock(c->props);
+
+        return !v || *t ? KA_SUCCESS : KA_ERROR_OOM;
+}
+
+/* Not exported */
+int ka_get_volume(ka_context *c, ka_proplist *proplist, float *volume) {
+        char *t;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(volume, KA_ERROR_INVALID);
+
+        *volume = 1.0f;
+
+        if ((ret = dup_override(c, proplist, KA_ATOM_KANBERRA_VOLUME, &t)) < 0 || !t)
+                return ret;
+
+        ret = ka_dsp_parse_volume(volume, t);
+        ka_free(t);
+
+        return ret;
+}
+
+/* Not exported. Returns 0 in *latency if none was asked for. */
+int ka_get_latency(ka_context *c, ka_proplist *proplist, unsigned *latency) {
+        char *t;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(latency, KA_ERROR_INVALID);
+
+        *latency = 0;
+
+        if ((ret = dup_override(c, proplist, KA_ATOM_KANBERRA_LATENCY_MSEC, &t)) < 0 || !t)
+                return ret;
+
+        ret = ka_parse_latency(latency, t);
+        ka_free(t);
+
+        return ret;
+}
+
+/* Not exported */
+int ka_get_resample_quality(ka_context *c, ka_proplist *proplist, ka_resample_quality_t *quality) {
+        char *t;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(quality, KA_ERROR_INVALID);
+
+        *quality = KA_RESAMPLE_DEFAULT;
+
+        if ((ret = dup_override(c, proplist, KA_ATOM_KANBERRA_RESAMPLE_QUALITY, &t)) < 0 || !t)
+                return ret;
+
+        ret = ka_parse_resample_quality(quality, t);
+        ka_free(t);
+
+        return ret;
+}
+
 /**
  * ka_context_playing:
  * @c: the context to check if sound is still playing
@@ -26,6 +26,7 @@
 #include "kanberra.h"
 #include "macro.h"
 #include "mutex.h"
+#include "resampler.h"
 
 struct ka_context {
         ka_bool_t opened;
@@ -50,4 +51,13 @@ typedef enum ka_cache_control {
 
 int ka_parse_cache_control(ka_cache_control_t *control, const char *c);
 
+/* Latencies beyond this are refused */
+#define KA_LATENCY_MSEC_MAX (10000U)
+
+int ka_parse_latency(unsigned *usec, const char *msec);
+
+int ka_get_volume(ka_context *c, ka_proplist *proplist, float *volume);
+int ka_get_latency(ka_context *c, ka_proplist *proplist, unsigned *latency);
+int ka_get_resample_quality(ka_context *c, ka_proplist *proplist, ka_resample_quality_t *quality);
+
 #endif
@@ -34,6 +34,7 @@ int driver_change_props(ka_context *c, ka_proplist *changed, ka_proplist *merged
 int driver_play(ka_context *c, uint32_t id, ka_proplist *p, ka_finish_callback_t cb, void *userdata);
 int driver_cancel(ka_context *c, uint32_t id);
 int driver_cache(ka_context *c, ka_proplist *p);
+int driver_cache_async(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata);
 
 int driver_playing(ka_context *c, uint32_t id, int *playing);
 
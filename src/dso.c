@@ -44,6 +44,7 @@ struct private_dso {
         int (*driver_play)(ka_context *c, uint32_t id, ka_proplist *p, ka_finish_callback_t cb, void *userdata);
         int (*driver_cancel)(ka_context *c, uint32_t id);
         int (*driver_cache)(ka_context *c, ka_proplist *p);
+        int (*driver_cache_async)(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata);
         int (*driver_playing)(ka_context *c, uint32_t id, int *playing);
 };
 
@@ -261,6 +262,7 @@ int driver_open(ka_context *c) {
             !(p->driver_play = GET_FUNC_PTR(p->module, driver, "driver_play", int, (ka_context*, uint32_t, ka_proplist *, ka_finish_callback_t, void *))) ||
             !(p->driver_cancel = GET_FUNC_PTR(p->module, driver, "driver_cancel", int, (ka_context*, uint32_t))) ||
             !(p->driver_cache = GET_FUNC_PTR(p->module, driver, "driver_cache", int, (ka_context*, ka_proplist *))) ||
+            !(p->driver_cache_async = GET_FUNC_PTR(p->module, driver, "driver_cache_async", int, (ka_context*, ka_proplist *, ka_cache_callback_t, void *))) ||
             !(p->driver_playing = GET_FUNC_PTR(p->module, driver, "driver_playing", int, (ka_context*, uint32_t, int*)))) {
 
                 ka_free(driver);
@@ -366,6 +368,18 @@ int driver_cache(ka_context *c, ka_proplist *pl) {
         return p->driver_cache(c, pl);
 }
 
+int driver_cache_async(ka_context *c, ka_proplist *pl, ka_cache_callback_t cb, void *userdata) {
+        struct private_dso *p;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private_dso, KA_ERROR_STATE);
+
+        p = PRIVATE_DSO(c);
+        ka_return_val_if_fail(p->driver_cache_async, KA_ERROR_STATE);
+
+        return p->driver_cache_async(c, pl, cb, userdata);
+}
+
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         struct private_dso *p;
 
@@ -0,0 +1,557 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kanberra.h"
+#include "dsp.h"
+#include "macro.h"
+
+#if defined(__SSE2__)
+#define DSP_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* AVX2 kernels are compiled for the target with a function attribute
+ * and only called if the CPU supports them */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define DSP_AVX2 1
+#include <immintrin.h>
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+/* On 32bit ARM NEON is optional and lacks a rounding float
+ * conversion, so we only use it on AArch64 where it is always
+ * there */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define DSP_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct dsp_ops {
+        const char *name;
+        void (*swap_s16)(int16_t *d, const int16_t *s, size_t n);
+        void (*u8_to_s16)(int16_t *d, const uint8_t *s, size_t n);
+        void (*s16_to_f32)(float *d, const int16_t *s, size_t n);
+        void (*f32_to_s16)(int16_t *d, const float *s, size_t n);
+        void (*volume_s16)(int16_t *d, const int16_t *s, float volume, size_t n);
+        void (*mix_s16)(float *sum, const int16_t *s, float volume, size_t n);
+};
+
+/* Scalar versions. The vectorized ones use these for the tail. */
+
+static inline int16_t clip_s16(float v) {
+        if (v >= 32767.0f)
+                return 0x7FFF;
+        if (v <= -32768.0f)
+                return -0x8000;
+
+        return (int16_t) lrintf(v);
+}
+
+static void swap_s16_scalar(int16_t *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                d[i] = (int16_t) KA_UINT16_SWAP((uint16_t) s[i]);
+}
+
+static void u8_to_s16_scalar(int16_t *d, const uint8_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                d[i] = (int16_t) (((int) s[i] - 0x80) * 0x100);
+}
+
+static void s16_to_f32_scalar(float *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                d[i] = (float) s[i] * (1.0f / 32768.0f);
+}
+
+static void f32_to_s16_scalar(int16_t *d, const float *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                d[i] = clip_s16(s[i] * 32768.0f);
+}
+
+static void volume_s16_scalar(int16_t *d, const int16_t *s, float volume, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                d[i] = clip_s16((float) s[i] * volume);
+}
+
+static void mix_s16_scalar(float *sum, const int16_t *s, float volume, size_t n) {
+        float k = volume * (1.0f / 32768.0f);
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                sum[i] += (float) s[i] * k;
+}
+
+static const struct dsp_ops ops_scalar = {
+        .name = "scalar",
+        .swap_s16 = swap_s16_scalar,
+        .u8_to_s16 = u8_to_s16_scalar,
+        .s16_to_f32 = s16_to_f32_scalar,
+        .f32_to_s16 = f32_to_s16_scalar,
+        .volume_s16 = volume_s16_scalar,
+        .mix_s16 = mix_s16_scalar
+};
+
+#ifdef DSP_SSE2
+
+static inline void s16_to_ps_sse2(__m128i x, __m128 *lo, __m128 *hi) {
+        /* Sign extend by putting the samples in the upper half */
+        *lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        *hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+}
+
+static inline __m128i ps_to_s16_sse2(__m128 lo, __m128 hi) {
+        const __m128 max = _mm_set1_ps(32767.0f), min = _mm_set1_ps(-32768.0f);
+
+        /* Out of range values would convert to INT_MIN, so clamp
+         * first. Packing saturates, but is then a no-op. */
+        lo = _mm_min_ps(_mm_max_ps(lo, min), max);
+        hi = _mm_min_ps(_mm_max_ps(hi, min), max);
+
+        return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+
+static void swap_s16_sse2(int16_t *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m128i x = _mm_loadu_si128((const __m128i*) (s + i));
+
+                x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+                _mm_storeu_si128((__m128i*) (d + i), x);
+        }
+
+        swap_s16_scalar(d + i, s + i, n - i);
+}
+
+static void u8_to_s16_sse2(int16_t *d, const uint8_t *s, size_t n) {
+        const __m128i bias = _mm_set1_epi8((char) 0x80), zero = _mm_setzero_si128();
+        size_t i;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+                __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (s + i)), bias);
+
+                /* Interleaving with zero puts each byte in the upper
+                 * half of a 16bit sample */
+                _mm_storeu_si128((__m128i*) (d + i), _mm_unpacklo_epi8(zero, x));
+                _mm_storeu_si128((__m128i*) (d + i + 8), _mm_unpackhi_epi8(zero, x));
+        }
+
+        u8_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static void s16_to_f32_sse2(float *d, const int16_t *s, size_t n) {
+        const __m128 k = _mm_set1_ps(1.0f / 32768.0f);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m128 lo, hi;
+
+                s16_to_ps_sse2(_mm_loadu_si128((const __m128i*) (s + i)), &lo, &hi);
+                _mm_storeu_ps(d + i, _mm_mul_ps(lo, k));
+                _mm_storeu_ps(d + i + 4, _mm_mul_ps(hi, k));
+        }
+
+        s16_to_f32_scalar(d + i, s + i, n - i);
+}
+
+static void f32_to_s16_sse2(int16_t *d, const float *s, size_t n) {
+        const __m128 k = _mm_set1_ps(32768.0f);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m128 lo = _mm_mul_ps(_mm_loadu_ps(s + i), k);
+                __m128 hi = _mm_mul_ps(_mm_loadu_ps(s + i + 4), k);
+
+                _mm_storeu_si128((__m128i*) (d + i), ps_to_s16_sse2(lo, hi));
+        }
+
+        f32_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static void volume_s16_sse2(int16_t *d, const int16_t *s, float volume, size_t n) {
+        const __m128 k = _mm_set1_ps(volume);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m128 lo, hi;
+
+                s16_to_ps_sse2(_mm_loadu_si128((const __m128i*) (s + i)), &lo, &hi);
+                _mm_storeu_si128((__m128i*) (d + i), ps_to_s16_sse2(_mm_mul_ps(lo, k), _mm_mul_ps(hi, k)));
+        }
+
+        volume_s16_scalar(d + i, s + i, volume, n - i);
+}
+
+static void mix_s16_sse2(float *sum, const int16_t *s, float volume, size_t n) {
+        const __m128 k = _mm_set1_ps(volume * (1.0f / 32768.0f));
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                __m128 lo, hi;
+
+                s16_to_ps_sse2(_mm_loadu_si128((const __m128i*) (s + i)), &lo, &hi);
+                _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), _mm_mul_ps(lo, k)));
+                _mm_storeu_ps(sum + i + 4, _mm_add_ps(_mm_loadu_ps(sum + i + 4), _mm_mul_ps(hi, k)));
+        }
+
+        mix_s16_scalar(sum + i, s + i, volume, n - i);
+}
+
+static const struct dsp_ops ops_sse2 = {
+        .name = "sse2",
+        .swap_s16 = swap_s16_sse2,
+        .u8_to_s16 = u8_to_s16_sse2,
+        .s16_to_f32 = s16_to_f32_sse2,
+        .f32_to_s16 = f32_to_s16_sse2,
+        .volume_s16 = volume_s16_sse2,
+        .mix_s16 = mix_s16_sse2
+};
+
+#endif
+
+#ifdef DSP_AVX2
+
+static inline AVX2_FUNCTION __m256 s16_to_ps_avx2(const int16_t *s) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) s)));
+}
+
+static inline AVX2_FUNCTION __m128i ps_to_s16_avx2(__m256 x) {
+        __m256i i;
+
+        x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-32768.0f)), _mm256_set1_ps(32767.0f));
+        i = _mm256_cvtps_epi32(x);
+
+        return _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+}
+
+static AVX2_FUNCTION void swap_s16_avx2(int16_t *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+                __m256i x = _mm256_loadu_si256((const __m256i*) (s + i));
+
+                x = _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+                _mm256_storeu_si256((__m256i*) (d + i), x);
+        }
+
+        swap_s16_scalar(d + i, s + i, n - i);
+}
+
+static AVX2_FUNCTION void u8_to_s16_avx2(int16_t *d, const uint8_t *s, size_t n) {
+        const __m256i bias = _mm256_set1_epi16(0x80);
+        size_t i;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+                __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (s + i)));
+
+                _mm256_storeu_si256((__m256i*) (d + i), _mm256_slli_epi16(_mm256_sub_epi16(x, bias), 8));
+        }
+
+        u8_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static AVX2_FUNCTION void s16_to_f32_avx2(float *d, const int16_t *s, size_t n) {
+        const __m256 k = _mm256_set1_ps(1.0f / 32768.0f);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                _mm256_storeu_ps(d + i, _mm256_mul_ps(s16_to_ps_avx2(s + i), k));
+
+        s16_to_f32_scalar(d + i, s + i, n - i);
+}
+
+static AVX2_FUNCTION void f32_to_s16_avx2(int16_t *d, const float *s, size_t n) {
+        const __m256 k = _mm256_set1_ps(32768.0f);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                _mm_storeu_si128((__m128i*) (d + i), ps_to_s16_avx2(_mm256_mul_ps(_mm256_loadu_ps(s + i), k)));
+
+        f32_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static AVX2_FUNCTION void volume_s16_avx2(int16_t *d, const int16_t *s, float volume, size_t n) {
+        const __m256 k = _mm256_set1_ps(volume);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                _mm_storeu_si128((__m128i*) (d + i), ps_to_s16_avx2(_mm256_mul_ps(s16_to_ps_avx2(s + i), k)));
+
+        volume_s16_scalar(d + i, s + i, volume, n - i);
+}
+
+static AVX2_FUNCTION void mix_s16_avx2(float *sum, const int16_t *s, float volume, size_t n) {
+        const __m256 k = _mm256_set1_ps(volume * (1.0f / 32768.0f));
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                _mm256_storeu_ps(sum + i, _mm256_add_ps(_mm256_loadu_ps(sum + i), _mm256_mul_ps(s16_to_ps_avx2(s + i), k)));
+
+        mix_s16_scalar(sum + i, s + i, volume, n - i);
+}
+
+static const struct dsp_ops ops_avx2 = {
+        .name = "avx2",
+        .swap_s16 = swap_s16_avx2,
+        .u8_to_s16 = u8_to_s16_avx2,
+        .s16_to_f32 = s16_to_f32_avx2,
+        .f32_to_s16 = f32_to_s16_avx2,
+        .volume_s16 = volume_s16_avx2,
+        .mix_s16 = mix_s16_avx2
+};
+
+#endif
+
+#ifdef DSP_NEON
+
+static inline float32x4_t s16_to_ps_neon(int16x4_t x) {
+        return vcvtq_f32_s32(vmovl_s16(x));
+}
+
+static inline int16x8_t ps_to_s16_neon(float32x4_t lo, float32x4_t hi) {
+        /* The rounding conversion and the narrowing both saturate */
+        return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(lo)), vqmovn_s32(vcvtnq_s32_f32(hi)));
+}
+
+static void swap_s16_neon(int16_t *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                vst1q_s16(d + i, vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(vld1q_s16(s + i)))));
+
+        swap_s16_scalar(d + i, s + i, n - i);
+}
+
+static void u8_to_s16_neon(int16_t *d, const uint8_t *s, size_t n) {
+        const uint8x8_t bias = vdup_n_u8(0x80);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                uint16x8_t x = vshlq_n_u16(vmovl_u8(veor_u8(vld1_u8(s + i), bias)), 8);
+
+                vst1q_s16(d + i, vreinterpretq_s16_u16(x));
+        }
+
+        u8_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static void s16_to_f32_neon(float *d, const int16_t *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                int16x8_t x = vld1q_s16(s + i);
+
+                vst1q_f32(d + i, vmulq_n_f32(s16_to_ps_neon(vget_low_s16(x)), 1.0f / 32768.0f));
+                vst1q_f32(d + i + 4, vmulq_n_f32(s16_to_ps_neon(vget_high_s16(x)), 1.0f / 32768.0f));
+        }
+
+        s16_to_f32_scalar(d + i, s + i, n - i);
+}
+
+static void f32_to_s16_neon(int16_t *d, const float *s, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                vst1q_s16(d + i, ps_to_s16_neon(vmulq_n_f32(vld1q_f32(s + i), 32768.0f),
+                                                vmulq_n_f32(vld1q_f32(s + i + 4), 32768.0f)));
+
+        f32_to_s16_scalar(d + i, s + i, n - i);
+}
+
+static void volume_s16_neon(int16_t *d, const int16_t *s, float volume, size_t n) {
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                int16x8_t x = vld1q_s16(s + i);
+
+                vst1q_s16(d + i, ps_to_s16_neon(vmulq_n_f32(s16_to_ps_neon(vget_low_s16(x)), volume),
+                                                vmulq_n_f32(s16_to_ps_neon(vget_high_s16(x)), volume)));
+        }
+
+        volume_s16_scalar(d + i, s + i, volume, n - i);
+}
+
+static void mix_s16_neon(float *sum, const int16_t *s, float volume, size_t n) {
+        float k = volume * (1.0f / 32768.0f);
+        size_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                int16x8_t x = vld1q_s16(s + i);
+
+                vst1q_f32(sum + i, vmlaq_n_f32(vld1q_f32(sum + i), s16_to_ps_neon(vget_low_s16(x)), k));
+                vst1q_f32(sum + i + 4, vmlaq_n_f32(vld1q_f32(sum + i + 4), s16_to_ps_neon(vget_high_s16(x)), k));
+        }
+
+        mix_s16_scalar(sum + i, s + i, volume, n - i);
+}
+
+static const struct dsp_ops ops_neon = {
+        .name = "neon",
+        .swap_s16 = swap_s16_neon,
+        .u8_to_s16 = u8_to_s16_neon,
+        .s16_to_f32 = s16_to_f32_neon,
+        .f32_to_s16 = f32_to_s16_neon,
+        .volume_s16 = volume_s16_neon,
+        .mix_s16 = mix_s16_neon
+};
+
+#endif
+
+static const struct dsp_ops *const all_ops[] = {
+#ifdef DSP_AVX2
+        &ops_avx2,
+#endif
+#ifdef DSP_SSE2
+        &ops_sse2,
+#endif
+#ifdef DSP_NEON
+        &ops_neon,
+#endif
+        &ops_scalar
+};
+
+static const struct dsp_ops *ops = NULL;
+
+static ka_bool_t ops_supported(const struct dsp_ops *o) {
+#ifdef DSP_AVX2
+        if (o == &ops_avx2)
+                return !!__builtin_cpu_supports("avx2");
+#endif
+
+        return TRUE;
+}
+
+static void pick_ops_once(void) {
+        const char *e;
+        unsigned i;
+
+        /* Allow forcing a specific implementation, for testing */
+        if ((e = getenv("KANBERRA_DSP")))
+                for (i = 0; i < KA_ELEMENTSOF(all_ops); i++)
+                        if (ka_streq(e, all_ops[i]->name) && ops_supported(all_ops[i])) {
+                                ops = all_ops[i];
+                                return;
+                        }
+
+        /* The list is ordered by preference */
+        for (i = 0; i < KA_ELEMENTSOF(all_ops); i++)
+                if (ops_supported(all_ops[i])) {
+                        ops = all_ops[i];
+                        return;
+                }
+}
+
+static const struct dsp_ops *get_ops(void) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        /* This part is not portable due to pthread_once usage */
+        pthread_once(&once, pick_ops_once);
+
+        return ops;
+}
+
+void ka_dsp_to_s16ne(int16_t *d, const void *s, ka_sample_type_t type, size_t n) {
+        ka_return_if_fail(d);
+        ka_return_if_fail(s);
+
+        switch (type) {
+        case KA_SAMPLE_S16NE:
+                if (d != s)
+                        memcpy(d, s, n * sizeof(int16_t));
+                break;
+
+        case KA_SAMPLE_S16RE:
+                get_ops()->swap_s16(d, s, n);
+                break;
+
+        case KA_SAMPLE_U8:
+                get_ops()->u8_to_s16(d, s, n);
+                break;
+        }
+}
+
+void ka_dsp_s16_to_f32(float *d, const int16_t *s, size_t n) {
+        ka_return_if_fail(d);
+        ka_return_if_fail(s);
+
+        get_ops()->s16_to_f32(d, s, n);
+}
+
+void ka_dsp_f32_to_s16(int16_t *d, const float *s, size_t n) {
+        ka_return_if_fail(d);
+        ka_return_if_fail(s);
+
+        get_ops()->f32_to_s16(d, s, n);
+}
+
+void ka_dsp_volume_s16(int16_t *d, const int16_t *s, float volume, size_t n) {
+        ka_return_if_fail(d);
+        ka_return_if_fail(s);
+
+        get_ops()->volume_s16(d, s, volume, n);
+}
+
+void ka_dsp_mix_s16(float *sum, const int16_t *s, float volume, size_t n) {
+        ka_return_if_fail(sum);
+        ka_return_if_fail(s);
+
+        get_ops()->mix_s16(sum, s, volume, n);
+}
+
+int ka_dsp_parse_volume(float *volume, const char *dB) {
+        char *e = NULL;
+        double v;
+
+        ka_return_val_if_fail(volume, KA_ERROR_INVALID);
+        ka_return_val_if_fail(dB, KA_ERROR_INVALID);
+
+        errno = 0;
+        v = strtod(dB, &e);
+        if (errno != 0 || !e || *e || e == dB)
+                return KA_ERROR_INVALID;
+
+        *volume = (float) pow(10.0, v / 20.0);
+        return KA_SUCCESS;
+}
+
+const char *ka_dsp_get_name(void) {
+        return get_ops()->name;
+}
@@ -0,0 +1,64 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberradsphfoo
+#define fookanberradsphfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "read-sound-file.h"
+
+/* Sample conversion, volume and mixing for backends that write to
+ * the sound device themselves. The kernels are vectorized where the
+ * CPU allows it, the implementation is picked on first use.
+ *
+ * All lengths are in samples, not frames. Float samples are
+ * normalized to [-1, 1). Unless noted otherwise d and s may be the
+ * same buffer, but must not overlap otherwise. */
+
+/* Converts n samples of the given type to native endian S16. For
+ * KA_SAMPLE_U8 d and s must not overlap. */
+void ka_dsp_to_s16ne(int16_t *d, const void *s, ka_sample_type_t type, size_t n);
+
+void ka_dsp_s16_to_f32(float *d, const int16_t *s, size_t n);
+
+/* Saturates samples outside of [-1, 1) */
+void ka_dsp_f32_to_s16(int16_t *d, const float *s, size_t n);
+
+/* Scales by a linear factor, saturating */
+void ka_dsp_volume_s16(int16_t *d, const int16_t *s, float volume, size_t n);
+
+/* Adds s, scaled by a linear factor, to the float mix buffer sum. Mix
+ * any number of streams into one by calling this for each, then
+ * convert the sum back with ka_dsp_f32_to_s16(). */
+void ka_dsp_mix_s16(float *sum, const int16_t *s, float volume, size_t n);
+
+/* Parses a KA_PROP_KANBERRA_VOLUME value in dB into a linear factor */
+int ka_dsp_parse_volume(float *volume, const char *dB);
+
+#define ka_dsp_volume_is_unity(v) ((v) >= 1.0f && (v) <= 1.0f)
+
+/* Name of the implementation in use, for debugging */
+const char *ka_dsp_get_name(void);
+
+#endif
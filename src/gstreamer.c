@@ -43,12 +43,14 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "idmap.h"
 #include "malloc.h"
 
 struct outstanding {
         KA_LLIST_FIELDS(struct outstanding);
         ka_bool_t dead;
         uint32_t id;
+        ka_idmap_entry by_id;
         int err;
         ka_finish_callback_t callback;
         void *userdata;
@@ -68,6 +70,8 @@ struct private {
         ka_bool_t mgr_thread_running;
         ka_bool_t semaphore_allocated;
         KA_LLIST_HEAD(struct outstanding, outstanding);
+
+        ka_idmap *ids;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -119,6 +123,11 @@ int driver_open(ka_context *c) {
                 return KA_ERROR_OOM;
         }
 
+        if (ka_idmap_new(&p->ids) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_OOM;
+        }
+
         if (sem_init(&p->semaphore, 0, 0) < 0) {
                 driver_destroy(c);
                 return KA_ERROR_OOM;
@@ -179,6 +188,9 @@ int driver_destroy(ka_context *c) {
                 ka_mutex_free(p->outstanding_mutex);
         }
 
+        if (p->ids)
+                ka_idmap_free(p->ids);
+
         if (p->mgr_bus)
                 g_object_unref(p->mgr_bus);
 
@@ -384,7 +396,7 @@ static void* thread_func(void *userdata) {
                         out->callback(out->context, out->id, out->err, out->userdata);
 
                 ka_mutex_lock(p->outstanding_mutex);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
                 outstanding_free(out);
                 ka_mutex_unlock(p->outstanding_mutex);
 
@@ -494,7 +506,7 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
         f = NULL;
 
         ka_mutex_lock(p->outstanding_mutex);
-        KA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        KA_IDMAP_LINK(struct outstanding, p->outstanding, p->ids, out);
         ka_mutex_unlock(p->outstanding_mutex);
 
         if (gst_element_set_state(out->pipeline,
@@ -517,7 +529,7 @@ fail:
 
 int driver_cancel(ka_context *c, uint32_t id) {
         struct private *p;
-        struct outstanding *out = NULL;
+        ka_idmap_entry *e, *next;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(PRIVATE(c), KA_ERROR_STATE);
@@ -526,13 +538,13 @@ int driver_cancel(ka_context *c, uint32_t id) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out;/* out = out->next*/) {
-                struct outstanding *next;
+        for (e = ka_idmap_get(p->ids, id); e; e = next) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
 
-                if (out->id != id || out->pipeline == NULL || out->dead == TRUE) {
-                        out = out->next;
+                next = ka_idmap_next(e);
+
+                if (out->pipeline == NULL || out->dead == TRUE)
                         continue;
-                }
 
                 if (gst_element_set_state(out->pipeline, GST_STATE_NULL) ==
                     GST_STATE_CHANGE_FAILURE)
@@ -540,10 +552,8 @@ int driver_cancel(ka_context *c, uint32_t id) {
 
                 if (out->callback)
                         out->callback(c, out->id, KA_ERROR_CANCELED, out->userdata);
-                next = out->next;
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
                 outstanding_free(out);
-                out = next;
         }
 
         ka_mutex_unlock(p->outstanding_mutex);
@@ -563,9 +573,18 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
         return KA_ERROR_NOTSUPPORTED;
 }
 
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+        ka_return_val_if_fail(PRIVATE(c), KA_ERROR_STATE);
+
+        return KA_ERROR_NOTSUPPORTED;
+}
+
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -577,9 +596,10 @@ int driver_playing(ka_context *c, uint32_t id, int *playing) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
 
-                if (out->id != id || out->pipeline == NULL || out->dead == TRUE)
+                if (out->pipeline == NULL || out->dead == TRUE)
                         continue;
 
                 *playing = 1;
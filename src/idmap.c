@@ -0,0 +1,157 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "kanberra.h"
+#include "idmap.h"
+#include "malloc.h"
+#include "macro.h"
+
+#define N_BITS_MIN 4U
+#define N_BITS_MAX 24U
+
+struct ka_idmap {
+        ka_idmap_entry **buckets;
+
+        /* There are 1 << n_bits buckets */
+        unsigned n_bits;
+        unsigned n_entries;
+};
+
+static unsigned bucket(unsigned n_bits, uint32_t key) {
+
+        /* Application chosen ids are often small and consecutive,
+         * sink input indexes anyway, so we spread them with a
+         * multiplicative hash and take the upper bits */
+        return (unsigned) ((uint32_t) (key * 2654435761U) >> (32U - n_bits));
+}
+
+int ka_idmap_new(ka_idmap **_m) {
+        ka_idmap *m;
+
+        ka_return_val_if_fail(_m, KA_ERROR_INVALID);
+
+        if (!(m = ka_new0(ka_idmap, 1)))
+                return KA_ERROR_OOM;
+
+        m->n_bits = N_BITS_MIN;
+
+        if (!(m->buckets = ka_new0(ka_idmap_entry*, 1U << m->n_bits))) {
+                ka_free(m);
+                return KA_ERROR_OOM;
+        }
+
+        *_m = m;
+
+        return KA_SUCCESS;
+}
+
+void ka_idmap_free(ka_idmap *m) {
+        ka_return_if_fail(m);
+
+        ka_free(m->buckets);
+        ka_free(m);
+}
+
+static void link_entry(ka_idmap_entry **head, ka_idmap_entry *e) {
+
+        if ((e->next = *head))
+                e->next->prev = &e->next;
+
+        e->prev = head;
+        *head = e;
+}
+
+static void grow(ka_idmap *m) {
+        ka_idmap_entry **nb;
+        unsigned n_bits = m->n_bits + 1, i;
+
+        /* If we cannot grow the chains just get longer */
+        if (n_bits > N_BITS_MAX || !(nb = ka_new0(ka_idmap_entry*, 1U << n_bits)))
+                return;
+
+        for (i = 0; i < 1U << m->n_bits; i++) {
+                ka_idmap_entry *e;
+
+                while ((e = m->buckets[i])) {
+                        m->buckets[i] = e->next;
+                        link_entry(nb + bucket(n_bits, e->key), e);
+                }
+        }
+
+        ka_free(m->buckets);
+        m->buckets = nb;
+        m->n_bits = n_bits;
+}
+
+void ka_idmap_put(ka_idmap *m, uint32_t key, ka_idmap_entry *e) {
+        ka_return_if_fail(m);
+        ka_return_if_fail(e);
+        ka_return_if_fail(!e->prev);
+
+        if (m->n_entries >= 2U << m->n_bits)
+                grow(m);
+
+        e->key = key;
+        link_entry(m->buckets + bucket(m->n_bits, key), e);
+        m->n_entries++;
+}
+
+void ka_idmap_remove(ka_idmap *m, ka_idmap_entry *e) {
+        ka_return_if_fail(m);
+        ka_return_if_fail(e);
+
+        if (!e->prev)
+                return;
+
+        if ((*e->prev = e->next))
+                e->next->prev = e->prev;
+
+        e->next = NULL;
+        e->prev = NULL;
+
+        ka_assert(m->n_entries > 0);
+        m->n_entries--;
+}
+
+static ka_idmap_entry* find(ka_idmap_entry *e, uint32_t key) {
+
+        while (e && e->key != key)
+                e = e->next;
+
+        return e;
+}
+
+ka_idmap_entry* ka_idmap_get(ka_idmap *m, uint32_t key) {
+        ka_return_val_if_fail(m, NULL);
+
+        return find(m->buckets[bucket(m->n_bits, key)], key);
+}
+
+ka_idmap_entry* ka_idmap_next(ka_idmap_entry *e) {
+        ka_return_val_if_fail(e, NULL);
+
+        return find(e->next, e->key);
+}
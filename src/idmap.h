@@ -0,0 +1,83 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberraidmaphfoo
+#define fookanberraidmaphfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "llist.h"
+
+/* A hash table from uint32_t keys to the drivers' outstanding sounds,
+ * like KA_LLIST intrusive: the entry is embedded in what it indexes,
+ * so adding and removing never allocates or fails. A key may occur
+ * more than once. Locking is up to the user. */
+
+typedef struct ka_idmap_entry {
+        struct ka_idmap_entry *next;
+
+        /* The pointer pointing to us, NULL if not in a map */
+        struct ka_idmap_entry **prev;
+
+        uint32_t key;
+} ka_idmap_entry;
+
+typedef struct ka_idmap ka_idmap;
+
+#define KA_IDMAP_ITEM(e, type, member) ((type*) ((char*) (e) - offsetof(type, member)))
+
+int ka_idmap_new(ka_idmap **m);
+
+/* Entries still in the map are simply forgotten */
+void ka_idmap_free(ka_idmap *m);
+
+void ka_idmap_put(ka_idmap *m, uint32_t key, ka_idmap_entry *e);
+
+/* Does nothing if e is not in the map */
+void ka_idmap_remove(ka_idmap *m, ka_idmap_entry *e);
+
+/* The entries with the key, in no particular order. To remove
+ * entries while iterating get the next one before removing the
+ * current one. */
+ka_idmap_entry* ka_idmap_get(ka_idmap *m, uint32_t key);
+ka_idmap_entry* ka_idmap_next(ka_idmap_entry *e);
+
+/* The drivers keep their outstanding sounds in a KA_LLIST, to go
+ * through all of them, and in a ka_idmap by their id, for cancel()
+ * and playing(). These keep the two in step. The item needs an id
+ * and a ka_idmap_entry called by_id. */
+#define KA_IDMAP_LINK(t,head,map,item)                          \
+        do {                                                    \
+                t *_link_item = (item);                         \
+                KA_LLIST_PREPEND(t, head, _link_item);          \
+                ka_idmap_put(map, _link_item->id, &_link_item->by_id); \
+        } while (0)
+
+#define KA_IDMAP_UNLINK(t,head,map,item)                        \
+        do {                                                    \
+                t *_link_item = (item);                         \
+                KA_LLIST_REMOVE(t, head, _link_item);           \
+                ka_idmap_remove(map, &_link_item->by_id);       \
+        } while (0)
+
+#endif
@@ -493,6 +493,61 @@ extern "C" {
  */
 #define KA_PROP_KANBERRA_FORCE_CHANNEL             "kanberra.force_channel"
 
+/**
+ * KA_PROP_KANBERRA_SOFTWARE_MIX:
+ *
+ * A special property that can be set on the context to make backends
+ * that access the sound device directly keep one output stream open
+ * and mix all sounds into it in software, instead of opening the
+ * device for each sound. This lowers the latency until a sound
+ * starts and allows overlapping sounds on devices that cannot mix
+ * in hardware. The stream is closed again after the context has
+ * been idle for a few seconds. Set to "1" to enable, "0" to
+ * disable. Defaults to "0". This property is only honoured by some
+ * backends, other backends may choose to ignore it completely.
+ *
+ * If the list of properties is handed on to the sound server this
+ * property is stripped from it.
+ *
+ * Since: 0.32
+ */
+#define KA_PROP_KANBERRA_SOFTWARE_MIX              "kanberra.software-mix"
+
+/**
+ * KA_PROP_KANBERRA_RESAMPLE_QUALITY:
+ *
+ * A special property that can be set to choose how backends that
+ * access the sound device directly convert sounds whose sample rate
+ * the device does not support. One of "low", "medium" or "high",
+ * trading CPU time for quality. Defaults to "medium". This property
+ * is only honoured by some backends, other backends may choose to
+ * ignore it completely.
+ *
+ * If the list of properties is handed on to the sound server this
+ * property is stripped from it.
+ *
+ * Since: 0.32
+ */
+#define KA_PROP_KANBERRA_RESAMPLE_QUALITY          "kanberra.resample-quality"
+
+/**
+ * KA_PROP_KANBERRA_LATENCY_MSEC:
+ *
+ * A special property that can be set to the output latency, in
+ * milliseconds, that backends accessing the sound device directly
+ * shall configure the device's buffer for. Lower values make sounds
+ * start and stop more promptly at the cost of more wakeups. If not
+ * set the device defaults are used, which often amount to a second
+ * or more. This property is only honoured by some backends, other
+ * backends may choose to ignore it completely.
+ *
+ * If the list of properties is handed on to the sound server this
+ * property is stripped from it.
+ *
+ * Since: 0.32
+ */
+#define KA_PROP_KANBERRA_LATENCY_MSEC              "kanberra.latency-msec"
+
 /**
  * ka_context:
  *
@@ -517,6 +572,19 @@ typedef struct ka_context ka_context;
  */
 typedef void (*ka_finish_callback_t)(ka_context *c, uint32_t id, int error_code, void *userdata);
 
+/**
+ * ka_cache_callback_t:
+ * @c: The libkanberra context this callback is called for
+ * @error_code: A numerical error code describing the reason this callback is called. If KA_SUCCESS is passed the sample was successfully cached.
+ * @userdata: Some arbitrary user data the caller of ka_context_cache_full_async() passed in.
+ *
+ * Cache completion callback. The same restrictions as for
+ * ka_finish_callback_t apply.
+ *
+ * Since: 0.32
+ */
+typedef void (*ka_cache_callback_t)(ka_context *c, int error_code, void *userdata);
+
 /**
  * Error codes:
  * @KA_SUCCESS: Success
@@ -570,6 +638,8 @@ int ka_context_play_full(ka_context *c, uint32_t id, ka_proplist *p, ka_finish_c
 int ka_context_play(ka_context *c, uint32_t id, ...) __attribute__((sentinel));
 int ka_context_cache_full(ka_context *c, ka_proplist *p);
 int ka_context_cache(ka_context *c, ...) __attribute__((sentinel));
+int ka_context_cache_full_async(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata);
+int ka_context_cache_theme(ka_context *c, ka_proplist *p, ka_cache_callback_t cb, void *userdata);
 int ka_context_cancel(ka_context *c, uint32_t id);
 int ka_context_playing(ka_context *c, uint32_t id, int *playing);
 
@@ -174,6 +174,16 @@ static inline size_t ka_align(size_t l) {
 
 typedef void (*ka_free_cb_t)(void *);
 
+/* Atomic operations on an int, with a full memory barrier */
+#define ka_atomic_load(p) (__sync_add_and_fetch((p), 0))
+#define ka_atomic_cmpxchg(p, old, new) (__sync_bool_compare_and_swap((p), (old), (new)))
+#define ka_atomic_store(p, v)                                   \
+        do {                                                    \
+                __sync_synchronize();                           \
+                *(volatile typeof(*(p)) *) (p) = (v);           \
+                __sync_synchronize();                           \
+        } while (FALSE)
+
 #ifdef HAVE_BYTESWAP_H
 #include <byteswap.h>
 #endif
@@ -339,6 +339,59 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
         return ret;
 }
 
+struct cache_closure {
+        ka_context *context;
+        ka_cache_callback_t callback;
+        void *userdata;
+};
+
+static void call_cache_closure(ka_context *c, int error_code, void *userdata) {
+        struct cache_closure *closure = userdata;
+
+        closure->callback(closure->context, error_code, closure->userdata);
+        ka_free(closure);
+}
+
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        int ret = KA_SUCCESS;
+        struct private *p;
+        struct backend *b;
+        struct cache_closure *closure;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        if (cb) {
+                if (!(closure = ka_new(struct cache_closure, 1)))
+                        return KA_ERROR_OOM;
+
+                closure->context = c;
+                closure->callback = cb;
+                closure->userdata = userdata;
+        } else
+                closure = NULL;
+
+        /* The first backend that can cache this, takes it */
+        for (b = p->backends; b; b = b->next) {
+                int r;
+
+                if ((r = ka_context_cache_full_async(b->context, proplist, closure ? call_cache_closure : NULL, closure)) == KA_SUCCESS)
+                        return r;
+
+                /* We only return the first failure */
+                if (ret == KA_SUCCESS)
+                        ret = r;
+        }
+
+        ka_free(closure);
+
+        return ret;
+}
+
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         int ret = KA_SUCCESS;
         struct private *p;
@@ -26,6 +26,8 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mutex.h"
 #include "malloc.h"
@@ -34,6 +36,11 @@ struct ka_mutex {
         pthread_mutex_t mutex;
 };
 
+struct ka_cond {
+        pthread_cond_t cond;
+        clockid_t clock;
+};
+
 ka_mutex* ka_mutex_new(void) {
         ka_mutex *m;
 
@@ -78,3 +85,78 @@ void ka_mutex_unlock(ka_mutex *m) {
 
         ka_assert_se(pthread_mutex_unlock(&m->mutex) == 0);
 }
+
+ka_cond* ka_cond_new(void) {
+        pthread_condattr_t attr;
+        ka_cond *c;
+
+        if (!(c = ka_new(ka_cond, 1)))
+                return NULL;
+
+        if (pthread_condattr_init(&attr) != 0) {
+                ka_free(c);
+                return NULL;
+        }
+
+        /* Timeouts shouldn't depend on the wall clock being set */
+        c->clock = CLOCK_REALTIME;
+#if defined(_POSIX_MONOTONIC_CLOCK) && _POSIX_MONOTONIC_CLOCK >= 0
+        if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0)
+                c->clock = CLOCK_MONOTONIC;
+#endif
+
+        if (pthread_cond_init(&c->cond, &attr) != 0) {
+                pthread_condattr_destroy(&attr);
+                ka_free(c);
+                return NULL;
+        }
+
+        pthread_condattr_destroy(&attr);
+
+        return c;
+}
+
+void ka_cond_free(ka_cond *c) {
+        ka_assert(c);
+
+        ka_assert_se(pthread_cond_destroy(&c->cond) == 0);
+        ka_free(c);
+}
+
+void ka_cond_signal(ka_cond *c) {
+        ka_assert(c);
+
+        ka_assert_se(pthread_cond_signal(&c->cond) == 0);
+}
+
+void ka_cond_wait(ka_cond *c, ka_mutex *m) {
+        ka_assert(c);
+        ka_assert(m);
+
+        ka_assert_se(pthread_cond_wait(&c->cond, &m->mutex) == 0);
+}
+
+ka_bool_t ka_cond_timedwait(ka_cond *c, ka_mutex *m, unsigned long usec) {
+        struct timespec ts;
+        int r;
+
+        ka_assert(c);
+        ka_assert(m);
+
+        ka_assert_se(clock_gettime(c->clock, &ts) == 0);
+
+        ts.tv_sec += (time_t) (usec / 1000000UL);
+        ts.tv_nsec += (long) (usec % 1000000UL) * 1000L;
+
+        if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+        }
+
+        if ((r = pthread_cond_timedwait(&c->cond, &m->mutex, &ts)) != 0) {
+                ka_assert(r == ETIMEDOUT);
+                return FALSE;
+        }
+
+        return TRUE;
+}
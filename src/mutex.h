@@ -34,4 +34,14 @@ void ka_mutex_lock(ka_mutex *m);
 ka_bool_t ka_mutex_try_lock(ka_mutex *m);
 void ka_mutex_unlock(ka_mutex *m);
 
+typedef struct ka_cond ka_cond;
+
+ka_cond* ka_cond_new(void);
+void ka_cond_free(ka_cond *c);
+
+void ka_cond_signal(ka_cond *c);
+void ka_cond_wait(ka_cond *c, ka_mutex *m);
+/* Returns FALSE if the time ran out before we were signalled */
+ka_bool_t ka_cond_timedwait(ka_cond *c, ka_mutex *m, unsigned long usec);
+
 #endif
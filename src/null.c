@@ -84,3 +84,11 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
 
         return KA_ERROR_NOTSUPPORTED;
 }
+
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+
+        return KA_ERROR_NOTSUPPORTED;
+}
@@ -29,7 +29,6 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/uio.h>
-#include <math.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -54,29 +53,57 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "sample-cache.h"
+#include "dsp.h"
+#include "resampler.h"
+#include "wakeup.h"
+#include "idmap.h"
 #include "malloc.h"
 
 struct private;
 
+/* With KA_PROP_KANBERRA_LATENCY_MSEC set the buffer is split into
+ * this many fragments */
+#define N_FRAGMENTS (4U)
+
 struct outstanding {
         KA_LLIST_FIELDS(struct outstanding);
-        ka_bool_t dead;
+
+        /* Set atomically by whoever ends the sound first, see
+         * outstanding_kill() */
+        int dead;
+
         uint32_t id;
+        ka_idmap_entry by_id;
         ka_finish_callback_t callback;
         void *userdata;
         ka_sound_file *file;
         int pcm;
-        int pipe_fd[2];
+        ka_wakeup wakeup;
         ka_context *context;
+        float volume;
+        ka_resample_quality_t quality;
+
+        /* The requested latency, 0 for the device's default */
+        unsigned latency;
+        size_t fragment_size;
+
+        /* Set if the device runs at a rate other than the file's */
+        ka_resampler *resampler;
+        int16_t *resampled;
+        size_t resampled_size;
 };
 
 struct private {
         ka_theme_data *theme;
+        ka_sample_cache *samples;
         ka_mutex *outstanding_mutex;
         ka_bool_t signal_semaphore;
         sem_t semaphore;
         ka_bool_t semaphore_allocated;
         KA_LLIST_HEAD(struct outstanding, outstanding);
+
+        ka_idmap *ids;
 };
 
 #define PRIVATE(c) ((struct private *) ((c)->private))
@@ -84,11 +111,8 @@ struct private {
 static void outstanding_free(struct outstanding *o) {
         ka_assert(o);
 
-        if (o->pipe_fd[1] >= 0)
-                close(o->pipe_fd[1]);
-
-        if (o->pipe_fd[0] >= 0)
-                close(o->pipe_fd[0]);
+        if (o->wakeup.fd[0] >= 0)
+                ka_wakeup_done(&o->wakeup);
 
         if (o->file)
                 ka_sound_file_close(o->file);
@@ -98,9 +122,23 @@ static void outstanding_free(struct outstanding *o) {
                 o->pcm = -1;
         }
 
+        if (o->resampler)
+                ka_resampler_free(o->resampler);
+
+        ka_free(o->resampled);
         ka_free(o);
 }
 
+/* Ends the sound. Of the player thread and the application's threads
+ * exactly one gets TRUE and needs to call the callback. */
+static ka_bool_t outstanding_kill(struct outstanding *out) {
+        return ka_atomic_cmpxchg(&out->dead, FALSE, TRUE);
+}
+
+static ka_bool_t outstanding_dead(struct outstanding *out) {
+        return ka_atomic_load(&out->dead);
+}
+
 int driver_open(ka_context *c) {
         struct private *p;
 
@@ -116,6 +154,11 @@ int driver_open(ka_context *c) {
                 return KA_ERROR_OOM;
         }
 
+        if (ka_idmap_new(&p->ids) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_OOM;
+        }
+
         if (sem_init(&p->semaphore, 0, 0) < 0) {
                 driver_destroy(c);
                 return KA_ERROR_OOM;
@@ -123,6 +166,11 @@ int driver_open(ka_context *c) {
 
         p->semaphore_allocated = TRUE;
 
+        if (ka_sample_cache_new(&p->samples, KA_SAMPLE_CACHE_SIZE_MAX) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_OOM;
+        }
+
         return KA_SUCCESS;
 }
 
@@ -141,19 +189,14 @@ int driver_destroy(ka_context *c) {
                 /* Tell all player threads to terminate */
                 for (out = p->outstanding; out; out = out->next) {
 
-                        if (out->dead)
+                        if (!outstanding_kill(out))
                                 continue;
 
-                        out->dead = TRUE;
-
                         if (out->callback)
                                 out->callback(c, out->id, KA_ERROR_DESTROYED, out->userdata);
 
                         /* This will cause the thread to wakeup and terminate */
-                        if (out->pipe_fd[1] >= 0) {
-                                close(out->pipe_fd[1]);
-                                out->pipe_fd[1] = -1;
-                        }
+                        ka_wakeup_signal(&out->wakeup);
                 }
 
                 if (p->semaphore_allocated) {
@@ -170,9 +213,15 @@ int driver_destroy(ka_context *c) {
                 ka_mutex_free(p->outstanding_mutex);
         }
 
+        if (p->ids)
+                ka_idmap_free(p->ids);
+
         if (p->theme)
                 ka_theme_data_free(p->theme);
 
+        if (p->samples)
+                ka_sample_cache_free(p->samples);
+
         if (p->semaphore_allocated)
                 sem_destroy(&p->semaphore);
 
@@ -200,11 +249,73 @@ int driver_change_props(ka_context *c, ka_proplist *changed, ka_proplist *merged
         return KA_SUCCESS;
 }
 
+static int get_cache_control(ka_proplist *proplist, ka_cache_control_t *control) {
+        const char *ct;
+        int ret = KA_SUCCESS;
+
+        ka_mutex_lock(proplist->mutex);
+
+        if ((ct = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_CACHE_CONTROL)))
+                ret = ka_parse_cache_control(control, ct);
+
+        ka_mutex_unlock(proplist->mutex);
+
+        return ret;
+}
+
 int driver_cache(ka_context *c, ka_proplist *proplist) {
+        struct private *p;
+        ka_cache_control_t cache_control = KA_CACHE_CONTROL_PERMANENT;
+        ka_sound_file *f;
+        char *sp;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        p = PRIVATE(c);
+
+        if ((ret = get_cache_control(proplist, &cache_control)) < 0)
+                return ret;
+
+        if (cache_control != KA_CACHE_CONTROL_PERMANENT)
+                return KA_ERROR_INVALID;
+
+        if ((ret = ka_lookup_sound(&f, &sp, &p->theme, c->props, proplist)) < 0)
+                return ret;
+
+        /* Files passed via media.filename don't tell us their path */
+        if (sp)
+                ret = ka_sample_cache_get(p->samples, &f, sp, cache_control);
+        else
+                ret = KA_ERROR_NOTSUPPORTED;
+
+        if (f)
+                ka_sound_file_close(f);
+
+        ka_free(sp);
+
+        return ret;
+}
+
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        int ret;
+
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        /* We only decode into our own memory, which is quick enough
+         * to do right away */
+        if ((ret = driver_cache(c, proplist)) < 0)
+                return ret;
+
+        if (cb)
+                cb(c, KA_SUCCESS, userdata);
 
-        return KA_ERROR_NOTSUPPORTED;
+        return KA_SUCCESS;
 }
 
 static int translate_error(int error) {
@@ -233,6 +344,9 @@ static int translate_error(int error) {
 
 static int open_oss(ka_context *c, struct outstanding *out) {
         int mode, val, test, ret;
+        ka_bool_t force_s16 = FALSE;
+        ka_sample_type_t type;
+        unsigned rate = 0;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -242,6 +356,8 @@ static int open_oss(ka_context *c, struct outstanding *out) {
          * multichannel streams. We cannot support those files hence */
         ka_return_val_if_fail(ka_sound_file_get_nchannels(out->file) <= 2, KA_ERROR_NOTSUPPORTED);
 
+reopen:
+
         if ((out->pcm = open(c->device ? c->device : "/dev/dsp", O_WRONLY | O_NONBLOCK, 0)) < 0)
                 goto finish_errno;
 
@@ -253,7 +369,39 @@ static int open_oss(ka_context *c, struct outstanding *out) {
         if (fcntl(out->pcm, F_SETFL, mode) < 0)
                 goto finish_errno;
 
-        switch (ka_sound_file_get_sample_type(out->file)) {
+        /* With software volume or resampling we write converted S16NE
+         * data */
+        type = ka_dsp_volume_is_unity(out->volume) && !force_s16 ? ka_sound_file_get_sample_type(out->file) : KA_SAMPLE_S16NE;
+
+        /* Without a latency asked for we stay with the device's
+         * default fragments, which can be rather large. This has to
+         * come before everything else, so until we know the rate the
+         * device plays at we assume the file's. */
+        if (out->latency > 0) {
+                uint64_t bytes;
+                unsigned shift;
+
+                bytes = (uint64_t) (rate > 0 ? rate : ka_sound_file_get_rate(out->file)) * ka_sound_file_get_nchannels(out->file) *
+                        (type == KA_SAMPLE_U8 ? 1 : 2) * out->latency / N_FRAGMENTS / 1000000ULL;
+
+                for (shift = 4; shift < 16 && ((uint64_t) 1 << shift) < bytes; shift++)
+                        ;
+
+                /* This is only a hint that drivers may ignore */
+                val = (int) ((N_FRAGMENTS << 16) | shift);
+                ioctl(out->pcm, SNDCTL_DSP_SETFRAGMENT, &val);
+
+                out->fragment_size = (size_t) 1 << shift;
+        }
+
+#ifdef SNDCTL_DSP_COOKEDMODE
+        /* We'd rather resample ourselves than have the kernel do
+         * it. Not all implementations know this, so ignore errors. */
+        val = 0;
+        ioctl(out->pcm, SNDCTL_DSP_COOKEDMODE, &val);
+#endif
+
+        switch (type) {
         case KA_SAMPLE_U8:
                 val = AFMT_U8;
                 break;
@@ -291,13 +439,38 @@ static int open_oss(ka_context *c, struct outstanding *out) {
         if (ioctl(out->pcm, SNDCTL_DSP_SPEED, &val) < 0)
                 goto finish_errno;
 
-        /* Check to make sure the configured rate is close enough to the
-         * requested rate. */
-        if (fabs((double) (val - test)) > test * 0.05) {
+        if (val <= 0) {
                 ret = KA_ERROR_NOTSUPPORTED;
                 goto finish_ret;
         }
 
+        /* If the device doesn't do the file's rate we resample to
+         * what it does, which needs S16NE. Since neither the format
+         * nor the fragments can be changed after the rate we need to
+         * start over for that, and to size the fragments for the
+         * device's rate. */
+        if (val != test) {
+                if (rate == 0) {
+                        ka_bool_t again = out->latency > 0;
+
+                        rate = (unsigned) val;
+
+                        if (!force_s16 && ka_dsp_volume_is_unity(out->volume) && ka_sound_file_get_sample_type(out->file) != KA_SAMPLE_S16NE) {
+                                force_s16 = TRUE;
+                                again = TRUE;
+                        }
+
+                        if (again) {
+                                close(out->pcm);
+                                out->pcm = -1;
+                                goto reopen;
+                        }
+                }
+
+                if ((ret = ka_resampler_new(&out->resampler, ka_sound_file_get_nchannels(out->file), (unsigned) test, (unsigned) val, out->quality)) < 0)
+                        goto finish_ret;
+        }
+
         return KA_SUCCESS;
 
 finish_errno:
@@ -309,12 +482,42 @@ finish_ret:
 
 #define BUFSIZE (4*1024)
 
+/* Runs n_in S16NE frames through the resampler into
+ * out->resampled. With n_in 0 the resampler is drained instead. */
+static int resample(struct outstanding *out, const int16_t *in, size_t n_in, size_t *n_out) {
+        unsigned nchannels = ka_sound_file_get_nchannels(out->file);
+        size_t n;
+
+        n = ka_resampler_max_out(out->resampler, n_in);
+
+        if (n > out->resampled_size) {
+                ka_free(out->resampled);
+                out->resampled_size = 0;
+
+                if (!(out->resampled = ka_new(int16_t, n * nchannels)))
+                        return KA_ERROR_OOM;
+
+                out->resampled_size = n;
+        }
+
+        *n_out = n;
+
+        if (n_in > 0)
+                return ka_resampler_run(out->resampler, in, n_in, out->resampled, n_out);
+
+        return ka_resampler_drain(out->resampler, out->resampled, n_out);
+}
+
 static void* thread_func(void *userdata) {
         struct outstanding *out = userdata;
         int ret;
-        void *data, *d = NULL;
+        void *data = NULL;
+        int16_t *conv = NULL;
+        const void *d = NULL;
+        ka_bool_t mapped = TRUE;
         size_t fs, data_size;
         size_t nbytes = 0;
+        ka_bool_t convert;
         struct pollfd pfd[2];
         nfds_t n_pfd = 2;
         struct private *p;
@@ -324,14 +527,16 @@ static void* thread_func(void *userdata) {
         pthread_detach(pthread_self());
 
         fs = ka_sound_file_frame_size(out->file);
-        data_size = (BUFSIZE/fs)*fs;
 
-        if (!(data = ka_malloc(data_size))) {
-                ret = KA_ERROR_OOM;
-                goto finish;
-        }
+        /* With a low latency we write a fragment at a time */
+        if (out->fragment_size > 0 && out->fragment_size < BUFSIZE)
+                data_size = (KA_MAX(out->fragment_size, fs)/fs)*fs;
+        else
+                data_size = (BUFSIZE/fs)*fs;
 
-        pfd[0].fd = out->pipe_fd[0];
+        convert = !ka_dsp_volume_is_unity(out->volume) || out->resampler;
+
+        pfd[0].fd = ka_wakeup_fd(&out->wakeup);
         pfd[0].events = POLLIN;
         pfd[0].revents = 0;
         pfd[1].fd = out->pcm;
@@ -341,7 +546,7 @@ static void* thread_func(void *userdata) {
         for (;;) {
                 ssize_t bytes_written;
 
-                if (out->dead)
+                if (outstanding_dead(out))
                         break;
 
                 if (poll(pfd, n_pfd, -1) < 0) {
@@ -358,13 +563,69 @@ static void* thread_func(void *userdata) {
                         goto finish;
                 }
 
-                if (nbytes <= 0) {
+                while (nbytes <= 0) {
+                        ka_sample_type_t type;
+                        size_t n, n_out;
+
                         nbytes = data_size;
 
-                        if ((ret = ka_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
+                        /* If possible, write straight from the file's
+                         * memory, avoiding a copy into our own buffer */
+                        if (mapped) {
+                                if ((ret = ka_sound_file_map(out->file, &d, &nbytes)) == KA_ERROR_NOTSUPPORTED)
+                                        mapped = FALSE;
+                                else if (ret < 0)
+                                        goto finish;
+                        }
+
+                        if (!mapped) {
+                                if (!data && !(data = ka_malloc(data_size))) {
+                                        ret = KA_ERROR_OOM;
+                                        goto finish;
+                                }
+
+                                nbytes = data_size;
+
+                                if ((ret = ka_sound_file_read_arbitrary(out->file, data, &nbytes)) < 0)
+                                        goto finish;
+
+                                d = data;
+                        }
+
+                        if (!convert)
+                                break;
+
+                        type = ka_sound_file_get_sample_type(out->file);
+                        n = type == KA_SAMPLE_U8 ? nbytes : nbytes / sizeof(int16_t);
+
+                        if (!conv && !(conv = ka_new(int16_t, BUFSIZE))) {
+                                ret = KA_ERROR_OOM;
+                                goto finish;
+                        }
+
+                        ka_dsp_to_s16ne(conv, d, type, n);
+
+                        if (!ka_dsp_volume_is_unity(out->volume))
+                                ka_dsp_volume_s16(conv, conv, out->volume, n);
+
+                        d = conv;
+                        nbytes = n * sizeof(int16_t);
+
+                        if (!out->resampler)
+                                break;
+
+                        n /= ka_sound_file_get_nchannels(out->file);
+
+                        if ((ret = resample(out, conv, n, &n_out)) < 0)
                                 goto finish;
 
-                        d = data;
+                        d = out->resampled;
+                        nbytes = n_out * sizeof(int16_t) * ka_sound_file_get_nchannels(out->file);
+
+                        /* The resampler might have kept everything
+                         * for itself, in which case we read more */
+                        if (n <= 0)
+                                break;
                 }
 
                 if (nbytes <= 0)
@@ -376,7 +637,7 @@ static void* thread_func(void *userdata) {
                 }
 
                 nbytes -= (size_t) bytes_written;
-                d = (uint8_t*) d + (size_t) bytes_written;
+                d = (const uint8_t*) d + (size_t) bytes_written;
         }
 
         ret = KA_SUCCESS;
@@ -384,14 +645,15 @@ static void* thread_func(void *userdata) {
 finish:
 
         ka_free(data);
+        ka_free(conv);
 
-        if (!out->dead)
+        if (outstanding_kill(out))
                 if (out->callback)
                         out->callback(out->context, out->id, ret, out->userdata);
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+        KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
 
         if (!p->outstanding && p->signal_semaphore)
                 sem_post(&p->semaphore);
@@ -406,6 +668,8 @@ finish:
 int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_callback_t cb, void *userdata) {
         struct private *p;
         struct outstanding *out = NULL;
+        ka_cache_control_t cache_control = KA_CACHE_CONTROL_NEVER;
+        char *sp;
         int ret;
         pthread_t thread;
 
@@ -425,30 +689,53 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
         out->id = id;
         out->callback = cb;
         out->userdata = userdata;
-        out->pipe_fd[0] = out->pipe_fd[1] = -1;
+        out->wakeup.fd[0] = out->wakeup.fd[1] = -1;
         out->pcm = -1;
 
-        if (pipe(out->pipe_fd) < 0) {
-                ret = KA_ERROR_SYSTEM;
+        if ((ret = ka_wakeup_init(&out->wakeup)) < 0)
+                goto finish;
+
+        if ((ret = get_cache_control(proplist, &cache_control)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_volume(c, proplist, &out->volume)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_resample_quality(c, proplist, &out->quality)) < 0)
+                goto finish;
+
+        if ((ret = ka_get_latency(c, proplist, &out->latency)) < 0)
                 goto finish;
-        }
 
-        if ((ret = ka_lookup_sound(&out->file, NULL, &p->theme, c->props, proplist)) < 0)
+        if ((ret = ka_lookup_sound(&out->file, &sp, &p->theme, c->props, proplist)) < 0)
                 goto finish;
 
+        /* Play from the decoded sample cache if we are allowed to */
+        if (sp && cache_control != KA_CACHE_CONTROL_NEVER) {
+                ret = ka_sample_cache_get(p->samples, &out->file, sp, cache_control);
+                ka_free(sp);
+
+                /* Whatever kept the sound out of the cache, we can
+                 * still stream it, unless the file couldn't even be
+                 * opened again */
+                if (ret < 0 && !out->file)
+                        goto finish;
+        } else
+                ka_free(sp);
+
         if ((ret = open_oss(c, out)) < 0)
                 goto finish;
 
         /* OK, we're ready to go, so let's add this to our list */
         ka_mutex_lock(p->outstanding_mutex);
-        KA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+        KA_IDMAP_LINK(struct outstanding, p->outstanding, p->ids, out);
         ka_mutex_unlock(p->outstanding_mutex);
 
         if (pthread_create(&thread, NULL, thread_func, out) < 0) {
                 ret = KA_ERROR_OOM;
 
                 ka_mutex_lock(p->outstanding_mutex);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
                 ka_mutex_unlock(p->outstanding_mutex);
 
                 goto finish;
@@ -467,7 +754,7 @@ finish:
 
 int driver_cancel(ka_context *c, uint32_t id) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -476,24 +763,19 @@ int driver_cancel(ka_context *c, uint32_t id) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
-
-                if (out->id != id)
-                        continue;
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
 
-                if (out->dead)
+                if (!outstanding_kill(out))
                         continue;
 
-                out->dead = TRUE;
-
                 if (out->callback)
                         out->callback(c, out->id, KA_ERROR_CANCELED, out->userdata);
 
-                /* This will cause the thread to wakeup and terminate */
-                if (out->pipe_fd[1] >= 0) {
-                        close(out->pipe_fd[1]);
-                        out->pipe_fd[1] = -1;
-                }
+                /* This will cause the thread to wakeup and terminate,
+                 * it frees the sound only with outstanding_mutex
+                 * held */
+                ka_wakeup_signal(&out->wakeup);
         }
 
         ka_mutex_unlock(p->outstanding_mutex);
@@ -503,7 +785,7 @@ int driver_cancel(ka_context *c, uint32_t id) {
 
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -515,10 +797,9 @@ int driver_playing(ka_context *c, uint32_t id, int *playing) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
 
-                if (out->dead ||
-                    out->id != id)
+                if (outstanding_dead(KA_IDMAP_ITEM(e, struct outstanding, by_id)))
                         continue;
 
                 *playing = 1;
@@ -31,6 +31,65 @@
 #include "macro.h"
 #include "malloc.h"
 
+#define N_SLOTS_MIN 16
+#define ARENA_SIZE_MIN 512
+
+/* The hashes are what calc_hash() returns for the key. */
+static const struct {
+        const char *key;
+        unsigned hash;
+} atoms[_KA_ATOM_MAX] = {
+        { KA_PROP_MEDIA_NAME, 0x70ea9255U },
+        { KA_PROP_MEDIA_TITLE, 0xacc003ceU },
+        { KA_PROP_MEDIA_ARTIST, 0xcb532c91U },
+        { KA_PROP_MEDIA_LANGUAGE, 0x2c44b622U },
+        { KA_PROP_MEDIA_FILENAME, 0x60a674d1U },
+        { KA_PROP_MEDIA_ICON, 0x70e85443U },
+        { KA_PROP_MEDIA_ICON_NAME, 0xaeef1107U },
+        { KA_PROP_MEDIA_ROLE, 0x70ec9840U },
+        { KA_PROP_EVENT_ID, 0x109308efU },
+        { KA_PROP_EVENT_DESCRIPTION, 0x5b9e96a8U },
+        { KA_PROP_EVENT_MOUSE_X, 0x7eecf61bU },
+        { KA_PROP_EVENT_MOUSE_Y, 0x7eecf61cU },
+        { KA_PROP_EVENT_MOUSE_HPOS, 0x796dfc69U },
+        { KA_PROP_EVENT_MOUSE_VPOS, 0x7974599bU },
+        { KA_PROP_EVENT_MOUSE_BUTTON, 0xcbec3f6fU },
+        { KA_PROP_WINDOW_NAME, 0x6f6bcdc9U },
+        { KA_PROP_WINDOW_ID, 0xf31017d9U },
+        { KA_PROP_WINDOW_ICON, 0x6f698fb7U },
+        { KA_PROP_WINDOW_ICON_NAME, 0x0cecde13U },
+        { KA_PROP_WINDOW_X, 0xbd84a5faU },
+        { KA_PROP_WINDOW_Y, 0xbd84a5fbU },
+        { KA_PROP_WINDOW_WIDTH, 0x7e904248U },
+        { KA_PROP_WINDOW_HEIGHT, 0x39a90ce5U },
+        { KA_PROP_WINDOW_HPOS, 0x6f694c2aU },
+        { KA_PROP_WINDOW_VPOS, 0x6f6fa95cU },
+        { KA_PROP_WINDOW_DESKTOP, 0x286e8c1eU },
+        { KA_PROP_WINDOW_X11_DISPLAY, 0xa854046eU },
+        { KA_PROP_WINDOW_X11_SCREEN, 0xab14af40U },
+        { KA_PROP_WINDOW_X11_MONITOR, 0x8e5fa906U },
+        { KA_PROP_WINDOW_X11_XID, 0xedf1713fU },
+        { KA_PROP_APPLICATION_NAME, 0xfd568069U },
+        { KA_PROP_APPLICATION_ID, 0xb346f279U },
+        { KA_PROP_APPLICATION_VERSION, 0xe39ce23aU },
+        { KA_PROP_APPLICATION_ICON, 0xfd544257U },
+        { KA_PROP_APPLICATION_ICON_NAME, 0x70e8cf73U },
+        { KA_PROP_APPLICATION_LANGUAGE, 0xa6237a36U },
+        { KA_PROP_APPLICATION_PROCESS_ID, 0xcedbf858U },
+        { KA_PROP_APPLICATION_PROCESS_BINARY, 0x898010beU },
+        { KA_PROP_APPLICATION_PROCESS_USER, 0x87c4fbc8U },
+        { KA_PROP_APPLICATION_PROCESS_HOST, 0x87bf05a5U },
+        { KA_PROP_KANBERRA_CACHE_CONTROL, 0xc451424aU },
+        { KA_PROP_KANBERRA_VOLUME, 0xccd0c9e2U },
+        { KA_PROP_KANBERRA_XDG_THEME_NAME, 0xb574106aU },
+        { KA_PROP_KANBERRA_XDG_THEME_OUTPUT_PROFILE, 0x8ad1fffcU },
+        { KA_PROP_KANBERRA_ENABLE, 0xafbb084bU },
+        { KA_PROP_KANBERRA_FORCE_CHANNEL, 0x2cd77fe7U },
+        { KA_PROP_KANBERRA_SOFTWARE_MIX, 0x06e4fdfeU },
+        { KA_PROP_KANBERRA_RESAMPLE_QUALITY, 0xea3e9197U },
+        { KA_PROP_KANBERRA_LATENCY_MSEC, 0x246538fbU }
+};
+
 static unsigned calc_hash(const char *c) {
         unsigned hash = 0;
 
@@ -40,6 +99,30 @@ static unsigned calc_hash(const char *c) {
         return hash;
 }
 
+static ka_prop_atom find_atom(const char *key, unsigned hash) {
+        unsigned a;
+
+        for (a = 0; a < _KA_ATOM_MAX; a++)
+                if (atoms[a].hash == hash && ka_streq(atoms[a].key, key))
+                        return (ka_prop_atom) a;
+
+        return KA_ATOM_INVALID;
+}
+
+/* Not exported */
+ka_prop_atom ka_prop_atom_from_string(const char *key) {
+        ka_return_val_if_fail(key, KA_ATOM_INVALID);
+
+        return find_atom(key, calc_hash(key));
+}
+
+/* Not exported */
+const char *ka_prop_atom_to_string(ka_prop_atom a) {
+        ka_return_val_if_fail(a >= 0 && a < _KA_ATOM_MAX, NULL);
+
+        return atoms[a].key;
+}
+
 /**
  * ka_proplist_create:
  * @p: A pointer where to fill in a pointer for the new property list.
@@ -60,43 +143,212 @@ int ka_proplist_create(ka_proplist **_p) {
                 return KA_ERROR_OOM;
         }
 
+        p->n_ref = 1;
+
         *_p = p;
 
         return KA_SUCCESS;
 }
 
-static int _unset(ka_proplist *p, const char *key) {
-        ka_prop *prop, *nprop;
+struct ka_arena_chunk {
+        ka_arena_chunk *next;
+        size_t size;
+        size_t used;
+};
+
+#define CHUNK_DATA(c) ((char*) (c) + KA_ALIGN(sizeof(ka_arena_chunk)))
+
+/* Returns the prop for the key, or NULL if it isn't there. In that
+ * case *free_slot is set to where it should be inserted. */
+static ka_prop* lookup(ka_proplist *p, const char *key, unsigned hash, ka_prop ***free_slot) {
         unsigned i;
 
+        ka_assert(p);
+        ka_assert(key);
+
+        if (free_slot)
+                *free_slot = NULL;
+
+        if (p->n_slots <= 0)
+                return NULL;
+
+        /* The table is never full, so this terminates */
+        for (i = hash & (p->n_slots-1);; i = (i+1) & (p->n_slots-1)) {
+                ka_prop *prop = p->slots[i];
+
+                if (!prop) {
+                        if (free_slot)
+                                *free_slot = p->slots + i;
+
+                        return NULL;
+                }
+
+                if (prop->hash == hash && ka_streq(prop->key, key))
+                        return prop;
+        }
+}
+
+/* Makes sure the newest chunk has room for n more bytes */
+static int arena_reserve(ka_proplist *p, size_t n) {
+        ka_arena_chunk *c;
+        size_t size;
+
+        ka_assert(p);
+
+        if (p->arena && p->arena->used + n <= p->arena->size)
+                return KA_SUCCESS;
+
+        size = p->arena ? p->arena->size * 2 : ARENA_SIZE_MIN;
+        if (size < n)
+                size = n;
+
+        if (!(c = ka_malloc(KA_ALIGN(sizeof(ka_arena_chunk)) + size)))
+                return KA_ERROR_OOM;
+
+        c->size = size;
+        c->used = 0;
+        c->next = p->arena;
+        p->arena = c;
+
+        return KA_SUCCESS;
+}
+
+/* Chunks are never freed or moved before the list is destroyed, so
+ * what we return here stays put */
+static void* arena_alloc(ka_proplist *p, size_t n) {
+        void *r;
+
+        ka_assert(p);
+
+        n = KA_ALIGN(n);
+
+        if (arena_reserve(p, n) < 0)
+                return NULL;
+
+        r = CHUNK_DATA(p->arena) + p->arena->used;
+        p->arena->used += n;
+        p->arena_used += n;
+
+        return r;
+}
+
+/* Reallocates the table so that there is room for n_extra more
+ * props */
+static int grow_slots(ka_proplist *p, unsigned n_extra) {
+        unsigned n_slots, i;
+        ka_prop **slots;
+
+        ka_assert(p);
+
+        n_slots = N_SLOTS_MIN;
+        while ((p->n_props + n_extra) * 4 >= n_slots * 3)
+                n_slots *= 2;
+
+        if (n_slots <= p->n_slots)
+                return KA_SUCCESS;
+
+        if (!(slots = ka_new0(ka_prop*, n_slots)))
+                return KA_ERROR_OOM;
+
+        for (i = 0; i < p->n_slots; i++) {
+                ka_prop *prop = p->slots[i];
+                unsigned j;
+
+                if (!prop)
+                        continue;
+
+                for (j = prop->hash & (n_slots-1); slots[j]; j = (j+1) & (n_slots-1))
+                        ;
+
+                slots[j] = prop;
+        }
+
+        ka_free(p->slots);
+
+        p->slots = slots;
+        p->n_slots = n_slots;
+
+        return KA_SUCCESS;
+}
+
+static int _set(ka_proplist *p, const char *key, unsigned hash, ka_prop_atom a, const void *data, size_t nbytes) {
+        ka_prop *prop, **slot;
+        size_t l;
+        void *d;
+        int ret;
+
         ka_return_val_if_fail(p, KA_ERROR_INVALID);
         ka_return_val_if_fail(key, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!nbytes || data, KA_ERROR_INVALID);
 
-        i = calc_hash(key) % N_HASHTABLE;
+        /* Note that data might point into this very list. That's fine
+         * since nothing we allocated is ever moved or freed before the
+         * list is. */
 
-        nprop = NULL;
-        for (prop = p->prop_hashtable[i]; prop; nprop = prop, prop = prop->next_in_slot)
-                if (strcmp(prop->key, key) == 0)
-                        break;
+        if ((prop = lookup(p, key, hash, &slot))) {
 
-        if (prop) {
-                if (nprop)
-                        nprop->next_in_slot = prop->next_in_slot;
-                else
-                        p->prop_hashtable[i] = prop->next_in_slot;
+                /* If the new value fits into the space of the old one
+                 * we can just overwrite it */
+                if (KA_ALIGN(prop->nbytes) >= nbytes) {
+                        memmove(prop->data, data, nbytes);
+                        prop->nbytes = nbytes;
+                        return KA_SUCCESS;
+                }
 
-                if (prop->prev_item)
-                        prop->prev_item->next_item = prop->next_item;
-                else
-                        p->first_item = prop->next_item;
+                if (!(d = arena_alloc(p, nbytes)))
+                        return KA_ERROR_OOM;
 
-                if (prop->next_item)
-                        prop->next_item->prev_item = prop->prev_item;
+                memcpy(d, data, nbytes);
+                prop->data = d;
+                prop->nbytes = nbytes;
 
-                ka_free(prop->key);
-                ka_free(prop);
+                return KA_SUCCESS;
         }
 
+        if ((p->n_props + 1) * 4 >= p->n_slots * 3) {
+                if ((ret = grow_slots(p, 1)) < 0)
+                        return ret;
+
+                lookup(p, key, hash, &slot);
+        }
+
+        ka_assert(slot);
+
+        /* Well-known keys are not copied */
+        l = a != KA_ATOM_INVALID ? 0 : strlen(key)+1;
+
+        if (!(prop = arena_alloc(p, KA_ALIGN(sizeof(ka_prop)) + KA_ALIGN(l) + nbytes)))
+                return KA_ERROR_OOM;
+
+        prop->hash = hash;
+        prop->atom = a;
+        prop->next_item = NULL;
+
+        if (a != KA_ATOM_INVALID) {
+                prop->key = atoms[a].key;
+                p->atom_prop[a] = prop;
+                prop->data = (char*) prop + KA_ALIGN(sizeof(ka_prop));
+        } else {
+                char *k = (char*) prop + KA_ALIGN(sizeof(ka_prop));
+
+                memcpy(k, key, l);
+                prop->key = k;
+                prop->data = k + KA_ALIGN(l);
+        }
+
+        memcpy(prop->data, data, nbytes);
+        prop->nbytes = nbytes;
+
+        if (p->last_item)
+                p->last_item->next_item = prop;
+        else
+                p->first_item = prop;
+
+        p->last_item = prop;
+
+        *slot = prop;
+        p->n_props++;
+
         return KA_SUCCESS;
 }
 
@@ -135,36 +387,29 @@ int ka_proplist_sets(ka_proplist *p, const char *key, const char *value) {
 
 int ka_proplist_setf(ka_proplist *p, const char *key, const char *format, ...) {
         int ret;
-        char *k;
-        ka_prop *prop;
-        size_t size = 100;
+        char buf[256], *v = buf;
+        size_t size = sizeof(buf);
         unsigned h;
 
         ka_return_val_if_fail(p, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!p->frozen, KA_ERROR_STATE);
         ka_return_val_if_fail(key, KA_ERROR_INVALID);
         ka_return_val_if_fail(format, KA_ERROR_INVALID);
 
-        if (!(k = ka_strdup(key)))
-                return KA_ERROR_OOM;
-
+        /* Most values fit on the stack, only go to the heap for the
+         * rest */
         for (;;) {
                 va_list ap;
                 int r;
 
-                if (!(prop = ka_malloc(KA_ALIGN(sizeof(ka_prop)) + size))) {
-                        ka_free(k);
-                        return KA_ERROR_OOM;
-                }
-
-
                 va_start(ap, format);
-                r = vsnprintf(KA_PROP_DATA(prop), size, format, ap);
+                r = vsnprintf(v, size, format, ap);
                 va_end(ap);
 
-                ((char*) KA_PROP_DATA(prop))[size-1] = 0;
+                v[size-1] = 0;
 
                 if (r > -1 && (size_t) r < size) {
-                        prop->nbytes = (size_t) r+1;
+                        size = (size_t) r+1;
                         break;
                 }
 
@@ -173,33 +418,22 @@ int ka_proplist_setf(ka_proplist *p, const char *key, const char *format, ...) {
                 else           /* glibc 2.0 */
                         size *= 2;
 
-                ka_free(prop);
-        }
-
-        prop->key = k;
+                if (v != buf)
+                        ka_free(v);
 
-        ka_mutex_lock(p->mutex);
-
-        if ((ret = _unset(p, key)) < 0) {
-                ka_free(prop);
-                ka_free(k);
-                goto finish;
+                if (!(v = ka_malloc(size)))
+                        return KA_ERROR_OOM;
         }
 
-        h = calc_hash(key) % N_HASHTABLE;
-
-        prop->next_in_slot = p->prop_hashtable[h];
-        p->prop_hashtable[h] = prop;
-
-        prop->prev_item = NULL;
-        if ((prop->next_item = p->first_item))
-                prop->next_item->prev_item = prop;
-        p->first_item = prop;
-
-finish:
+        h = calc_hash(key);
 
+        ka_mutex_lock(p->mutex);
+        ret = _set(p, key, h, find_atom(key, h), v, size);
         ka_mutex_unlock(p->mutex);
 
+        if (v != buf)
+                ka_free(v);
+
         return ret;
 }
 
@@ -217,46 +451,33 @@ finish:
 
 int ka_proplist_set(ka_proplist *p, const char *key, const void *data, size_t nbytes) {
         int ret;
-        char *k;
-        ka_prop *prop;
         unsigned h;
 
         ka_return_val_if_fail(p, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!p->frozen, KA_ERROR_STATE);
         ka_return_val_if_fail(key, KA_ERROR_INVALID);
         ka_return_val_if_fail(!nbytes || data, KA_ERROR_INVALID);
 
-        if (!(k = ka_strdup(key)))
-                return KA_ERROR_OOM;
-
-        if (!(prop = ka_malloc(KA_ALIGN(sizeof(ka_prop)) + nbytes))) {
-                ka_free(k);
-                return KA_ERROR_OOM;
-        }
-
-        prop->key = k;
-        prop->nbytes = nbytes;
-        memcpy(KA_PROP_DATA(prop), data, nbytes);
+        h = calc_hash(key);
 
         ka_mutex_lock(p->mutex);
+        ret = _set(p, key, h, find_atom(key, h), data, nbytes);
+        ka_mutex_unlock(p->mutex);
 
-        if ((ret = _unset(p, key)) < 0) {
-                ka_free(prop);
-                ka_free(k);
-                goto finish;
-        }
-
-        h = calc_hash(key) % N_HASHTABLE;
-
-        prop->next_in_slot = p->prop_hashtable[h];
-        p->prop_hashtable[h] = prop;
+        return ret;
+}
 
-        prop->prev_item = NULL;
-        if ((prop->next_item = p->first_item))
-                prop->next_item->prev_item = prop;
-        p->first_item = prop;
+/* Not exported */
+int ka_proplist_sets_atom(ka_proplist *p, ka_prop_atom a, const char *value) {
+        int ret;
 
-finish:
+        ka_return_val_if_fail(p, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!p->frozen, KA_ERROR_STATE);
+        ka_return_val_if_fail(a >= 0 && a < _KA_ATOM_MAX, KA_ERROR_INVALID);
+        ka_return_val_if_fail(value, KA_ERROR_INVALID);
 
+        ka_mutex_lock(p->mutex);
+        ret = _set(p, atoms[a].key, atoms[a].hash, a, value, strlen(value)+1);
         ka_mutex_unlock(p->mutex);
 
         return ret;
@@ -264,19 +485,10 @@ finish:
 
 /* Not exported, not self-locking */
 ka_prop* ka_proplist_get_unlocked(ka_proplist *p, const char *key) {
-        ka_prop *prop;
-        unsigned i;
-
         ka_return_val_if_fail(p, NULL);
         ka_return_val_if_fail(key, NULL);
 
-        i = calc_hash(key) % N_HASHTABLE;
-
-        for (prop = p->prop_hashtable[i]; prop; prop = prop->next_in_slot)
-                if (strcmp(prop->key, key) == 0)
-                        return prop;
-
-        return NULL;
+        return lookup(p, key, calc_hash(key), NULL);
 }
 
 /* Not exported, not self-locking */
@@ -295,6 +507,39 @@ const char* ka_proplist_gets_unlocked(ka_proplist *p, const char *key) {
         return KA_PROP_DATA(prop);
 }
 
+/* Not exported, not self-locking */
+ka_prop* ka_proplist_get_atom_unlocked(ka_proplist *p, ka_prop_atom a) {
+        ka_return_val_if_fail(p, NULL);
+        ka_return_val_if_fail(a >= 0 && a < _KA_ATOM_MAX, NULL);
+
+        return p->atom_prop[a];
+}
+
+/* Not exported, not self-locking */
+const char* ka_proplist_gets_atom_unlocked(ka_proplist *p, ka_prop_atom a) {
+        ka_prop *prop;
+
+        if (!(prop = ka_proplist_get_atom_unlocked(p, a)))
+                return NULL;
+
+        if (!memchr(KA_PROP_DATA(prop), 0, prop->nbytes))
+                return NULL;
+
+        return KA_PROP_DATA(prop);
+}
+
+/* Not exported, not self-locking */
+ka_prop* ka_proplist_next_unlocked(ka_proplist *p, ka_prop *prop) {
+        ka_return_val_if_fail(p, NULL);
+
+        return prop ? prop->next_item : p->first_item;
+}
+
+/* Not exported, not self-locking */
+ka_prop* ka_proplist_first_unlocked(ka_proplist *p) {
+        return ka_proplist_next_unlocked(p, NULL);
+}
+
 /**
  * ka_proplist_destroy:
  * @p: The property list to destroy
@@ -305,16 +550,27 @@ const char* ka_proplist_gets_unlocked(ka_proplist *p, const char *key) {
  */
 
 int ka_proplist_destroy(ka_proplist *p) {
-        ka_prop *prop, *nprop;
+        unsigned n;
 
         ka_return_val_if_fail(p, KA_ERROR_INVALID);
 
-        for (prop = p->first_item; prop; prop = nprop) {
-                nprop = prop->next_item;
-                ka_free(prop->key);
-                ka_free(prop);
+        /* Snapshots might still be referenced elsewhere */
+        ka_mutex_lock(p->mutex);
+        ka_assert(p->n_ref >= 1);
+        n = --p->n_ref;
+        ka_mutex_unlock(p->mutex);
+
+        if (n > 0)
+                return KA_SUCCESS;
+
+        while (p->arena) {
+                ka_arena_chunk *c = p->arena;
+
+                p->arena = c->next;
+                ka_free(c);
         }
 
+        ka_free(p->slots);
         ka_mutex_free(p->mutex);
 
         ka_free(p);
@@ -322,6 +578,27 @@ int ka_proplist_destroy(ka_proplist *p) {
         return KA_SUCCESS;
 }
 
+/* Not exported */
+ka_proplist* ka_proplist_ref(ka_proplist *p) {
+        ka_return_val_if_fail(p, NULL);
+
+        ka_mutex_lock(p->mutex);
+        ka_assert(p->n_ref >= 1);
+        p->n_ref++;
+        ka_mutex_unlock(p->mutex);
+
+        return p;
+}
+
+/* Not exported. After this call the list may not be changed anymore,
+ * but may be shared between threads without locking. */
+void ka_proplist_freeze(ka_proplist *p) {
+        ka_return_if_fail(p);
+
+        p->frozen = TRUE;
+}
+
+/* a must be new and hence not visible to anybody else yet */
 static int merge_into(ka_proplist *a, ka_proplist *b) {
         int ret = KA_SUCCESS;
         ka_prop *prop;
@@ -329,19 +606,21 @@ static int merge_into(ka_proplist *a, ka_proplist *b) {
         ka_return_val_if_fail(a, KA_ERROR_INVALID);
         ka_return_val_if_fail(b, KA_ERROR_INVALID);
 
-        ka_mutex_lock(b->mutex);
+        ka_proplist_lock(b);
 
-        for (prop = b->first_item; prop; prop = prop->next_item)
-                if ((ret = ka_proplist_set(a, prop->key, KA_PROP_DATA(prop), prop->nbytes)) < 0)
+        for (prop = ka_proplist_first_unlocked(b); prop; prop = ka_proplist_next_unlocked(b, prop))
+                if ((ret = _set(a, prop->key, prop->hash, prop->atom, KA_PROP_DATA(prop), prop->nbytes)) < 0)
                         break;
 
-        ka_mutex_unlock(b->mutex);
+        ka_proplist_unlock(b);
 
         return ret;
 }
 
 int ka_proplist_merge(ka_proplist **_a, ka_proplist *b, ka_proplist *c) {
         ka_proplist *a;
+        unsigned n;
+        size_t size;
         int ret;
 
         ka_return_val_if_fail(_a, KA_ERROR_INVALID);
@@ -351,7 +630,22 @@ int ka_proplist_merge(ka_proplist **_a, ka_proplist *b, ka_proplist *c) {
         if ((ret = ka_proplist_create(&a)) < 0)
                 return ret;
 
-        if ((ret = merge_into(a, b)) < 0 ||
+        /* Size the new list so that everything fits right away. This
+         * might be more than needed, as b and c may still hold values
+         * that have been overwritten since. */
+        ka_proplist_lock(b);
+        n = b->n_props;
+        size = b->arena_used;
+        ka_proplist_unlock(b);
+
+        ka_proplist_lock(c);
+        n += c->n_props;
+        size += c->arena_used;
+        ka_proplist_unlock(c);
+
+        if ((ret = grow_slots(a, n)) < 0 ||
+            (ret = arena_reserve(a, size)) < 0 ||
+            (ret = merge_into(a, b)) < 0 ||
             (ret = merge_into(a, c)) < 0) {
                 ka_proplist_destroy(a);
                 return ret;
@@ -367,9 +661,22 @@ ka_bool_t ka_proplist_contains(ka_proplist *p, const char *key) {
         ka_return_val_if_fail(p, FALSE);
         ka_return_val_if_fail(key, FALSE);
 
-        ka_mutex_lock(p->mutex);
+        ka_proplist_lock(p);
         b = !!ka_proplist_get_unlocked(p, key);
-        ka_mutex_unlock(p->mutex);
+        ka_proplist_unlock(p);
+
+        return b;
+}
+
+ka_bool_t ka_proplist_contains_atom(ka_proplist *p, ka_prop_atom a) {
+        ka_bool_t b;
+
+        ka_return_val_if_fail(p, FALSE);
+        ka_return_val_if_fail(a >= 0 && a < _KA_ATOM_MAX, FALSE);
+
+        ka_proplist_lock(p);
+        b = !!p->atom_prop[a];
+        ka_proplist_unlock(p);
 
         return b;
 }
@@ -28,29 +28,141 @@
 #include "kanberra.h"
 #include "mutex.h"
 
-#define N_HASHTABLE 31
+/* Atoms for the well-known KA_PROP_xxx keys, which may be used to
+ * look them up without hashing or comparing strings. Keep this in sync
+ * with the table in proplist.c. */
+typedef enum ka_prop_atom {
+        KA_ATOM_MEDIA_NAME,
+        KA_ATOM_MEDIA_TITLE,
+        KA_ATOM_MEDIA_ARTIST,
+        KA_ATOM_MEDIA_LANGUAGE,
+        KA_ATOM_MEDIA_FILENAME,
+        KA_ATOM_MEDIA_ICON,
+        KA_ATOM_MEDIA_ICON_NAME,
+        KA_ATOM_MEDIA_ROLE,
+        KA_ATOM_EVENT_ID,
+        KA_ATOM_EVENT_DESCRIPTION,
+        KA_ATOM_EVENT_MOUSE_X,
+        KA_ATOM_EVENT_MOUSE_Y,
+        KA_ATOM_EVENT_MOUSE_HPOS,
+        KA_ATOM_EVENT_MOUSE_VPOS,
+        KA_ATOM_EVENT_MOUSE_BUTTON,
+        KA_ATOM_WINDOW_NAME,
+        KA_ATOM_WINDOW_ID,
+        KA_ATOM_WINDOW_ICON,
+        KA_ATOM_WINDOW_ICON_NAME,
+        KA_ATOM_WINDOW_X,
+        KA_ATOM_WINDOW_Y,
+        KA_ATOM_WINDOW_WIDTH,
+        KA_ATOM_WINDOW_HEIGHT,
+        KA_ATOM_WINDOW_HPOS,
+        KA_ATOM_WINDOW_VPOS,
+        KA_ATOM_WINDOW_DESKTOP,
+        KA_ATOM_WINDOW_X11_DISPLAY,
+        KA_ATOM_WINDOW_X11_SCREEN,
+        KA_ATOM_WINDOW_X11_MONITOR,
+        KA_ATOM_WINDOW_X11_XID,
+        KA_ATOM_APPLICATION_NAME,
+        KA_ATOM_APPLICATION_ID,
+        KA_ATOM_APPLICATION_VERSION,
+        KA_ATOM_APPLICATION_ICON,
+        KA_ATOM_APPLICATION_ICON_NAME,
+        KA_ATOM_APPLICATION_LANGUAGE,
+        KA_ATOM_APPLICATION_PROCESS_ID,
+        KA_ATOM_APPLICATION_PROCESS_BINARY,
+        KA_ATOM_APPLICATION_PROCESS_USER,
+        KA_ATOM_APPLICATION_PROCESS_HOST,
+        KA_ATOM_KANBERRA_CACHE_CONTROL,
+        KA_ATOM_KANBERRA_VOLUME,
+        KA_ATOM_KANBERRA_XDG_THEME_NAME,
+        KA_ATOM_KANBERRA_XDG_THEME_OUTPUT_PROFILE,
+        KA_ATOM_KANBERRA_ENABLE,
+        KA_ATOM_KANBERRA_FORCE_CHANNEL,
+        KA_ATOM_KANBERRA_SOFTWARE_MIX,
+        KA_ATOM_KANBERRA_RESAMPLE_QUALITY,
+        KA_ATOM_KANBERRA_LATENCY_MSEC,
+        _KA_ATOM_MAX,
+        KA_ATOM_INVALID = -1
+} ka_prop_atom;
+
+/* The props are kept in an arena which holds them together with their
+ * keys and values, and is only ever appended to. An open addressing
+ * hash table of pointers into it is used for lookups. Only the table
+ * is rebuilt when it grows, the props stay where they are until the
+ * list is destroyed. */
 
 typedef struct ka_prop {
-        char *key;
+        const char *key;
+        unsigned hash;
+        ka_prop_atom atom;
         size_t nbytes;
-        struct ka_prop *next_in_slot, *next_item, *prev_item;
+        void *data;
+        struct ka_prop *next_item;
 } ka_prop;
 
-#define KA_PROP_DATA(p) ((void*) ((char*) (p) + KA_ALIGN(sizeof(ka_prop))))
+#define KA_PROP_DATA(p) ((p)->data)
+
+typedef struct ka_arena_chunk ka_arena_chunk;
 
 struct ka_proplist {
         ka_mutex *mutex;
 
-        ka_prop *prop_hashtable[N_HASHTABLE];
-        ka_prop *first_item;
+        /* Protected by mutex */
+        unsigned n_ref;
+
+        /* Frozen lists are immutable snapshots which may be shared and
+         * read without locking */
+        ka_bool_t frozen;
+
+        ka_prop **slots;
+        unsigned n_slots;
+        unsigned n_props;
+
+        /* In the order they were first set */
+        ka_prop *first_item, *last_item;
+
+        /* Newest chunk first, arena_used is the total over all */
+        ka_arena_chunk *arena;
+        size_t arena_used;
+
+        /* The prop for each atom, NULL if unset */
+        ka_prop *atom_prop[_KA_ATOM_MAX];
 };
 
 int ka_proplist_merge(ka_proplist **_a, ka_proplist *b, ka_proplist *c);
+
+ka_proplist* ka_proplist_ref(ka_proplist *p);
+void ka_proplist_freeze(ka_proplist *p);
+
+static inline void ka_proplist_lock(ka_proplist *p) {
+        if (!p->frozen)
+                ka_mutex_lock(p->mutex);
+}
+
+static inline void ka_proplist_unlock(ka_proplist *p) {
+        if (!p->frozen)
+                ka_mutex_unlock(p->mutex);
+}
+
 ka_bool_t ka_proplist_contains(ka_proplist *p, const char *key);
 
-/* Both of the following two functions are not locked! Need manual locking! */
+/* All of the following functions are not locked! Need manual
+ * locking! The props and values returned stay valid for as long as
+ * the list does. When a key is set again, a value pointer taken before
+ * either sees the new value, or, if that didn't fit into the old
+ * place, keeps pointing to the old one. */
 ka_prop* ka_proplist_get_unlocked(ka_proplist *p, const char *key);
 const char* ka_proplist_gets_unlocked(ka_proplist *p, const char *key);
+ka_prop* ka_proplist_first_unlocked(ka_proplist *p);
+ka_prop* ka_proplist_next_unlocked(ka_proplist *p, ka_prop *prop);
+ka_prop* ka_proplist_get_atom_unlocked(ka_proplist *p, ka_prop_atom a);
+const char* ka_proplist_gets_atom_unlocked(ka_proplist *p, ka_prop_atom a);
+
+ka_bool_t ka_proplist_contains_atom(ka_proplist *p, ka_prop_atom a);
+int ka_proplist_sets_atom(ka_proplist *p, ka_prop_atom a, const char *value);
+
+ka_prop_atom ka_prop_atom_from_string(const char *key);
+const char *ka_prop_atom_to_string(ka_prop_atom a);
 
 int ka_proplist_merge_ap(ka_proplist *p, va_list ap);
 int ka_proplist_from_ap(ka_proplist **_p, va_list ap);
@@ -44,6 +44,7 @@
 #include "llist.h"
 #include "read-sound-file.h"
 #include "sound-theme-spec.h"
+#include "idmap.h"
 #include "malloc.h"
 
 enum outstanding_type {
@@ -52,20 +53,48 @@ enum outstanding_type {
         OUTSTANDING_UPLOAD
 };
 
+/* The props we interpret ourselves for each event */
+struct event_props {
+        char *name;
+        pa_volume_t volume;
+        ka_bool_t volume_set;
+        ka_cache_control_t cache_control;
+        pa_channel_position_t position;
+};
+
 struct outstanding {
         KA_LLIST_FIELDS(struct outstanding);
         enum outstanding_type type;
         ka_context *context;
         uint32_t id;
         uint32_t sink_input;
+        ka_idmap_entry by_id, by_sink_input;
         pa_stream *stream;
         pa_operation *drain_operation;
         ka_finish_callback_t callback;
+        ka_cache_callback_t cache_callback; /* for OUTSTANDING_UPLOAD */
         void *userdata;
+        char *name;
         ka_sound_file *file;
         int error;
         unsigned clean_up:1; /* Handler needs to clean up the outstanding struct */
         unsigned finished:1; /* finished playing */
+        unsigned cancel_pending:1; /* canceled before play_sample_cb() learned the sink input */
+
+        /* For a sample played without waiting for the server's
+         * reply, what we need to stream it instead if the server
+         * turns out to have lost it. Dropped once it plays. */
+        pa_proplist *event_proplist;
+        ka_proplist *context_props, *proplist;
+        struct event_props event;
+};
+
+/* A sample we know to be in the server's sample cache */
+struct sample {
+        KA_LLIST_FIELDS(struct sample);
+        uint32_t index;
+        char *name;
+        ka_idmap_entry by_name;
 };
 
 struct private {
@@ -77,12 +106,36 @@ struct private {
 
         ka_mutex *outstanding_mutex;
         KA_LLIST_HEAD(struct outstanding, outstanding);
+
+        ka_idmap *ids;
+
+        /* Those of outstanding that have a sink input, by its
+         * index */
+        ka_idmap *sink_inputs;
+
+        /* What the server has cached, by a hash of their names. This
+         * is only touched with the mainloop lock held. Until the
+         * initial listing has come in, it is incomplete. */
+        KA_LLIST_HEAD(struct sample, samples);
+        ka_idmap *sample_names;
+        ka_bool_t samples_listed;
+
+        /* c->props as we pass them to the server, kept up to date by
+         * driver_change_props(), so that reconnecting doesn't need
+         * to convert them again */
+        pa_proplist *props;
 };
 
+/* Props that are for us only, and additionally those that make no
+ * sense for a sample that outlives the event it was uploaded for */
+static const char *const private_prefixes[] = { "kanberra.", NULL };
+static const char *const upload_prefixes[] = { "kanberra.", "event.mouse.", "window.", NULL };
+
 #define PRIVATE(c) ((struct private *) ((c)->private))
 
 static void context_state_cb(pa_context *pc, void *userdata);
 static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t, uint32_t idx, void *userdata);
+static int upload(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata, ka_bool_t wait);
 
 static void outstanding_disconnect(struct outstanding *o) {
         ka_assert(o);
@@ -102,53 +155,233 @@ static void outstanding_disconnect(struct outstanding *o) {
         }
 }
 
+static void outstanding_forget_event(struct outstanding *o) {
+        ka_assert(o);
+
+        if (o->event_proplist) {
+                pa_proplist_free(o->event_proplist);
+                o->event_proplist = NULL;
+        }
+
+        if (o->context_props) {
+                ka_proplist_destroy(o->context_props);
+                o->context_props = NULL;
+        }
+
+        if (o->proplist) {
+                ka_proplist_destroy(o->proplist);
+                o->proplist = NULL;
+        }
+}
+
 static void outstanding_free(struct outstanding *o) {
         ka_assert(o);
 
         outstanding_disconnect(o);
+        outstanding_forget_event(o);
 
         if (o->file)
                 ka_sound_file_close(o->file);
 
+        ka_free(o->name);
         ka_free(o);
 }
 
-static int convert_proplist(pa_proplist **_l, ka_proplist *c) {
+static void outstanding_notify(struct outstanding *o, int error) {
+        ka_assert(o);
+
+        if (o->type == OUTSTANDING_UPLOAD) {
+                if (o->cache_callback)
+                        o->cache_callback(o->context, error, o->userdata);
+        } else if (o->callback)
+                o->callback(o->context, o->id, error, o->userdata);
+}
+
+/* Both need to be called with outstanding_mutex held */
+static void outstanding_link(struct private *p, struct outstanding *out) {
+        KA_IDMAP_LINK(struct outstanding, p->outstanding, p->ids, out);
+
+        if (out->sink_input != PA_INVALID_INDEX)
+                ka_idmap_put(p->sink_inputs, out->sink_input, &out->by_sink_input);
+}
+
+static void outstanding_unlink(struct private *p, struct outstanding *out) {
+        KA_IDMAP_UNLINK(struct outstanding, p->outstanding, p->ids, out);
+        ka_idmap_remove(p->sink_inputs, &out->by_sink_input);
+}
+
+static uint32_t name_hash(const char *name) {
+        uint32_t hash = 0;
+
+        for (; *name; name++)
+                hash = 31 * hash + (uint32_t) *name;
+
+        return hash;
+}
+
+static struct sample *sample_find(struct private *p, const char *name) {
+        ka_idmap_entry *e;
+
+        for (e = ka_idmap_get(p->sample_names, name_hash(name)); e; e = ka_idmap_next(e)) {
+                struct sample *s = KA_IDMAP_ITEM(e, struct sample, by_name);
+
+                if (ka_streq(s->name, name))
+                        return s;
+        }
+
+        return NULL;
+}
+
+static void sample_add(struct private *p, uint32_t idx, const char *name) {
+        struct sample *s;
+
+        if ((s = sample_find(p, name))) {
+                s->index = idx;
+                return;
+        }
+
+        /* If we run out of memory we'll just ask the server again
+         * next time */
+        if (!(s = ka_new0(struct sample, 1)))
+                return;
+
+        if (!(s->name = ka_strdup(name))) {
+                ka_free(s);
+                return;
+        }
+
+        s->index = idx;
+
+        KA_LLIST_PREPEND(struct sample, p->samples, s);
+        ka_idmap_put(p->sample_names, name_hash(name), &s->by_name);
+}
+
+static void sample_remove(struct private *p, struct sample *s) {
+        KA_LLIST_REMOVE(struct sample, p->samples, s);
+        ka_idmap_remove(p->sample_names, &s->by_name);
+        ka_free(s->name);
+        ka_free(s);
+}
+
+static void samples_clear(struct private *p) {
+        while (p->samples)
+                sample_remove(p, p->samples);
+
+        p->samples_listed = FALSE;
+}
+
+static ka_bool_t has_prefix(const char *key, const char *const *prefixes) {
+        ka_assert(key);
+        ka_assert(prefixes);
+
+        for (; *prefixes; prefixes++)
+                if (strncmp(key, *prefixes, strlen(*prefixes)) == 0)
+                        return TRUE;
+
+        return FALSE;
+}
+
+/* Converts all props but those starting with one of skip */
+static int convert_proplist(pa_proplist **_l, ka_proplist *c, const char *const *skip) {
         pa_proplist *l;
         ka_prop *i;
 
         ka_return_val_if_fail(_l, KA_ERROR_INVALID);
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(skip, KA_ERROR_INVALID);
 
         if (!(l = pa_proplist_new()))
                 return KA_ERROR_OOM;
 
-        ka_mutex_lock(c->mutex);
+        ka_proplist_lock(c);
+
+        for (i = ka_proplist_first_unlocked(c); i; i = ka_proplist_next_unlocked(c, i)) {
+
+                if (has_prefix(i->key, skip))
+                        continue;
 
-        for (i = c->first_item; i; i = i->next_item)
                 if (pa_proplist_set(l, i->key, KA_PROP_DATA(i), i->nbytes) < 0) {
-                        ka_mutex_unlock(c->mutex);
+                        ka_proplist_unlock(c);
                         pa_proplist_free(l);
                         return KA_ERROR_INVALID;
                 }
+        }
 
-        ka_mutex_unlock(c->mutex);
+        ka_proplist_unlock(c);
 
         *_l = l;
 
         return KA_SUCCESS;
 }
 
-static pa_proplist *strip_prefix(pa_proplist *l, const char *prefix) {
-        const char *key;
-        void *state = NULL;
-        ka_assert(l);
+/* Only overwrites the fields of e for which a prop is set */
+static int parse_event_props(ka_proplist *proplist, struct event_props *e) {
+        const char *t;
+        int ret = KA_SUCCESS;
+
+        ka_assert(proplist);
+        ka_assert(e);
 
-        while ((key = pa_proplist_iterate(l, &state)))
-                if (strncmp(key, prefix, strlen(prefix)) == 0)
-                        pa_proplist_unset(l, key);
+        ka_proplist_lock(proplist);
 
-        return l;
+        if ((t = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_EVENT_ID)))
+                if (!(e->name = ka_strdup(t))) {
+                        ret = KA_ERROR_OOM;
+                        goto finish;
+                }
+
+        if ((t = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_VOLUME))) {
+                char *end = NULL;
+                double dvol;
+
+                errno = 0;
+                dvol = strtod(t, &end);
+                if (errno != 0 || !end || *end) {
+                        ret = KA_ERROR_INVALID;
+                        goto finish;
+                }
+
+                e->volume = pa_sw_volume_from_dB(dvol);
+                e->volume_set = TRUE;
+        }
+
+        if ((t = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_CACHE_CONTROL)))
+                if (ka_parse_cache_control(&e->cache_control, t) < 0) {
+                        ret = KA_ERROR_INVALID;
+                        goto finish;
+                }
+
+        if ((t = ka_proplist_gets_atom_unlocked(proplist, KA_ATOM_KANBERRA_FORCE_CHANNEL))) {
+                pa_channel_map m;
+
+                if (!pa_channel_map_parse(&m, t) ||
+                    m.channels != 1) {
+                        ret = KA_ERROR_INVALID;
+                        goto finish;
+                }
+
+                e->position = m.map[0];
+        }
+
+        /* We cannot remap a sample when playing it from the cache, so
+         * each forced channel gets its own copy there */
+        if (e->name && e->position != PA_CHANNEL_POSITION_INVALID) {
+                char *n;
+
+                if (!(n = ka_sprintf_malloc("%s@%s", e->name, pa_channel_position_to_string(e->position)))) {
+                        ret = KA_ERROR_OOM;
+                        goto finish;
+                }
+
+                ka_free(e->name);
+                e->name = n;
+        }
+
+finish:
+
+        ka_proplist_unlock(proplist);
+
+        return ret;
 }
 
 static void add_common(pa_proplist *l) {
@@ -216,7 +449,6 @@ static int translate_error(int error) {
 }
 
 static int context_connect(ka_context *c, ka_bool_t nofail) {
-        pa_proplist *l;
         struct private *p;
         int ret;
 
@@ -228,26 +460,22 @@ static int context_connect(ka_context *c, ka_bool_t nofail) {
         /* If this immediate attempt fails, don't try to reconnect. */
         p->reconnect = FALSE;
 
-        if ((ret = convert_proplist(&l, c->props)) < 0)
-                return ret;
-
-        strip_prefix(l, "kanberra.");
+        if (!p->props) {
+                if ((ret = convert_proplist(&p->props, c->props, private_prefixes)) < 0)
+                        return ret;
 
-        if (!pa_proplist_contains(l, PA_PROP_APPLICATION_NAME)) {
-                pa_proplist_sets(l, PA_PROP_APPLICATION_NAME, "libkanberra");
-                pa_proplist_sets(l, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
+                if (!pa_proplist_contains(p->props, PA_PROP_APPLICATION_NAME)) {
+                        pa_proplist_sets(p->props, PA_PROP_APPLICATION_NAME, "libkanberra");
+                        pa_proplist_sets(p->props, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
 
-                if (!pa_proplist_contains(l, PA_PROP_APPLICATION_ID))
-                        pa_proplist_sets(l, PA_PROP_APPLICATION_ID, "org.freedesktop.libkanberra");
+                        if (!pa_proplist_contains(p->props, PA_PROP_APPLICATION_ID))
+                                pa_proplist_sets(p->props, PA_PROP_APPLICATION_ID, "org.freedesktop.libkanberra");
 
+                }
         }
 
-        if (!(p->context = pa_context_new_with_proplist(pa_threaded_mainloop_get_api(p->mainloop), NULL, l))) {
-                pa_proplist_free(l);
+        if (!(p->context = pa_context_new_with_proplist(pa_threaded_mainloop_get_api(p->mainloop), NULL, p->props)))
                 return KA_ERROR_OOM;
-        }
-
-        pa_proplist_free(l);
 
         pa_context_set_state_callback(p->context, context_state_cb, c);
         pa_context_set_subscribe_callback(p->context, context_subscribe_cb, c);
@@ -292,12 +520,11 @@ static void context_state_cb(pa_context *pc, void *userdata) {
                 while ((out = p->outstanding)) {
 
                         outstanding_disconnect(out);
-                        KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                        outstanding_unlink(p, out);
 
                         ka_mutex_unlock(p->outstanding_mutex);
 
-                        if (out->callback)
-                                out->callback(c, out->id, ret, out->userdata);
+                        outstanding_notify(out, ret);
 
                         outstanding_free(out);
 
@@ -306,6 +533,9 @@ static void context_state_cb(pa_context *pc, void *userdata) {
 
                 ka_mutex_unlock(p->outstanding_mutex);
 
+                /* A new connection will list the cache again */
+                samples_clear(p);
+
                 if (state == PA_CONTEXT_FAILED && p->reconnect) {
 
                         if (p->context) {
@@ -329,8 +559,55 @@ static void context_state_cb(pa_context *pc, void *userdata) {
         pa_threaded_mainloop_signal(p->mainloop, FALSE);
 }
 
+static void sample_info_cb(pa_context *pc, const pa_sample_info *i, int eol GNUC_UNUSED, void *userdata) {
+        ka_context *c = userdata;
+
+        ka_assert(pc);
+        ka_assert(c);
+
+        if (i)
+                sample_add(PRIVATE(c), i->index, i->name);
+}
+
+static void sample_list_cb(pa_context *pc, const pa_sample_info *i, int eol, void *userdata) {
+        ka_context *c = userdata;
+
+        ka_assert(pc);
+        ka_assert(c);
+
+        if (i)
+                sample_add(PRIVATE(c), i->index, i->name);
+        else if (eol > 0)
+                PRIVATE(c)->samples_listed = TRUE;
+}
+
+static void sample_cache_event(ka_context *c, pa_subscription_event_type_t t, uint32_t idx) {
+        struct private *p;
+        struct sample *s;
+        pa_operation *o;
+
+        p = PRIVATE(c);
+
+        if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_REMOVE) {
+
+                /* We need the name, but don't care if we can't get it:
+                 * not knowing about a sample just means we stream it */
+                if ((o = pa_context_get_sample_info_by_index(p->context, idx, sample_info_cb, c)))
+                        pa_operation_unref(o);
+
+                return;
+        }
+
+        for (s = p->samples; s; s = s->next)
+                if (s->index == idx) {
+                        sample_remove(p, s);
+                        break;
+                }
+}
+
 static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t, uint32_t idx, void *userdata) {
-        struct outstanding *out, *n;
+        struct outstanding *out;
+        ka_idmap_entry *e, *n;
         KA_LLIST_HEAD(struct outstanding, l);
         ka_context *c = userdata;
         struct private *p;
@@ -338,6 +615,11 @@ static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t,
         ka_assert(pc);
         ka_assert(c);
 
+        if ((t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SAMPLE_CACHE) {
+                sample_cache_event(c, t, idx);
+                return;
+        }
+
         if (t != (PA_SUBSCRIPTION_EVENT_SINK_INPUT|PA_SUBSCRIPTION_EVENT_REMOVE))
                 return;
 
@@ -347,14 +629,15 @@ static void context_subscribe_cb(pa_context *pc, pa_subscription_event_type_t t,
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = n) {
-                n = out->next;
+        for (e = ka_idmap_get(p->sink_inputs, idx); e; e = n) {
+                out = KA_IDMAP_ITEM(e, struct outstanding, by_sink_input);
+                n = ka_idmap_next(e);
 
-                if (!out->clean_up || out->type != OUTSTANDING_SAMPLE || out->sink_input != idx)
+                if (!out->clean_up || out->type != OUTSTANDING_SAMPLE)
                         continue;
 
                 outstanding_disconnect(out);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
 
                 KA_LLIST_PREPEND(struct outstanding, l, out);
         }
@@ -389,6 +672,13 @@ int driver_open(ka_context *c) {
                 return KA_ERROR_OOM;
         }
 
+        if (ka_idmap_new(&p->ids) < 0 ||
+            ka_idmap_new(&p->sink_inputs) < 0 ||
+            ka_idmap_new(&p->sample_names) < 0) {
+                driver_destroy(c);
+                return KA_ERROR_OOM;
+        }
+
         if (!(p->mainloop = pa_threaded_mainloop_new())) {
                 driver_destroy(c);
                 return KA_ERROR_OOM;
@@ -459,10 +749,9 @@ int driver_destroy(ka_context *c) {
 
         while (p->outstanding) {
                 struct outstanding *out = p->outstanding;
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
 
-                if (out->callback)
-                        out->callback(c, out->id, KA_ERROR_DESTROYED, out->userdata);
+                outstanding_notify(out, KA_ERROR_DESTROYED);
 
                 outstanding_free(out);
         }
@@ -473,9 +762,23 @@ int driver_destroy(ka_context *c) {
         if (p->theme)
                 ka_theme_data_free(p->theme);
 
+        if (p->props)
+                pa_proplist_free(p->props);
+
         if (p->outstanding_mutex)
                 ka_mutex_free(p->outstanding_mutex);
 
+        if (p->ids)
+                ka_idmap_free(p->ids);
+
+        if (p->sink_inputs)
+                ka_idmap_free(p->sink_inputs);
+
+        if (p->sample_names) {
+                samples_clear(p);
+                ka_idmap_free(p->sample_names);
+        }
+
         ka_free(p);
 
         c->private = NULL;
@@ -518,18 +821,23 @@ int driver_change_props(ka_context *c, ka_proplist *changed, ka_proplist *merged
                 return KA_ERROR_STATE; /* can be silently ignored */
         }
 
-        if ((ret = convert_proplist(&l, changed)) < 0)
+        if ((ret = convert_proplist(&l, changed, private_prefixes)) < 0) {
+                pa_threaded_mainloop_unlock(p->mainloop);
                 return ret;
+        }
 
-        strip_prefix(l, "kanberra.");
+        pa_proplist_update(p->props, PA_UPDATE_REPLACE, l);
 
         /* We start these asynchronously and don't care about the return
-         * value */
+         * value. If only our own props changed, there's nothing to
+         * tell the server. */
 
-        if (!(o = pa_context_proplist_update(p->context, PA_UPDATE_REPLACE, l, NULL, NULL)))
-                ret = translate_error(pa_context_errno(p->context));
-        else
-                pa_operation_unref(o);
+        if (!pa_proplist_isempty(l)) {
+                if (!(o = pa_context_proplist_update(p->context, PA_UPDATE_REPLACE, l, NULL, NULL)))
+                        ret = translate_error(pa_context_errno(p->context));
+                else
+                        pa_operation_unref(o);
+        }
 
         pa_threaded_mainloop_unlock(p->mainloop);
 
@@ -562,11 +870,20 @@ static int subscribe(ka_context *c) {
         /* We start these asynchronously and don't care about the return
          * value */
 
-        if (!(o = pa_context_subscribe(p->context, PA_SUBSCRIPTION_MASK_SINK_INPUT, NULL, NULL)))
+        if (!(o = pa_context_subscribe(p->context, PA_SUBSCRIPTION_MASK_SINK_INPUT|PA_SUBSCRIPTION_MASK_SAMPLE_CACHE, NULL, NULL)))
                 ret = translate_error(pa_context_errno(p->context));
         else
                 pa_operation_unref(o);
 
+        /* Learn what is cached already, the subscription tells us
+         * about the changes from then on */
+        if (ret == KA_SUCCESS) {
+                if (!(o = pa_context_get_sample_info_list(p->context, sample_list_cb, c)))
+                        ret = translate_error(pa_context_errno(p->context));
+                else
+                        pa_operation_unref(o);
+        }
+
         pa_threaded_mainloop_unlock(p->mainloop);
 
         p->subscribed = TRUE;
@@ -574,6 +891,37 @@ static int subscribe(ka_context *c) {
         return ret;
 }
 
+static int stream_connect(ka_context *c, struct outstanding *out, pa_proplist *l, const struct event_props *e);
+
+/* Streams a sample that was played without waiting for the server's
+ * reply, after the server told us it doesn't have it anymore. This
+ * runs in the mainloop thread, so the sound file is looked up with
+ * a theme of our own, as p->theme belongs to the application's
+ * thread. This is rare enough for the blocking to be acceptable. */
+static int stream_lost_sample(struct outstanding *out) {
+        ka_theme_data *t = NULL;
+        char *sp;
+        int ret;
+
+        ret = ka_lookup_sound(&out->file, &sp, &t, out->context_props, out->proplist);
+
+        if (t)
+                ka_theme_data_free(t);
+
+        if (ret < 0)
+                return ret;
+
+        if (sp)
+                if (!pa_proplist_contains(out->event_proplist, KA_PROP_MEDIA_FILENAME))
+                        pa_proplist_sets(out->event_proplist, KA_PROP_MEDIA_FILENAME, sp);
+
+        ka_free(sp);
+
+        out->type = OUTSTANDING_STREAM;
+
+        return stream_connect(out->context, out, out->event_proplist, &out->event);
+}
+
 static void play_sample_cb(pa_context *c, uint32_t idx, void *userdata) {
         struct private *p;
         struct outstanding *out = userdata;
@@ -583,6 +931,62 @@ static void play_sample_cb(pa_context *c, uint32_t idx, void *userdata) {
 
         p = PRIVATE(out->context);
 
+        if (out->clean_up) {
+                pa_operation *o;
+                int err;
+
+                /* Nobody waited for this, see driver_play() */
+
+                ka_mutex_lock(p->outstanding_mutex);
+
+                if (out->cancel_pending) {
+                        outstanding_unlink(p, out);
+                        ka_mutex_unlock(p->outstanding_mutex);
+
+                        /* driver_cancel() already told the
+                         * application, we only need to stop it */
+                        if (idx != PA_INVALID_INDEX)
+                                if ((o = pa_context_kill_sink_input(c, idx, NULL, NULL)))
+                                        pa_operation_unref(o);
+
+                        outstanding_free(out);
+                        return;
+                }
+
+                if (idx != PA_INVALID_INDEX) {
+                        out->sink_input = idx;
+                        ka_idmap_put(p->sink_inputs, idx, &out->by_sink_input);
+                        ka_mutex_unlock(p->outstanding_mutex);
+
+                        outstanding_forget_event(out);
+                        return;
+                }
+
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                /* The sample is gone from the cache before we learned
+                 * about it. Forget about it, so that the next play
+                 * streams and uploads it again, and stream this one
+                 * right away. */
+                if ((err = translate_error(pa_context_errno(c))) == KA_ERROR_NOTFOUND) {
+                        struct sample *s;
+
+                        if ((s = sample_find(p, out->name)))
+                                sample_remove(p, s);
+
+                        if ((err = stream_lost_sample(out)) == KA_SUCCESS)
+                                return;
+                }
+
+                ka_mutex_lock(p->outstanding_mutex);
+                outstanding_unlink(p, out);
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                outstanding_notify(out, err);
+                outstanding_free(out);
+                return;
+        }
+
         if (idx != PA_INVALID_INDEX) {
                 out->error = KA_SUCCESS;
                 out->sink_input = idx;
@@ -619,14 +1023,18 @@ static void stream_state_cb(pa_stream *s, void *userdata) {
 
                 err = state == PA_STREAM_FAILED ? translate_error(pa_context_errno(pa_stream_get_context(s))) : KA_ERROR_DESTROYED;
 
+                /* For an upload the stream terminating is the server
+                 * telling us it has the whole sample now */
+                if (out->type == OUTSTANDING_UPLOAD && state == PA_STREAM_TERMINATED)
+                        err = KA_SUCCESS;
+
                 if (out->clean_up) {
                         ka_mutex_lock(p->outstanding_mutex);
                         outstanding_disconnect(out);
-                        KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                        outstanding_unlink(p, out);
                         ka_mutex_unlock(p->outstanding_mutex);
 
-                        if (out->callback)
-                                out->callback(out->context, out->id, out->error, out->userdata);
+                        outstanding_notify(out, out->type == OUTSTANDING_UPLOAD ? err : out->error);
 
                         outstanding_free(out);
                 } else {
@@ -656,7 +1064,7 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
         if (out->clean_up) {
                 ka_mutex_lock(p->outstanding_mutex);
                 outstanding_disconnect(out);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 ka_mutex_unlock(p->outstanding_mutex);
 
                 if (out->callback)
@@ -681,7 +1089,7 @@ static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
 static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
         struct outstanding *out = userdata;
         struct private *p;
-        void *data;
+        void *data = NULL;
         int ret;
         ka_bool_t eof = FALSE;
 
@@ -693,24 +1101,60 @@ static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
 
         while (bytes > 0) {
                 size_t rbytes = bytes;
+                const void *d;
 
-                if (!(data = ka_malloc(rbytes))) {
-                        ret = KA_ERROR_OOM;
+                /* If the file is memory mapped we can hand its data
+                 * to PulseAudio directly, which then copies it only
+                 * once. */
+                if ((ret = ka_sound_file_map(out->file, &d, &rbytes)) >= 0) {
+
+                        if (rbytes <= 0) {
+                                eof = TRUE;
+                                break;
+                        }
+
+                        ka_assert(rbytes <= bytes);
+
+                        if (pa_stream_write(s, d, rbytes, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+                                ret = translate_error(pa_context_errno(p->context));
+                                goto finish;
+                        }
+
+                        bytes -= rbytes;
+                        continue;
+
+                } else if (ret != KA_ERROR_NOTSUPPORTED)
+                        goto finish;
+
+                rbytes = bytes;
+
+                /* Otherwise we decode straight into the memory block
+                 * PulseAudio is going to send, so that we don't need
+                 * to allocate and copy a buffer of our own. */
+                if (pa_stream_begin_write(s, &data, &rbytes) < 0) {
+                        ret = translate_error(pa_context_errno(p->context));
                         goto finish;
                 }
 
+                /* The block might be smaller than what we asked for,
+                 * but we may only write whole frames */
+                rbytes -= rbytes % pa_frame_size(pa_stream_get_sample_spec(s));
+                ka_assert(rbytes > 0);
+
                 if ((ret = ka_sound_file_read_arbitrary(out->file, data, &rbytes)) < 0)
                         goto finish;
 
                 if (rbytes <= 0) {
+                        pa_stream_cancel_write(s);
+                        data = NULL;
                         eof = TRUE;
                         break;
                 }
 
                 ka_assert(rbytes <= bytes);
 
-                if ((ret = pa_stream_write(s, data, rbytes, ka_free, 0, PA_SEEK_RELATIVE)) < 0) {
-                        ret = translate_error(ret);
+                if (pa_stream_write(s, data, rbytes, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+                        ret = translate_error(pa_context_errno(p->context));
                         goto finish;
                 }
 
@@ -730,7 +1174,7 @@ static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
                                 goto finish;
                         }
 
-                        /* Let's just signal driver_cache() which has been waiting for us */
+                        /* Let's just signal upload() in case it is waiting for us */
                         pa_threaded_mainloop_signal(p->mainloop, FALSE);
 
                 } else {
@@ -750,22 +1194,20 @@ static void stream_write_cb(pa_stream *s, size_t bytes, void *userdata) {
                 pa_stream_set_write_callback(s, NULL, NULL);
         }
 
-        ka_free(data);
-
         return;
 
 finish:
 
-        ka_free(data);
+        if (data)
+                pa_stream_cancel_write(s);
 
         if (out->clean_up) {
                 ka_mutex_lock(p->outstanding_mutex);
                 outstanding_disconnect(out);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 ka_mutex_unlock(p->outstanding_mutex);
 
-                if (out->callback)
-                        out->callback(out->context, out->id, ret, out->userdata);
+                outstanding_notify(out, ret);
 
                 outstanding_free(out);
 
@@ -806,13 +1248,22 @@ static const pa_channel_position_t channel_table[_KA_CHANNEL_POSITION_MAX] = {
         [KA_CHANNEL_TOP_REAR_CENTER] = PA_CHANNEL_POSITION_TOP_REAR_CENTER
 };
 
-static ka_bool_t convert_channel_map(ka_sound_file *f, pa_channel_map *cm) {
+static ka_bool_t convert_channel_map(ka_sound_file *f, pa_channel_position_t position, pa_channel_map *cm) {
         const ka_channel_position_t *positions;
         unsigned c;
 
         ka_assert(f);
         ka_assert(cm);
 
+        /* Apply kanberra.force_channel */
+        if (position != PA_CHANNEL_POSITION_INVALID) {
+                cm->channels = ka_sound_file_get_nchannels(f);
+                for (c = 0; c < cm->channels; c++)
+                        cm->map[c] = position;
+
+                return TRUE;
+        }
+
         if (!(positions = ka_sound_file_get_channel_map(f)))
                 return FALSE;
 
@@ -823,29 +1274,61 @@ static ka_bool_t convert_channel_map(ka_sound_file *f, pa_channel_map *cm) {
         return TRUE;
 }
 
-int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_callback_t cb, void *userdata) {
-        struct private *p;
-        pa_proplist *l = NULL;
-        const char *n, *vol, *ct, *channel;
-        char *name = NULL;
-#if defined(PA_MAJOR) && ((PA_MAJOR > 0) || (PA_MAJOR == 0 && PA_MINOR > 9) || (PA_MAJOR == 0 && PA_MINOR == 9 && PA_MICRO >= 15))
-        pa_volume_t v = (pa_volume_t) -1;
-#else
-        pa_volume_t v = PA_VOLUME_NORM;
-#endif
-        ka_bool_t volume_set = FALSE;
+/* Creates the stream for out->file and connects it, without waiting
+ * for it to get ready. Needs to be called with the mainloop lock
+ * held. */
+static int stream_connect(ka_context *c, struct outstanding *out, pa_proplist *l, const struct event_props *e) {
+        struct private *p = PRIVATE(c);
         pa_cvolume cvol;
         pa_sample_spec ss;
         pa_channel_map cm;
-        pa_channel_position_t position = PA_CHANNEL_POSITION_INVALID;
         ka_bool_t cm_good;
-        ka_cache_control_t cache_control = KA_CACHE_CONTROL_NEVER;
+        pa_buffer_attr ba;
+
+        ss.format = sample_type_table[ka_sound_file_get_sample_type(out->file)];
+        ss.channels = (uint8_t) ka_sound_file_get_nchannels(out->file);
+        ss.rate = ka_sound_file_get_rate(out->file);
+
+        cm_good = convert_channel_map(out->file, e->position, &cm);
+
+        if (!(out->stream = pa_stream_new_with_proplist(p->context, NULL, &ss, cm_good ? &cm : NULL, l)))
+                return translate_error(pa_context_errno(p->context));
+
+        pa_stream_set_state_callback(out->stream, stream_state_cb, out);
+        pa_stream_set_write_callback(out->stream, stream_write_cb, out);
+
+        if (e->volume_set)
+                pa_cvolume_set(&cvol, ss.channels, e->volume);
+
+        /* Make sure we get the longest latency possible, to minimize CPU
+         * consumption */
+        ba.maxlength = (uint32_t) -1;
+        ba.tlength = (uint32_t) -1;
+        ba.prebuf = (uint32_t) -1;
+        ba.minreq = (uint32_t) -1;
+        ba.fragsize = (uint32_t) -1;
+
+        if (pa_stream_connect_playback(out->stream, c->device, &ba,
+#ifdef PA_STREAM_FAIL_ON_SUSPEND
+                                       PA_STREAM_FAIL_ON_SUSPEND
+#else
+                                       0
+#endif
+                                       | (e->position != PA_CHANNEL_POSITION_INVALID ? PA_STREAM_NO_REMIX_CHANNELS : 0)
+                                       , e->volume_set ? &cvol : NULL, NULL) < 0)
+                return translate_error(pa_context_errno(p->context));
+
+        return KA_SUCCESS;
+}
+
+int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_callback_t cb, void *userdata) {
+        struct private *p;
+        pa_proplist *l = NULL;
+        struct event_props e;
         struct outstanding *out = NULL;
-        int try = 3;
         int ret;
         pa_operation *o;
         char *sp;
-        pa_buffer_attr ba;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
@@ -856,6 +1339,16 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
 
         ka_return_val_if_fail(p->mainloop, KA_ERROR_STATE);
 
+        e.name = NULL;
+#if defined(PA_MAJOR) && ((PA_MAJOR > 0) || (PA_MAJOR == 0 && PA_MINOR > 9) || (PA_MAJOR == 0 && PA_MINOR == 9 && PA_MICRO >= 15))
+        e.volume = (pa_volume_t) -1;
+#else
+        e.volume = PA_VOLUME_NORM;
+#endif
+        e.volume_set = FALSE;
+        e.cache_control = KA_CACHE_CONTROL_NEVER;
+        e.position = PA_CHANNEL_POSITION_INVALID;
+
         if (!(out = ka_new0(struct outstanding, 1))) {
                 ret = KA_ERROR_OOM;
                 goto finish_unlocked;
@@ -868,81 +1361,66 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
         out->callback = cb;
         out->userdata = userdata;
 
-        if ((ret = convert_proplist(&l, proplist)) < 0)
+        if ((ret = parse_event_props(proplist, &e)) < 0)
                 goto finish_unlocked;
 
-        if ((n = pa_proplist_gets(l, KA_PROP_EVENT_ID)))
-                if (!(name = ka_strdup(n))) {
-                        ret = KA_ERROR_OOM;
-                        goto finish_unlocked;
-                }
-
-        if ((vol = pa_proplist_gets(l, KA_PROP_KANBERRA_VOLUME))) {
-                char *e = NULL;
-                double dvol;
-
-                errno = 0;
-                dvol = strtod(vol, &e);
-                if (errno != 0 || !e || *e) {
-                        ret = KA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-                v = pa_sw_volume_from_dB(dvol);
-                volume_set = TRUE;
-        }
-
-        if ((ct = pa_proplist_gets(l, KA_PROP_KANBERRA_CACHE_CONTROL)))
-                if ((ret = ka_parse_cache_control(&cache_control, ct)) < 0) {
-                        ret = KA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-        if ((channel = pa_proplist_gets(l, KA_PROP_KANBERRA_FORCE_CHANNEL))) {
-                pa_channel_map t;
-
-                if (!pa_channel_map_parse(&t, channel) ||
-                    t.channels != 1) {
-                        ret = KA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-                position = t.map[0];
-
-                /* We cannot remap cached samples, so let's fail when cacheing
-                 * shall be used */
-                if (cache_control != KA_CACHE_CONTROL_NEVER) {
-                        ret = KA_ERROR_NOTSUPPORTED;
-                        goto finish_unlocked;
-                }
-        }
+        /* Only the props of the event itself, the server has those of
+         * the context already */
+        if ((ret = convert_proplist(&l, proplist, private_prefixes)) < 0)
+                goto finish_unlocked;
 
-        strip_prefix(l, "kanberra.");
         add_common(l);
 
         if ((ret = subscribe(c)) < 0)
                 goto finish_unlocked;
 
-        if (name && cache_control != KA_CACHE_CONTROL_NEVER) {
+        if (e.name && e.cache_control != KA_CACHE_CONTROL_NEVER) {
+                ka_bool_t canceled = FALSE, cached;
 
                 /* Ok, this sample has an event id, let's try to play it from the cache */
 
-                for (;;) {
-                        ka_bool_t canceled;
+                pa_threaded_mainloop_lock(p->mainloop);
 
-                        pa_threaded_mainloop_lock(p->mainloop);
+                if (!p->context) {
+                        ret = KA_ERROR_STATE;
+                        goto finish_locked;
+                }
 
-                        if (!p->context) {
-                                ret = KA_ERROR_STATE;
-                                goto finish_locked;
-                        }
+                /* Once we know what the server has cached we don't
+                 * have to ask it first */
+                cached = !p->samples_listed || sample_find(p, e.name);
+
+                if (cached) {
 
                         /* Let's try to play the sample */
-                        if (!(o = pa_context_play_sample_with_proplist(p->context, name, c->device, v, l, play_sample_cb, out))) {
+                        if (!(o = pa_context_play_sample_with_proplist(p->context, e.name, c->device, e.volume, l, play_sample_cb, out))) {
                                 ret = translate_error(pa_context_errno(p->context));
                                 goto finish_locked;
                         }
 
+                        /* If nobody wants to know when the sound
+                         * finished and we know it is cached, there's
+                         * no point in waiting for the server's
+                         * reply. play_sample_cb() will fill in the
+                         * sink input, or stream the sound should the
+                         * server have dropped the sample
+                         * meanwhile. */
+                        if (!cb && p->samples_listed) {
+                                pa_operation_unref(o);
+
+                                out->name = e.name;
+                                e.name = NULL;
+
+                                out->event = e;
+                                out->event_proplist = l;
+                                l = NULL;
+                                out->context_props = ka_proplist_ref(c->props);
+                                out->proplist = ka_proplist_ref(proplist);
+
+                                ret = KA_SUCCESS;
+                                goto finish_locked;
+                        }
+
                         for (;;) {
                                 pa_operation_state_t state = pa_operation_get_state(o);
 
@@ -963,9 +1441,11 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
                                 ret = KA_SUCCESS;
                                 goto finish_locked;
                         }
+                }
 
-                        pa_threaded_mainloop_unlock(p->mainloop);
+                pa_threaded_mainloop_unlock(p->mainloop);
 
+                if (cached) {
                         /* The operation might have been canceled due to connection termination */
                         if (canceled || !p->context) {
                                 ret = KA_ERROR_DISCONNECTED;
@@ -977,19 +1457,14 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
                                 ret = out->error;
                                 goto finish_unlocked;
                         }
-
-                        /* Hmm, we need to play it directly */
-                        if (cache_control != KA_CACHE_CONTROL_PERMANENT)
-                                break;
-
-                        /* Don't loop forever */
-                        if (--try <= 0)
-                                break;
-
-                        /* Let's upload the sample and retry playing */
-                        if ((ret = driver_cache(c, proplist)) < 0)
-                                goto finish_unlocked;
                 }
+
+                /* Hmm, we need to play it directly. If it shall be
+                 * cached, we upload it in the background so that it is
+                 * there next time, but don't make this time wait for
+                 * it. */
+                if (e.cache_control == KA_CACHE_CONTROL_PERMANENT)
+                        upload(c, proplist, NULL, NULL, FALSE);
         }
 
         out->type = OUTSTANDING_STREAM;
@@ -1004,22 +1479,6 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
 
         ka_free(sp);
 
-        ss.format = sample_type_table[ka_sound_file_get_sample_type(out->file)];
-        ss.channels = (uint8_t) ka_sound_file_get_nchannels(out->file);
-        ss.rate = ka_sound_file_get_rate(out->file);
-
-        if (position != PA_CHANNEL_POSITION_INVALID) {
-                unsigned u;
-                /* Apply kanberra.force_channel */
-
-                cm.channels = ss.channels;
-                for (u = 0; u < cm.channels; u++)
-                        cm.map[u] = position;
-
-                cm_good = TRUE;
-        } else
-                cm_good = convert_channel_map(out->file, &cm);
-
         pa_threaded_mainloop_lock(p->mainloop);
 
         if (!p->context) {
@@ -1027,36 +1486,8 @@ int driver_play(ka_context *c, uint32_t id, ka_proplist *proplist, ka_finish_cal
                 goto finish_locked;
         }
 
-        if (!(out->stream = pa_stream_new_with_proplist(p->context, NULL, &ss, cm_good ? &cm : NULL, l))) {
-                ret = translate_error(pa_context_errno(p->context));
+        if ((ret = stream_connect(c, out, l, &e)) < 0)
                 goto finish_locked;
-        }
-
-        pa_stream_set_state_callback(out->stream, stream_state_cb, out);
-        pa_stream_set_write_callback(out->stream, stream_write_cb, out);
-
-        if (volume_set)
-                pa_cvolume_set(&cvol, ss.channels, v);
-
-        /* Make sure we get the longest latency possible, to minimize CPU
-         * consumption */
-        ba.maxlength = (uint32_t) -1;
-        ba.tlength = (uint32_t) -1;
-        ba.prebuf = (uint32_t) -1;
-        ba.minreq = (uint32_t) -1;
-        ba.fragsize = (uint32_t) -1;
-
-        if (pa_stream_connect_playback(out->stream, c->device, &ba,
-#ifdef PA_STREAM_FAIL_ON_SUSPEND
-                                       PA_STREAM_FAIL_ON_SUSPEND
-#else
-                                       0
-#endif
-                                       | (position != PA_CHANNEL_POSITION_INVALID ? PA_STREAM_NO_REMIX_CHANNELS : 0)
-                                       , volume_set ? &cvol : NULL, NULL) < 0) {
-                ret = translate_error(pa_context_errno(p->context));
-                goto finish_locked;
-        }
 
         for (;;) {
                 pa_stream_state_t state;
@@ -1096,7 +1527,7 @@ finish_locked:
                 out->clean_up = TRUE;
 
                 ka_mutex_lock(p->outstanding_mutex);
-                KA_LLIST_PREPEND(struct outstanding, p->outstanding, out);
+                outstanding_link(p, out);
                 ka_mutex_unlock(p->outstanding_mutex);
         } else
                 outstanding_free(out);
@@ -1113,7 +1544,7 @@ finish_unlocked:
         if (l)
                 pa_proplist_free(l);
 
-        ka_free(name);
+        ka_free(e.name);
 
         return ret;
 }
@@ -1122,7 +1553,7 @@ int driver_cancel(ka_context *c, uint32_t id) {
         struct private *p;
         pa_operation *o;
         int ret = KA_SUCCESS;
-        struct outstanding *out, *n;
+        ka_idmap_entry *e, *n;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -1143,19 +1574,34 @@ int driver_cancel(ka_context *c, uint32_t id) {
         /* We start these asynchronously and don't care about the return
          * value */
 
-        for (out = p->outstanding; out; out = n) {
+        for (e = ka_idmap_get(p->ids, id); e; e = n) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
                 int ret2 = KA_SUCCESS;
-                n = out->next;
+                n = ka_idmap_next(e);
 
-                if (out->type == OUTSTANDING_UPLOAD ||
-                    out->id != id ||
-                    out->sink_input == PA_INVALID_INDEX)
+                if (out->type == OUTSTANDING_UPLOAD || out->cancel_pending)
                         continue;
 
-                if (!(o = pa_context_kill_sink_input(p->context, out->sink_input, NULL, NULL)))
-                        ret2 = translate_error(pa_context_errno(p->context));
-                else
-                        pa_operation_unref(o);
+                /* A sample played without waiting for the server's
+                 * reply, which hasn't come in yet. play_sample_cb()
+                 * kills the sink input once it knows it. */
+                if (out->type == OUTSTANDING_SAMPLE && out->sink_input == PA_INVALID_INDEX) {
+                        out->cancel_pending = TRUE;
+
+                        if (out->callback)
+                                out->callback(c, out->id, KA_ERROR_CANCELED, out->userdata);
+
+                        continue;
+                }
+
+                /* A stream that isn't ready yet has no sink input to
+                 * kill, disconnecting it is enough */
+                if (out->sink_input != PA_INVALID_INDEX) {
+                        if (!(o = pa_context_kill_sink_input(p->context, out->sink_input, NULL, NULL)))
+                                ret2 = translate_error(pa_context_errno(p->context));
+                        else
+                                pa_operation_unref(o);
+                }
 
                 /* We make sure here to kill all streams identified by the id
                  * here. However, we will return only the first error we
@@ -1168,7 +1614,7 @@ int driver_cancel(ka_context *c, uint32_t id) {
                         out->callback(c, out->id, KA_ERROR_CANCELED, out->userdata);
 
                 outstanding_disconnect(out);
-                KA_LLIST_REMOVE(struct outstanding, p->outstanding, out);
+                outstanding_unlink(p, out);
                 outstanding_free(out);
         }
 
@@ -1179,26 +1625,27 @@ int driver_cancel(ka_context *c, uint32_t id) {
         return ret;
 }
 
-int driver_cache(ka_context *c, ka_proplist *proplist) {
+static int upload(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata, ka_bool_t wait) {
         struct private *p;
         pa_proplist *l = NULL;
-        const char *n, *ct;
+        struct event_props e;
         pa_sample_spec ss;
         pa_channel_map cm;
         ka_bool_t cm_good;
-        ka_cache_control_t cache_control = KA_CACHE_CONTROL_PERMANENT;
         struct outstanding *out;
         int ret;
         char *sp;
 
-        ka_return_val_if_fail(c, KA_ERROR_INVALID);
-        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
-        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
-
         p = PRIVATE(c);
 
         ka_return_val_if_fail(p->mainloop, KA_ERROR_STATE);
 
+        e.name = NULL;
+        e.volume = PA_VOLUME_NORM;
+        e.volume_set = FALSE;
+        e.cache_control = KA_CACHE_CONTROL_PERMANENT;
+        e.position = PA_CHANNEL_POSITION_INVALID;
+
         if (!(out = ka_new0(struct outstanding, 1))) {
                 ret = KA_ERROR_OOM;
                 goto finish_unlocked;
@@ -1207,34 +1654,49 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
         out->type = OUTSTANDING_UPLOAD;
         out->context = c;
         out->sink_input = PA_INVALID_INDEX;
+        out->cache_callback = cb;
+        out->userdata = userdata;
+
+        ret = parse_event_props(proplist, &e);
 
-        if ((ret = convert_proplist(&l, proplist)) < 0)
+        /* The outstanding struct owns the name from now on */
+        out->name = e.name;
+
+        if (ret < 0)
                 goto finish_unlocked;
 
-        if (!(n = pa_proplist_gets(l, KA_PROP_EVENT_ID))) {
+        if (!out->name) {
                 ret = KA_ERROR_INVALID;
                 goto finish_unlocked;
         }
 
-        if ((ct = pa_proplist_gets(l, KA_PROP_KANBERRA_CACHE_CONTROL)))
-                if ((ret = ka_parse_cache_control(&cache_control, ct)) < 0) {
-                        ret = KA_ERROR_INVALID;
-                        goto finish_unlocked;
-                }
-
-        if (cache_control != KA_CACHE_CONTROL_PERMANENT) {
+        if (e.cache_control != KA_CACHE_CONTROL_PERMANENT) {
                 ret = KA_ERROR_INVALID;
                 goto finish_unlocked;
         }
 
-        if ((ct = pa_proplist_gets(l, KA_PROP_KANBERRA_FORCE_CHANNEL))) {
-                ret = KA_ERROR_NOTSUPPORTED;
-                goto finish_unlocked;
+        /* Nobody waits for background uploads, so there's no point
+         * in starting another one for a sample already on its way */
+        if (!cb && !wait) {
+                struct outstanding *i;
+
+                ka_mutex_lock(p->outstanding_mutex);
+
+                for (i = p->outstanding; i; i = i->next)
+                        if (i->type == OUTSTANDING_UPLOAD && ka_streq(i->name, out->name))
+                                break;
+
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                if (i) {
+                        ret = KA_SUCCESS;
+                        goto finish_unlocked;
+                }
         }
 
-        strip_prefix(l, "kanberra.");
-        strip_prefix(l, "event.mouse.");
-        strip_prefix(l, "window.");
+        if ((ret = convert_proplist(&l, proplist, upload_prefixes)) < 0)
+                goto finish_unlocked;
+
         add_common(l);
 
         /* Let's stream the sample directly */
@@ -1251,7 +1713,7 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
         ss.channels = (uint8_t) ka_sound_file_get_nchannels(out->file);
         ss.rate = ka_sound_file_get_rate(out->file);
 
-        cm_good = convert_channel_map(out->file, &cm);
+        cm_good = convert_channel_map(out->file, e.position, &cm);
 
         pa_threaded_mainloop_lock(p->mainloop);
 
@@ -1273,6 +1735,20 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
                 goto finish_locked;
         }
 
+        if (!wait) {
+                /* The stream callbacks will finish the upload, notify
+                 * the caller and clean up after us */
+                out->clean_up = TRUE;
+
+                ka_mutex_lock(p->outstanding_mutex);
+                outstanding_link(p, out);
+                ka_mutex_unlock(p->outstanding_mutex);
+
+                out = NULL;
+                ret = KA_SUCCESS;
+                goto finish_locked;
+        }
+
         for (;;) {
                 pa_stream_state_t state;
 
@@ -1299,7 +1775,8 @@ int driver_cache(ka_context *c, ka_proplist *proplist) {
         ret = KA_SUCCESS;
 
 finish_locked:
-        outstanding_free(out);
+        if (out)
+                outstanding_free(out);
         out = NULL;
 
         pa_threaded_mainloop_unlock(p->mainloop);
@@ -1315,9 +1792,26 @@ finish_unlocked:
         return ret;
 }
 
+int driver_cache(ka_context *c, ka_proplist *proplist) {
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        return upload(c, proplist, NULL, NULL, TRUE);
+}
+
+int driver_cache_async(ka_context *c, ka_proplist *proplist, ka_cache_callback_t cb, void *userdata) {
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(proplist, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!userdata || cb, KA_ERROR_INVALID);
+        ka_return_val_if_fail(c->private, KA_ERROR_STATE);
+
+        return upload(c, proplist, cb, userdata, FALSE);
+}
+
 int driver_playing(ka_context *c, uint32_t id, int *playing) {
         struct private *p;
-        struct outstanding *out;
+        ka_idmap_entry *e;
 
         ka_return_val_if_fail(c, KA_ERROR_INVALID);
         ka_return_val_if_fail(c->private, KA_ERROR_STATE);
@@ -1329,11 +1823,12 @@ int driver_playing(ka_context *c, uint32_t id, int *playing) {
 
         ka_mutex_lock(p->outstanding_mutex);
 
-        for (out = p->outstanding; out; out = out->next) {
+        for (e = ka_idmap_get(p->ids, id); e; e = ka_idmap_next(e)) {
+                struct outstanding *out = KA_IDMAP_ITEM(e, struct outstanding, by_id);
 
-                if (out->type == OUTSTANDING_UPLOAD ||
-                    out->id != id ||
-                    out->sink_input == PA_INVALID_INDEX)
+                /* Samples whose sink input we don't know yet count
+                 * as playing, unless they have been canceled */
+                if (out->type == OUTSTANDING_UPLOAD || out->cancel_pending)
                         continue;
 
                 *playing = 1;
@@ -41,6 +41,14 @@ struct ka_sound_file {
         unsigned nchannels;
         unsigned rate;
         ka_sample_type_t type;
+
+        /* Only used for files backed by already decoded memory */
+        const uint8_t *data;
+        size_t data_size;
+        size_t data_index;
+        const ka_channel_position_t *channel_map;
+        ka_free_cb_t data_free;
+        void *data_userdata;
 };
 
 int ka_sound_file_open(ka_sound_file **_f, const char *fn) {
@@ -96,6 +104,41 @@ fail:
         return ret;
 }
 
+int ka_sound_file_open_memory(
+                ka_sound_file **_f,
+                const void *data,
+                size_t size,
+                ka_sample_type_t type,
+                unsigned rate,
+                unsigned nchannels,
+                const ka_channel_position_t *channel_map,
+                void (*free_cb)(void *userdata),
+                void *userdata) {
+
+        ka_sound_file *f;
+
+        ka_return_val_if_fail(_f, KA_ERROR_INVALID);
+        ka_return_val_if_fail(data || size == 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(rate > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(nchannels > 0, KA_ERROR_INVALID);
+
+        if (!(f = ka_new0(ka_sound_file, 1)))
+                return KA_ERROR_OOM;
+
+        f->data = data;
+        f->data_size = size;
+        f->type = type;
+        f->rate = rate;
+        f->nchannels = nchannels;
+        f->channel_map = channel_map;
+        f->data_free = free_cb;
+        f->data_userdata = userdata;
+
+        *_f = f;
+
+        return KA_SUCCESS;
+}
+
 void ka_sound_file_close(ka_sound_file *f) {
         ka_assert(f);
 
@@ -103,6 +146,8 @@ void ka_sound_file_close(ka_sound_file *f) {
                 ka_wav_close(f->wav);
         if (f->vorbis)
                 ka_vorbis_close(f->vorbis);
+        if (f->data_free)
+                f->data_free(f->data_userdata);
 
         ka_free(f->filename);
         ka_free(f);
@@ -128,8 +173,24 @@ const ka_channel_position_t* ka_sound_file_get_channel_map(ka_sound_file *f) {
 
         if (f->wav)
                 return ka_wav_get_channel_map(f->wav);
-        else
+        else if (f->vorbis)
                 return ka_vorbis_get_channel_map(f->vorbis);
+        else
+                return f->channel_map;
+}
+
+static int read_memory(ka_sound_file *f, void *d, size_t *n) {
+        size_t k;
+
+        ka_assert(f->data_index <= f->data_size);
+
+        k = KA_MIN(*n, f->data_size - f->data_index);
+
+        memcpy(d, f->data + f->data_index, k);
+        f->data_index += k;
+        *n = k;
+
+        return KA_SUCCESS;
 }
 
 int ka_sound_file_read_int16(ka_sound_file *f, int16_t *d, size_t *n) {
@@ -137,9 +198,20 @@ int ka_sound_file_read_int16(ka_sound_file *f, int16_t *d, size_t *n) {
         ka_return_val_if_fail(d, KA_ERROR_INVALID);
         ka_return_val_if_fail(n, KA_ERROR_INVALID);
         ka_return_val_if_fail(*n > 0, KA_ERROR_INVALID);
-        ka_return_val_if_fail(f->wav || f->vorbis, KA_ERROR_STATE);
+        ka_return_val_if_fail(f->wav || f->vorbis || f->data, KA_ERROR_STATE);
         ka_return_val_if_fail(f->type == KA_SAMPLE_S16NE || f->type == KA_SAMPLE_S16RE, KA_ERROR_STATE);
 
+        if (f->data) {
+                int ret;
+                size_t k;
+
+                k = *n * sizeof(int16_t);
+                if ((ret = read_memory(f, d, &k)) == KA_SUCCESS)
+                        *n = k / sizeof(int16_t);
+
+                return ret;
+        }
+
         if (f->wav)
                 return ka_wav_read_s16le(f->wav, d, n);
         else
@@ -151,9 +223,12 @@ int ka_sound_file_read_uint8(ka_sound_file *f, uint8_t *d, size_t *n) {
         ka_return_val_if_fail(d, KA_ERROR_INVALID);
         ka_return_val_if_fail(n, KA_ERROR_INVALID);
         ka_return_val_if_fail(*n > 0, KA_ERROR_INVALID);
-        ka_return_val_if_fail(f->wav && !f->vorbis, KA_ERROR_STATE);
+        ka_return_val_if_fail((f->wav || f->data) && !f->vorbis, KA_ERROR_STATE);
         ka_return_val_if_fail(f->type == KA_SAMPLE_U8, KA_ERROR_STATE);
 
+        if (f->data)
+                return read_memory(f, d, n);
+
         if (f->wav)
                 return ka_wav_read_u8(f->wav, d, n);
 
@@ -197,13 +272,56 @@ int ka_sound_file_read_arbitrary(ka_sound_file *f, void *d, size_t *n) {
         return ret;
 }
 
+int ka_sound_file_map(ka_sound_file *f, const void **d, size_t *n) {
+        size_t fs;
+        int ret;
+
+        ka_return_val_if_fail(f, KA_ERROR_INVALID);
+        ka_return_val_if_fail(d, KA_ERROR_INVALID);
+        ka_return_val_if_fail(n, KA_ERROR_INVALID);
+        ka_return_val_if_fail(*n > 0, KA_ERROR_INVALID);
+
+        /* Never hand out partial frames */
+        fs = ka_sound_file_frame_size(f);
+        *n = (*n / fs) * fs;
+
+        ka_return_val_if_fail(*n > 0, KA_ERROR_INVALID);
+
+        if (f->data) {
+                ka_assert(f->data_index <= f->data_size);
+
+                *n = KA_MIN(*n, ((f->data_size - f->data_index) / fs) * fs);
+                *d = f->data + f->data_index;
+                f->data_index += *n;
+
+                return KA_SUCCESS;
+        }
+
+        if (!f->wav)
+                return KA_ERROR_NOTSUPPORTED;
+
+        if (ka_wav_get_size(f->wav) < (off_t) fs) {
+                *n = 0;
+                return KA_SUCCESS;
+        }
+
+        *n = KA_MIN(*n, ((size_t) ka_wav_get_size(f->wav) / fs) * fs);
+
+        if ((ret = ka_wav_map(f->wav, d, n)) < 0)
+                return ret;
+
+        return KA_SUCCESS;
+}
+
 off_t ka_sound_file_get_size(ka_sound_file *f) {
         ka_return_val_if_fail(f, (off_t) -1);
 
         if (f->wav)
                 return ka_wav_get_size(f->wav);
-        else
+        else if (f->vorbis)
                 return ka_vorbis_get_size(f->vorbis);
+        else
+                return (off_t) (f->data_size - f->data_index);
 }
 
 size_t ka_sound_file_frame_size(ka_sound_file *f) {
@@ -60,6 +60,10 @@ typedef struct ka_sound_file ka_sound_file;
 int ka_sound_file_open(ka_sound_file **f, const char *fn);
 void ka_sound_file_close(ka_sound_file *f);
 
+/* Wraps already decoded PCM data. free_cb is called with userdata
+ * when the file is closed, the data itself is not copied. */
+int ka_sound_file_open_memory(ka_sound_file **f, const void *data, size_t size, ka_sample_type_t type, unsigned rate, unsigned nchannels, const ka_channel_position_t *channel_map, void (*free_cb)(void *userdata), void *userdata);
+
 unsigned ka_sound_file_get_nchannels(ka_sound_file *f);
 unsigned ka_sound_file_get_rate(ka_sound_file *f);
 ka_sample_type_t ka_sound_file_get_sample_type(ka_sound_file *f);
@@ -72,6 +76,12 @@ int ka_sound_file_read_uint8(ka_sound_file *f, uint8_t *d, size_t *n);
 
 int ka_sound_file_read_arbitrary(ka_sound_file *f, void *d, size_t *n);
 
+/* Like ka_sound_file_read_arbitrary(), but returns a pointer to the
+ * data instead of copying it, which stays valid until the file is
+ * closed. Returns KA_ERROR_NOTSUPPORTED if the file needs to be
+ * decoded, in which case it should be read normally. */
+int ka_sound_file_map(ka_sound_file *f, const void **d, size_t *n);
+
 size_t ka_sound_file_frame_size(ka_sound_file *f);
 
 #endif
@@ -24,6 +24,10 @@
 #include <config.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include "kanberra.h"
 #include "read-wav.h"
 #include "macro.h"
@@ -79,6 +83,11 @@ struct ka_wav {
         FILE *file;
 
         off_t data_size;
+
+        /* Only set after ka_wav_map() was called */
+        void *map;
+        size_t map_size;
+
         unsigned nchannels;
         unsigned rate;
         unsigned depth;
@@ -144,7 +153,7 @@ int ka_wav_open(ka_wav **_w, FILE *f)  {
         ka_return_val_if_fail(_w, KA_ERROR_INVALID);
         ka_return_val_if_fail(f, KA_ERROR_INVALID);
 
-        if (!(w = ka_new(ka_wav, 1)))
+        if (!(w = ka_new0(ka_wav, 1)))
                 return KA_ERROR_OOM;
 
         w->file = f;
@@ -254,6 +263,9 @@ fail:
 void ka_wav_close(ka_wav *w) {
         ka_assert(w);
 
+        if (w->map)
+                munmap(w->map, w->map_size);
+
         fclose(w->file);
         ka_free(w);
 }
@@ -359,6 +371,65 @@ int ka_wav_read_u8(ka_wav *w, uint8_t *d, size_t *n) {
         return KA_SUCCESS;
 }
 
+static int map_file(ka_wav *w) {
+        struct stat st;
+        off_t offset;
+        void *m;
+
+        if (fstat(fileno(w->file), &st) < 0)
+                return KA_ERROR_SYSTEM;
+
+        /* Where the next read would have continued */
+        if ((offset = ftello(w->file)) < 0)
+                return KA_ERROR_SYSTEM;
+
+        /* Never touch pages beyond the end of a truncated file, that
+         * would be a SIGBUS */
+        if (offset + w->data_size > st.st_size) {
+                if (offset > st.st_size)
+                        return KA_ERROR_CORRUPT;
+
+                w->data_size = st.st_size - offset;
+        }
+
+        w->map_size = (size_t) (offset + w->data_size);
+
+        if (w->map_size <= 0)
+                return KA_ERROR_CORRUPT;
+
+        if ((m = mmap(NULL, w->map_size, PROT_READ, MAP_PRIVATE, fileno(w->file), 0)) == MAP_FAILED)
+                return KA_ERROR_NOTSUPPORTED;
+
+#ifdef MADV_SEQUENTIAL
+        madvise(m, w->map_size, MADV_SEQUENTIAL);
+#endif
+
+        w->map = m;
+
+        return KA_SUCCESS;
+}
+
+int ka_wav_map(ka_wav *w, const void **d, size_t *n) {
+        int ret;
+
+        ka_return_val_if_fail(w, KA_ERROR_INVALID);
+        ka_return_val_if_fail(d, KA_ERROR_INVALID);
+        ka_return_val_if_fail(n, KA_ERROR_INVALID);
+        ka_return_val_if_fail(*n > 0, KA_ERROR_INVALID);
+
+        if (!w->map)
+                if ((ret = map_file(w)) < 0)
+                        return ret;
+
+        if ((off_t) *n > w->data_size)
+                *n = (size_t) w->data_size;
+
+        *d = (const uint8_t*) w->map + (w->map_size - (size_t) w->data_size);
+        w->data_size -= (off_t) *n;
+
+        return KA_SUCCESS;
+}
+
 off_t ka_wav_get_size(ka_wav *v) {
         ka_return_val_if_fail(v, (off_t) -1);
 
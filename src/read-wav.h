@@ -40,6 +40,10 @@ const ka_channel_position_t* ka_wav_get_channel_map(ka_wav *f);
 int ka_wav_read_u8(ka_wav *f, uint8_t *d, size_t *n);
 int ka_wav_read_s16le(ka_wav *f, int16_t *d, size_t *n);
 
+/* Returns a pointer into the memory mapped data chunk instead of
+ * copying. Don't mix with the read functions above. */
+int ka_wav_map(ka_wav *f, const void **d, size_t *n);
+
 off_t ka_wav_get_size(ka_wav *f);
 
 #endif
@@ -0,0 +1,373 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "remix.h"
+#include "malloc.h"
+#include "macro.h"
+
+struct ka_remix {
+        unsigned in_channels, out_channels;
+
+        /* out_channels rows of in_channels factors each */
+        float *matrix;
+};
+
+typedef enum side {
+        SIDE_LEFT,
+        SIDE_RIGHT,
+        SIDE_CENTER,
+        SIDE_LFE
+} side_t;
+
+static const side_t side_table[_KA_CHANNEL_POSITION_MAX] = {
+        [KA_CHANNEL_MONO] = SIDE_CENTER,
+        [KA_CHANNEL_FRONT_LEFT] = SIDE_LEFT,
+        [KA_CHANNEL_FRONT_RIGHT] = SIDE_RIGHT,
+        [KA_CHANNEL_FRONT_CENTER] = SIDE_CENTER,
+        [KA_CHANNEL_REAR_LEFT] = SIDE_LEFT,
+        [KA_CHANNEL_REAR_RIGHT] = SIDE_RIGHT,
+        [KA_CHANNEL_REAR_CENTER] = SIDE_CENTER,
+        [KA_CHANNEL_LFE] = SIDE_LFE,
+        [KA_CHANNEL_FRONT_LEFT_OF_CENTER] = SIDE_LEFT,
+        [KA_CHANNEL_FRONT_RIGHT_OF_CENTER] = SIDE_RIGHT,
+        [KA_CHANNEL_SIDE_LEFT] = SIDE_LEFT,
+        [KA_CHANNEL_SIDE_RIGHT] = SIDE_RIGHT,
+        [KA_CHANNEL_TOP_CENTER] = SIDE_CENTER,
+        [KA_CHANNEL_TOP_FRONT_LEFT] = SIDE_LEFT,
+        [KA_CHANNEL_TOP_FRONT_RIGHT] = SIDE_RIGHT,
+        [KA_CHANNEL_TOP_FRONT_CENTER] = SIDE_CENTER,
+        [KA_CHANNEL_TOP_REAR_LEFT] = SIDE_LEFT,
+        [KA_CHANNEL_TOP_REAR_RIGHT] = SIDE_RIGHT,
+        [KA_CHANNEL_TOP_REAR_CENTER] = SIDE_CENTER
+};
+
+static const char * const name_table[_KA_CHANNEL_POSITION_MAX] = {
+        [KA_CHANNEL_MONO] = "mono",
+        [KA_CHANNEL_FRONT_LEFT] = "front-left",
+        [KA_CHANNEL_FRONT_RIGHT] = "front-right",
+        [KA_CHANNEL_FRONT_CENTER] = "front-center",
+        [KA_CHANNEL_REAR_LEFT] = "rear-left",
+        [KA_CHANNEL_REAR_RIGHT] = "rear-right",
+        [KA_CHANNEL_REAR_CENTER] = "rear-center",
+        [KA_CHANNEL_LFE] = "lfe",
+        [KA_CHANNEL_FRONT_LEFT_OF_CENTER] = "front-left-of-center",
+        [KA_CHANNEL_FRONT_RIGHT_OF_CENTER] = "front-right-of-center",
+        [KA_CHANNEL_SIDE_LEFT] = "side-left",
+        [KA_CHANNEL_SIDE_RIGHT] = "side-right",
+        [KA_CHANNEL_TOP_CENTER] = "top-center",
+        [KA_CHANNEL_TOP_FRONT_LEFT] = "top-front-left",
+        [KA_CHANNEL_TOP_FRONT_RIGHT] = "top-front-right",
+        [KA_CHANNEL_TOP_FRONT_CENTER] = "top-front-center",
+        [KA_CHANNEL_TOP_REAR_LEFT] = "top-rear-left",
+        [KA_CHANNEL_TOP_REAR_RIGHT] = "top-rear-right",
+        [KA_CHANNEL_TOP_REAR_CENTER] = "top-rear-center"
+};
+
+static const ka_channel_position_t map_mono[] = {
+        KA_CHANNEL_MONO
+};
+
+static const ka_channel_position_t map_stereo[] = {
+        KA_CHANNEL_FRONT_LEFT, KA_CHANNEL_FRONT_RIGHT
+};
+
+static const ka_channel_position_t map_quad[] = {
+        KA_CHANNEL_FRONT_LEFT, KA_CHANNEL_FRONT_RIGHT,
+        KA_CHANNEL_REAR_LEFT, KA_CHANNEL_REAR_RIGHT
+};
+
+static const ka_channel_position_t map_surround_50[] = {
+        KA_CHANNEL_FRONT_LEFT, KA_CHANNEL_FRONT_RIGHT,
+        KA_CHANNEL_REAR_LEFT, KA_CHANNEL_REAR_RIGHT,
+        KA_CHANNEL_FRONT_CENTER
+};
+
+static const ka_channel_position_t map_surround_51[] = {
+        KA_CHANNEL_FRONT_LEFT, KA_CHANNEL_FRONT_RIGHT,
+        KA_CHANNEL_REAR_LEFT, KA_CHANNEL_REAR_RIGHT,
+        KA_CHANNEL_FRONT_CENTER, KA_CHANNEL_LFE
+};
+
+static const ka_channel_position_t map_surround_71[] = {
+        KA_CHANNEL_FRONT_LEFT, KA_CHANNEL_FRONT_RIGHT,
+        KA_CHANNEL_REAR_LEFT, KA_CHANNEL_REAR_RIGHT,
+        KA_CHANNEL_FRONT_CENTER, KA_CHANNEL_LFE,
+        KA_CHANNEL_SIDE_LEFT, KA_CHANNEL_SIDE_RIGHT
+};
+
+const ka_channel_position_t *ka_channel_map_default(unsigned nchannels) {
+
+        switch (nchannels) {
+        case 1:
+                return map_mono;
+        case 2:
+                return map_stereo;
+        case 4:
+                return map_quad;
+        case 5:
+                return map_surround_50;
+        case 6:
+                return map_surround_51;
+        case 8:
+                return map_surround_71;
+        default:
+                return NULL;
+        }
+}
+
+int ka_parse_channel_position(ka_channel_position_t *position, const char *name) {
+        unsigned i;
+
+        ka_return_val_if_fail(position, KA_ERROR_INVALID);
+        ka_return_val_if_fail(name, KA_ERROR_INVALID);
+
+        for (i = 0; i < _KA_CHANNEL_POSITION_MAX; i++)
+                if (ka_streq(name, name_table[i])) {
+                        *position = (ka_channel_position_t) i;
+                        return KA_SUCCESS;
+                }
+
+        /* The aliases PulseAudio accepts too */
+        if (ka_streq(name, "left"))
+                *position = KA_CHANNEL_FRONT_LEFT;
+        else if (ka_streq(name, "right"))
+                *position = KA_CHANNEL_FRONT_RIGHT;
+        else if (ka_streq(name, "center"))
+                *position = KA_CHANNEL_FRONT_CENTER;
+        else if (ka_streq(name, "subwoofer"))
+                *position = KA_CHANNEL_LFE;
+        else
+                return KA_ERROR_INVALID;
+
+        return KA_SUCCESS;
+}
+
+/* Adds input channel i to all output channels at position p. Returns
+ * FALSE if there are none. */
+static ka_bool_t route(ka_remix *r, const ka_channel_position_t *out_map, unsigned i, ka_channel_position_t p, float f) {
+        ka_bool_t found = FALSE;
+        unsigned o;
+
+        for (o = 0; o < r->out_channels; o++)
+                if (out_map[o] == p) {
+                        r->matrix[o * r->in_channels + i] += f;
+                        found = TRUE;
+                }
+
+        return found;
+}
+
+/* Routes input channel i to the nearest thing to position p the
+ * output has */
+static void route_nearest(ka_remix *r, const ka_channel_position_t *out_map, unsigned i, ka_channel_position_t p, float f) {
+        ka_bool_t l, rt;
+        unsigned o;
+
+        if (route(r, out_map, i, p, f))
+                return;
+
+        switch (side_table[p]) {
+
+        case SIDE_LEFT:
+                if (route(r, out_map, i, KA_CHANNEL_FRONT_LEFT, f) ||
+                    route(r, out_map, i, KA_CHANNEL_MONO, f) ||
+                    route(r, out_map, i, KA_CHANNEL_FRONT_CENTER, f))
+                        return;
+                break;
+
+        case SIDE_RIGHT:
+                if (route(r, out_map, i, KA_CHANNEL_FRONT_RIGHT, f) ||
+                    route(r, out_map, i, KA_CHANNEL_MONO, f) ||
+                    route(r, out_map, i, KA_CHANNEL_FRONT_CENTER, f))
+                        return;
+                break;
+
+        case SIDE_CENTER:
+                if (route(r, out_map, i, KA_CHANNEL_FRONT_CENTER, f) ||
+                    route(r, out_map, i, KA_CHANNEL_MONO, f))
+                        return;
+
+                /* Spread it over both sides, keeping its power */
+                l = route(r, out_map, i, KA_CHANNEL_FRONT_LEFT, f * (float) M_SQRT1_2);
+                rt = route(r, out_map, i, KA_CHANNEL_FRONT_RIGHT, f * (float) M_SQRT1_2);
+
+                if (l || rt)
+                        return;
+                break;
+
+        case SIDE_LFE:
+                /* Without a subwoofer we drop it, like everybody
+                 * else does */
+                return;
+        }
+
+        /* Nothing close, so play it everywhere, unless that's the
+         * subwoofer */
+        for (o = 0; o < r->out_channels; o++)
+                if (out_map[o] != KA_CHANNEL_LFE)
+                        r->matrix[o * r->in_channels + i] += f;
+}
+
+int ka_remix_new(ka_remix **_r,
+                 unsigned in_channels, const ka_channel_position_t *in_map,
+                 unsigned out_channels, const ka_channel_position_t *out_map,
+                 const ka_channel_position_t *force) {
+        ka_remix *r;
+        unsigned i, o;
+
+        ka_return_val_if_fail(_r, KA_ERROR_INVALID);
+        ka_return_val_if_fail(in_channels > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(out_channels > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!force || *force < _KA_CHANNEL_POSITION_MAX, KA_ERROR_INVALID);
+
+        if (!in_map)
+                in_map = ka_channel_map_default(in_channels);
+        if (!out_map)
+                out_map = ka_channel_map_default(out_channels);
+
+        /* Without knowing where the output channels are we cannot
+         * tell which one a forced position is. Mono can go to all of
+         * them though. */
+        if (force && *force != KA_CHANNEL_MONO && !out_map)
+                return KA_ERROR_NOTSUPPORTED;
+
+        if (!(r = ka_new0(ka_remix, 1)))
+                return KA_ERROR_OOM;
+
+        r->in_channels = in_channels;
+        r->out_channels = out_channels;
+
+        if (!(r->matrix = ka_new0(float, in_channels * out_channels))) {
+                ka_free(r);
+                return KA_ERROR_OOM;
+        }
+
+        if (!force && (!out_map || !in_map)) {
+
+                /* We know nothing about the layout, so we pass the
+                 * channels on by index */
+                for (i = 0; i < KA_MIN(in_channels, out_channels); i++)
+                        r->matrix[i * in_channels + i] = 1.0f;
+
+        } else if (force) {
+
+                /* Mix everything down and put it on that one
+                 * channel. For mono that means all of them. */
+                for (i = 0; i < in_channels; i++) {
+                        float f = 1.0f / (float) in_channels;
+
+                        if (*force == KA_CHANNEL_MONO) {
+                                for (o = 0; o < out_channels; o++)
+                                        if (!out_map || out_map[o] != KA_CHANNEL_LFE)
+                                                r->matrix[o * in_channels + i] = f;
+                        } else
+                                route_nearest(r, out_map, i, *force, f);
+                }
+
+        } else {
+
+                for (i = 0; i < in_channels; i++) {
+
+                        /* Mono goes everywhere */
+                        if (in_map[i] == KA_CHANNEL_MONO && in_channels == 1) {
+                                for (o = 0; o < out_channels; o++)
+                                        if (out_map[o] != KA_CHANNEL_LFE)
+                                                r->matrix[o * in_channels + i] = 1.0f;
+                                continue;
+                        }
+
+                        route_nearest(r, out_map, i, in_map[i], 1.0f);
+                }
+
+                /* Scale down outputs that more than one input was
+                 * folded into, so that they don't clip */
+                for (o = 0; o < out_channels; o++) {
+                        float sum = 0;
+
+                        for (i = 0; i < in_channels; i++)
+                                sum += r->matrix[o * in_channels + i];
+
+                        if (sum > 1.0f)
+                                for (i = 0; i < in_channels; i++)
+                                        r->matrix[o * in_channels + i] /= sum;
+                }
+        }
+
+        *_r = r;
+
+        return KA_SUCCESS;
+}
+
+void ka_remix_free(ka_remix *r) {
+        ka_return_if_fail(r);
+
+        ka_free(r->matrix);
+        ka_free(r);
+}
+
+ka_bool_t ka_remix_is_identity(ka_remix *r) {
+        unsigned i, o;
+
+        ka_return_val_if_fail(r, FALSE);
+
+        if (r->in_channels != r->out_channels)
+                return FALSE;
+
+        for (o = 0; o < r->out_channels; o++)
+                for (i = 0; i < r->in_channels; i++) {
+                        float f = r->matrix[o * r->in_channels + i], e = i == o ? 1.0f : 0.0f;
+
+                        if (f < e || f > e)
+                                return FALSE;
+                }
+
+        return TRUE;
+}
+
+void ka_remix_run(ka_remix *r, int16_t *d, const int16_t *s, size_t n) {
+        unsigned i, o;
+
+        ka_return_if_fail(r);
+        ka_return_if_fail(d || n <= 0);
+        ka_return_if_fail(s || n <= 0);
+
+        for (; n > 0; n--) {
+                const float *m = r->matrix;
+
+                for (o = 0; o < r->out_channels; o++) {
+                        float sum = 0;
+
+                        for (i = 0; i < r->in_channels; i++)
+                                sum += *(m++) * (float) s[i];
+
+                        *(d++) = (int16_t) lrintf(KA_CLAMP(sum, -32768.0f, 32767.0f));
+                }
+
+                s += r->in_channels;
+        }
+}
@@ -0,0 +1,64 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberraremixhfoo
+#define fookanberraremixhfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "kanberra.h"
+#include "macro.h"
+#include "read-sound-file.h"
+
+/* Maps interleaved native endian S16 from one channel layout to
+ * another, for backends that write to the device themselves.
+ * Channels the output lacks are folded into the nearest ones that it
+ * has, upmixing copies to them. A map may be NULL, in which case the
+ * usual layout for the number of channels is assumed. */
+
+typedef struct ka_remix ka_remix;
+
+/* If force is not NULL all input is mixed down and played only on
+ * the output channel at that position, as for
+ * KA_PROP_KANBERRA_FORCE_CHANNEL. Fails with KA_ERROR_NOTSUPPORTED if
+ * the output layout is unknown, unless that position is mono. */
+int ka_remix_new(ka_remix **r,
+                 unsigned in_channels, const ka_channel_position_t *in_map,
+                 unsigned out_channels, const ka_channel_position_t *out_map,
+                 const ka_channel_position_t *force);
+void ka_remix_free(ka_remix *r);
+
+/* TRUE if the remix would pass the data on unchanged */
+ka_bool_t ka_remix_is_identity(ka_remix *r);
+
+/* Converts n frames. d and s must not overlap. */
+void ka_remix_run(ka_remix *r, int16_t *d, const int16_t *s, size_t n);
+
+/* The usual layout for the number of channels, as WAVE and ALSA
+ * assume it, or NULL if there is none */
+const ka_channel_position_t *ka_channel_map_default(unsigned nchannels);
+
+/* Parses a KA_PROP_KANBERRA_FORCE_CHANNEL value */
+int ka_parse_channel_position(ka_channel_position_t *position, const char *name);
+
+#endif
@@ -0,0 +1,301 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resampler.h"
+#include "dsp.h"
+#include "malloc.h"
+#include "macro.h"
+
+/* Rate ratios that would need more filter phases than this are
+ * interpolated linearly instead */
+#define N_PHASES_MAX 1024U
+
+struct ka_resampler {
+        unsigned nchannels;
+
+        /* out_rate/in_rate, reduced */
+        unsigned l, m;
+
+        /* An even number of taps per phase, half of them on each
+         * side. NULL for linear interpolation. */
+        unsigned n_taps;
+        float *filter;
+
+        /* Input frames still needed. pos is the frame the next
+         * output sample is based on, phase/l the fraction past
+         * it. */
+        float *buf;
+        size_t buf_len, buf_size;
+        size_t pos;
+        unsigned phase;
+        ka_bool_t drained;
+
+        float *out;
+        size_t out_size;
+};
+
+static unsigned gcd(unsigned a, unsigned b) {
+
+        while (b > 0) {
+                unsigned t = a % b;
+                a = b;
+                b = t;
+        }
+
+        return a;
+}
+
+static int make_filter(ka_resampler *r, double rolloff) {
+        unsigned p, j, half = r->n_taps / 2;
+        double fc;
+
+        if (!(r->filter = ka_new(float, r->l * r->n_taps)))
+                return KA_ERROR_OOM;
+
+        /* Cut off below the lower of both Nyquist frequencies, in
+         * cycles per input sample */
+        fc = 0.5 * rolloff * (r->l < r->m ? (double) r->l / r->m : 1.0);
+
+        for (p = 0; p < r->l; p++) {
+                float *f = r->filter + p * r->n_taps;
+                double sum = 0;
+
+                for (j = 0; j < r->n_taps; j++) {
+                        double d = (double) j - (half - 1) - (double) p / r->l, x, w;
+
+                        x = 2.0 * fc * d;
+                        x = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+
+                        /* Blackman window */
+                        w = 0.42 + 0.5 * cos(M_PI * d / half) + 0.08 * cos(2.0 * M_PI * d / half);
+
+                        f[j] = (float) (x * w);
+                        sum += f[j];
+                }
+
+                /* Unity gain for DC in every phase */
+                for (j = 0; j < r->n_taps; j++)
+                        f[j] = (float) (f[j] / sum);
+        }
+
+        return KA_SUCCESS;
+}
+
+int ka_resampler_new(ka_resampler **_r, unsigned nchannels, unsigned in_rate, unsigned out_rate, ka_resample_quality_t quality) {
+        ka_resampler *r;
+        unsigned g;
+        int ret;
+
+        ka_return_val_if_fail(_r, KA_ERROR_INVALID);
+        ka_return_val_if_fail(nchannels > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(in_rate > 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(out_rate > 0, KA_ERROR_INVALID);
+
+        if (!(r = ka_new0(ka_resampler, 1)))
+                return KA_ERROR_OOM;
+
+        g = gcd(in_rate, out_rate);
+        r->nchannels = nchannels;
+        r->l = out_rate / g;
+        r->m = in_rate / g;
+
+        if (quality == KA_RESAMPLE_LOW || r->l > N_PHASES_MAX)
+                r->n_taps = 2;
+        else {
+                r->n_taps = quality == KA_RESAMPLE_HIGH ? 32 : 16;
+
+                if ((ret = make_filter(r, quality == KA_RESAMPLE_HIGH ? 0.95 : 0.9)) < 0) {
+                        ka_resampler_free(r);
+                        return ret;
+                }
+        }
+
+        /* Start with silence as history for the first samples */
+        r->buf_size = r->n_taps;
+        if (!(r->buf = ka_new0(float, r->buf_size * nchannels))) {
+                ka_resampler_free(r);
+                return KA_ERROR_OOM;
+        }
+
+        r->buf_len = r->pos = r->n_taps / 2 - 1;
+
+        *_r = r;
+
+        return KA_SUCCESS;
+}
+
+void ka_resampler_free(ka_resampler *r) {
+        ka_return_if_fail(r);
+
+        ka_free(r->filter);
+        ka_free(r->buf);
+        ka_free(r->out);
+        ka_free(r);
+}
+
+static int reserve(float **b, size_t *size, size_t n, unsigned nchannels) {
+        float *nb;
+
+        if (n <= *size)
+                return KA_SUCCESS;
+
+        n = KA_MAX(n, *size * 2);
+
+        if (!(nb = ka_new(float, n * nchannels)))
+                return KA_ERROR_OOM;
+
+        if (*size > 0)
+                memcpy(nb, *b, *size * nchannels * sizeof(float));
+
+        ka_free(*b);
+        *b = nb;
+        *size = n;
+
+        return KA_SUCCESS;
+}
+
+static size_t produce(ka_resampler *r, size_t n_out) {
+        unsigned half = r->n_taps / 2, nc = r->nchannels, c, j;
+        size_t k, drop;
+
+        for (k = 0; k < n_out && r->pos + half < r->buf_len; k++) {
+                const float *in = r->buf + (r->pos + 1 - half) * nc;
+                float *out = r->out + k * nc;
+
+                if (r->filter) {
+                        const float *f = r->filter + r->phase * r->n_taps;
+
+                        for (c = 0; c < nc; c++) {
+                                float sum = 0;
+
+                                for (j = 0; j < r->n_taps; j++)
+                                        sum += in[j * nc + c] * f[j];
+
+                                out[c] = sum;
+                        }
+                } else {
+                        float frac = (float) r->phase / (float) r->l;
+
+                        for (c = 0; c < nc; c++)
+                                out[c] = in[c] + (in[nc + c] - in[c]) * frac;
+                }
+
+                r->phase += r->m;
+                r->pos += r->phase / r->l;
+                r->phase %= r->l;
+        }
+
+        /* Forget what no future output depends on anymore. When
+         * downsampling pos may already point past what we have. */
+        drop = KA_MIN(r->pos + 1 - half, r->buf_len);
+
+        if (drop > 0) {
+                memmove(r->buf, r->buf + drop * nc, (r->buf_len - drop) * nc * sizeof(float));
+                r->buf_len -= drop;
+                r->pos -= drop;
+        }
+
+        return k;
+}
+
+static int run(ka_resampler *r, int16_t *out, size_t *n_out) {
+        int ret;
+
+        if ((ret = reserve(&r->out, &r->out_size, *n_out, r->nchannels)) < 0)
+                return ret;
+
+        *n_out = produce(r, *n_out);
+        ka_dsp_f32_to_s16(out, r->out, *n_out * r->nchannels);
+
+        return KA_SUCCESS;
+}
+
+int ka_resampler_run(ka_resampler *r, const int16_t *in, size_t n_in, int16_t *out, size_t *n_out) {
+        int ret;
+
+        ka_return_val_if_fail(r, KA_ERROR_INVALID);
+        ka_return_val_if_fail(in || n_in <= 0, KA_ERROR_INVALID);
+        ka_return_val_if_fail(out, KA_ERROR_INVALID);
+        ka_return_val_if_fail(n_out, KA_ERROR_INVALID);
+        ka_return_val_if_fail(!r->drained, KA_ERROR_STATE);
+
+        if ((ret = reserve(&r->buf, &r->buf_size, r->buf_len + n_in, r->nchannels)) < 0)
+                return ret;
+
+        ka_dsp_s16_to_f32(r->buf + r->buf_len * r->nchannels, in, n_in * r->nchannels);
+        r->buf_len += n_in;
+
+        return run(r, out, n_out);
+}
+
+int ka_resampler_drain(ka_resampler *r, int16_t *out, size_t *n_out) {
+        int ret;
+
+        ka_return_val_if_fail(r, KA_ERROR_INVALID);
+        ka_return_val_if_fail(out, KA_ERROR_INVALID);
+        ka_return_val_if_fail(n_out, KA_ERROR_INVALID);
+
+        /* Pad with silence so that the last samples make it through
+         * the filter */
+        if (!r->drained) {
+                size_t n = r->n_taps / 2;
+
+                if ((ret = reserve(&r->buf, &r->buf_size, r->buf_len + n, r->nchannels)) < 0)
+                        return ret;
+
+                memset(r->buf + r->buf_len * r->nchannels, 0, n * r->nchannels * sizeof(float));
+                r->buf_len += n;
+                r->drained = TRUE;
+        }
+
+        return run(r, out, n_out);
+}
+
+size_t ka_resampler_max_out(ka_resampler *r, size_t n_in) {
+        ka_return_val_if_fail(r, 0);
+
+        return (r->buf_len + n_in + r->n_taps / 2) * r->l / r->m + 1;
+}
+
+int ka_parse_resample_quality(ka_resample_quality_t *quality, const char *q) {
+        ka_return_val_if_fail(quality, KA_ERROR_INVALID);
+        ka_return_val_if_fail(q, KA_ERROR_INVALID);
+
+        if (ka_streq(q, "low"))
+                *quality = KA_RESAMPLE_LOW;
+        else if (ka_streq(q, "medium"))
+                *quality = KA_RESAMPLE_MEDIUM;
+        else if (ka_streq(q, "high"))
+                *quality = KA_RESAMPLE_HIGH;
+        else
+                return KA_ERROR_INVALID;
+
+        return KA_SUCCESS;
+}
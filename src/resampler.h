@@ -0,0 +1,66 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberraresamplerhfoo
+#define fookanberraresamplerhfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "kanberra.h"
+#include "proplist.h"
+
+/* Converts interleaved native endian S16 between sample rates, for
+ * backends that write to the device themselves and want to keep it
+ * at its native rate. "low" interpolates linearly, "medium" and
+ * "high" use a windowed sinc polyphase filter of increasing
+ * length. */
+
+typedef enum ka_resample_quality {
+        KA_RESAMPLE_LOW,
+        KA_RESAMPLE_MEDIUM,
+        KA_RESAMPLE_HIGH
+} ka_resample_quality_t;
+
+#define KA_RESAMPLE_DEFAULT KA_RESAMPLE_MEDIUM
+
+typedef struct ka_resampler ka_resampler;
+
+int ka_resampler_new(ka_resampler **r, unsigned nchannels, unsigned in_rate, unsigned out_rate, ka_resample_quality_t quality);
+void ka_resampler_free(ka_resampler *r);
+
+/* Consumes all n_in frames of in and writes up to *n_out frames to
+ * out, setting *n_out to the number of frames written. Input that
+ * could not be turned into output yet is kept for the next call. */
+int ka_resampler_run(ka_resampler *r, const int16_t *in, size_t n_in, int16_t *out, size_t *n_out);
+
+/* At the end of the stream, writes the output still pending in the
+ * filter. Call until *n_out is 0. */
+int ka_resampler_drain(ka_resampler *r, int16_t *out, size_t *n_out);
+
+/* An upper bound for the frames ka_resampler_run() produces from
+ * n_in frames, pending input included */
+size_t ka_resampler_max_out(ka_resampler *r, size_t n_in);
+
+int ka_parse_resample_quality(ka_resample_quality_t *quality, const char *q);
+
+#endif
@@ -0,0 +1,319 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "sample-cache.h"
+#include "malloc.h"
+#include "mutex.h"
+#include "llist.h"
+
+typedef struct ka_sample ka_sample;
+
+struct ka_sample {
+        KA_LLIST_FIELDS(ka_sample);
+        ka_sample_cache *cache;
+        unsigned n_ref;
+        ka_bool_t linked;
+        ka_bool_t permanent;
+
+        char *path;
+        ka_sample_type_t type;
+        unsigned rate;
+        unsigned nchannels;
+        ka_channel_position_t *channel_map;
+
+        void *data;
+        size_t size;
+};
+
+struct ka_sample_cache {
+        ka_mutex *mutex;
+        size_t size, size_max;
+
+        /* Most recently used first */
+        KA_LLIST_HEAD(ka_sample, samples);
+};
+
+int ka_sample_cache_new(ka_sample_cache **_c, size_t size_max) {
+        ka_sample_cache *c;
+
+        ka_return_val_if_fail(_c, KA_ERROR_INVALID);
+
+        if (!(c = ka_new0(ka_sample_cache, 1)))
+                return KA_ERROR_OOM;
+
+        if (!(c->mutex = ka_mutex_new())) {
+                ka_free(c);
+                return KA_ERROR_OOM;
+        }
+
+        c->size_max = size_max;
+
+        *_c = c;
+
+        return KA_SUCCESS;
+}
+
+static void sample_free(ka_sample *s) {
+        ka_assert(s);
+
+        ka_free(s->path);
+        ka_free(s->channel_map);
+        ka_free(s->data);
+        ka_free(s);
+}
+
+/* Needs to be called with the cache mutex held */
+static void sample_unlink(ka_sample_cache *c, ka_sample *s) {
+        ka_assert(s->linked);
+
+        KA_LLIST_REMOVE(ka_sample, c->samples, s);
+        s->linked = FALSE;
+
+        ka_assert(c->size >= s->size);
+        c->size -= s->size;
+
+        if (s->n_ref <= 0)
+                sample_free(s);
+}
+
+static void sample_unref(void *userdata) {
+        ka_sample *s = userdata;
+        ka_sample_cache *c;
+
+        ka_assert(s);
+
+        c = s->cache;
+
+        ka_mutex_lock(c->mutex);
+
+        ka_assert(s->n_ref >= 1);
+        s->n_ref--;
+
+        if (s->n_ref <= 0 && !s->linked)
+                sample_free(s);
+
+        ka_mutex_unlock(c->mutex);
+}
+
+void ka_sample_cache_free(ka_sample_cache *c) {
+        ka_assert(c);
+
+        while (c->samples) {
+                ka_assert(c->samples->n_ref <= 0);
+                sample_unlink(c, c->samples);
+        }
+
+        ka_mutex_free(c->mutex);
+        ka_free(c);
+}
+
+/* Drops unused volatile samples, least recently used first, until
+ * size additional bytes fit into the cache. Needs to be called with
+ * the cache mutex held. */
+static ka_bool_t make_room(ka_sample_cache *c, size_t size) {
+        ka_sample *s, *prev;
+
+        if (size > c->size_max)
+                return FALSE;
+
+        for (s = c->samples; s && s->next; s = s->next)
+                ;
+
+        for (; s && c->size + size > c->size_max; s = prev) {
+                prev = s->prev;
+
+                if (!s->permanent)
+                        sample_unlink(c, s);
+        }
+
+        return c->size + size <= c->size_max;
+}
+
+/* The number of bytes we'll get out of a freshly opened file */
+static size_t file_size(ka_sound_file *f) {
+        off_t size;
+        size_t fs;
+
+        if ((size = ka_sound_file_get_size(f)) <= 0)
+                return 0;
+
+        fs = ka_sound_file_frame_size(f);
+
+        return ((size_t) size / fs) * fs;
+}
+
+static ka_sample *find_sample(ka_sample_cache *c, const char *path, ka_sound_file *f) {
+        ka_sample *s;
+
+        for (s = c->samples; s; s = s->next)
+                if (s->type == ka_sound_file_get_sample_type(f) &&
+                    s->rate == ka_sound_file_get_rate(f) &&
+                    s->nchannels == ka_sound_file_get_nchannels(f) &&
+                    s->size == file_size(f) &&
+                    ka_streq(s->path, path))
+                        return s;
+
+        return NULL;
+}
+
+static int decode_sample(ka_sample **_s, ka_sound_file *f, const char *path, size_t size) {
+        const ka_channel_position_t *map;
+        ka_sample *s;
+        int ret;
+
+        if (!(s = ka_new0(ka_sample, 1)))
+                return KA_ERROR_OOM;
+
+        s->type = ka_sound_file_get_sample_type(f);
+        s->rate = ka_sound_file_get_rate(f);
+        s->nchannels = ka_sound_file_get_nchannels(f);
+
+        if (!(s->path = ka_strdup(path)) ||
+            !(s->data = ka_malloc(size))) {
+                ret = KA_ERROR_OOM;
+                goto fail;
+        }
+
+        if ((map = ka_sound_file_get_channel_map(f)))
+                if (!(s->channel_map = ka_newdup(ka_channel_position_t, map, s->nchannels))) {
+                        ret = KA_ERROR_OOM;
+                        goto fail;
+                }
+
+        while (s->size < size) {
+                size_t n = size - s->size;
+
+                if ((ret = ka_sound_file_read_arbitrary(f, (uint8_t*) s->data + s->size, &n)) < 0)
+                        goto fail;
+
+                if (n <= 0)
+                        break;
+
+                s->size += n;
+        }
+
+        /* The header promised more data than we could decode, don't
+         * keep this, since we'd never find it again */
+        if (s->size != size) {
+                ret = KA_ERROR_CORRUPT;
+                goto fail;
+        }
+
+        *_s = s;
+
+        return KA_SUCCESS;
+
+fail:
+        sample_free(s);
+
+        return ret;
+}
+
+/* After a failed decode *f has been read from already, so we replace
+ * it with a freshly opened one the caller can stream from instead */
+static int reopen(ka_sound_file **f, const char *path, int ret) {
+        ka_sound_file *nf;
+
+        ka_sound_file_close(*f);
+        *f = NULL;
+
+        if (ka_sound_file_open(&nf, path) < 0)
+                return ret;
+
+        *f = nf;
+
+        return ret;
+}
+
+int ka_sample_cache_get(ka_sample_cache *c, ka_sound_file **f, const char *path, ka_cache_control_t control) {
+        ka_sample *s;
+        ka_sound_file *nf;
+        size_t size;
+        ka_bool_t decoded = FALSE;
+        int ret;
+
+        ka_return_val_if_fail(c, KA_ERROR_INVALID);
+        ka_return_val_if_fail(f, KA_ERROR_INVALID);
+        ka_return_val_if_fail(*f, KA_ERROR_INVALID);
+        ka_return_val_if_fail(path, KA_ERROR_INVALID);
+        ka_return_val_if_fail(control != KA_CACHE_CONTROL_NEVER, KA_ERROR_INVALID);
+
+        if ((size = file_size(*f)) <= 0 || size > c->size_max)
+                return KA_ERROR_TOOBIG;
+
+        ka_mutex_lock(c->mutex);
+
+        if ((s = find_sample(c, path, *f))) {
+
+                /* Move to the front of the LRU list */
+                KA_LLIST_REMOVE(ka_sample, c->samples, s);
+                KA_LLIST_PREPEND(ka_sample, c->samples, s);
+
+                if (control == KA_CACHE_CONTROL_PERMANENT)
+                        s->permanent = TRUE;
+
+        } else {
+
+                /* Don't block the playback threads while decoding */
+                ka_mutex_unlock(c->mutex);
+
+                if ((ret = decode_sample(&s, *f, path, size)) < 0)
+                        return reopen(f, path, ret);
+
+                decoded = TRUE;
+                s->cache = c;
+                s->permanent = control == KA_CACHE_CONTROL_PERMANENT;
+
+                ka_mutex_lock(c->mutex);
+
+                /* If the cache is filled up with permanent samples we
+                 * still play from the decoded data, but drop it
+                 * afterwards */
+                if (make_room(c, s->size)) {
+                        KA_LLIST_PREPEND(ka_sample, c->samples, s);
+                        s->linked = TRUE;
+                        c->size += s->size;
+                }
+        }
+
+        if ((ret = ka_sound_file_open_memory(&nf, s->data, s->size, s->type, s->rate, s->nchannels, s->channel_map, sample_unref, s)) < 0) {
+                if (!s->linked)
+                        sample_free(s);
+
+                ka_mutex_unlock(c->mutex);
+
+                return decoded ? reopen(f, path, ret) : ret;
+        }
+
+        s->n_ref++;
+
+        ka_mutex_unlock(c->mutex);
+
+        ka_sound_file_close(*f);
+        *f = nf;
+
+        return KA_SUCCESS;
+}
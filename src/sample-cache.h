@@ -0,0 +1,51 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberrasamplecachehfoo
+#define fookanberrasamplecachehfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#include "common.h"
+#include "read-sound-file.h"
+
+/* An in-process cache of fully decoded sounds, for backends that
+ * have no sound server to upload samples to. Entries are identified
+ * by the resolved file name and the sample spec of the file. */
+
+#define KA_SAMPLE_CACHE_SIZE_MAX (8U*1024U*1024U)
+
+typedef struct ka_sample_cache ka_sample_cache;
+
+int ka_sample_cache_new(ka_sample_cache **c, size_t size_max);
+
+/* Must not be called before all sound files returned by
+ * ka_sample_cache_get() have been closed. */
+void ka_sample_cache_free(ka_sample_cache *c);
+
+/* Replaces *f, which needs to be freshly opened from path, with a
+ * sound file reading from the cached decoded data, decoding and
+ * storing it first if necessary. On failure *f is left to be read
+ * from the start, so that the caller may stream it instead, or is
+ * closed and set to NULL if it could not be opened again. Returns
+ * KA_ERROR_TOOBIG if the sound does not fit into the cache. */
+int ka_sample_cache_get(ka_sample_cache *c, ka_sound_file **f, const char *path, ka_cache_control_t control);
+
+#endif
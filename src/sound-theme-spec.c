@@ -26,6 +26,9 @@
 
 #include <errno.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <locale.h>
 
@@ -38,8 +41,14 @@
 #define FALLBACK_THEME "freedesktop"
 #define DEFAULT_OUTPUT_PROFILE "stereo"
 #define N_THEME_DIR_MAX 8
+#define N_INDEX_HASHTABLE 31
+#define N_INDEX_DIRS_MAX 256
+#define N_EVENT_SLOTS 127
 
 typedef struct ka_data_dir ka_data_dir;
+typedef struct ka_index_entry ka_index_entry;
+typedef struct ka_index_dir ka_index_dir;
+typedef struct ka_theme_index ka_theme_index;
 
 struct ka_data_dir {
         KA_LLIST_FIELDS(ka_data_dir);
@@ -57,6 +66,57 @@ struct ka_theme_data {
 
         unsigned n_theme_dir;
         ka_bool_t loaded_fallback_theme;
+
+        ka_theme_index *index;
+};
+
+/* Suffixes we look for, in the order of preference */
+enum {
+        SUFFIX_DISABLED = 1,
+        SUFFIX_OGA = 2,
+        SUFFIX_OGG = 4,
+        SUFFIX_WAV = 8
+};
+
+static const struct {
+        unsigned flag;
+        const char *suffix;
+} suffixes[] = {
+        { SUFFIX_DISABLED, ".disabled" },
+        { SUFFIX_OGA, ".oga" },
+        { SUFFIX_OGG, ".ogg" },
+        { SUFFIX_WAV, ".wav" }
+};
+
+/* The names of the sound files of a single directory, without
+ * suffix, together with the suffixes that are available for them */
+struct ka_index_entry {
+        ka_index_entry *next_in_slot;
+        char *name;
+        unsigned suffixes;
+};
+
+struct ka_index_dir {
+        ka_index_dir *next_in_slot;
+        char *path;
+
+        ka_bool_t exists;
+        ka_bool_t dirty;
+        time_t mtime;
+        unsigned serial;
+
+        unsigned n_slots;
+        ka_index_entry **slots;
+};
+
+/* An index of the directories we searched through, so that a lookup
+ * doesn't need to probe every single file name/suffix/locale
+ * combination on disk. Each directory is read once with readdir() and
+ * reread only when its mtime changed. */
+struct ka_theme_index {
+        ka_index_dir *dirs[N_INDEX_HASHTABLE];
+        unsigned n_dirs;
+        unsigned serial;
 };
 
 int ka_get_data_home(char **e) {
@@ -404,8 +464,19 @@ static int load_theme_data(ka_theme_data **_t, const char *name) {
         if (!t->loaded_fallback_theme)
                 load_theme_dir(t, FALLBACK_THEME);
 
-        if (*_t)
+        if (*_t) {
+                /* The directory index is not specific to a theme, so
+                 * let's keep it */
+                t->index = (*_t)->index;
+                (*_t)->index = NULL;
+
                 ka_theme_data_free(*_t);
+        }
+
+        /* Not having an index is not fatal, we just fall back to
+         * probing for the files one by one */
+        if (!t->index)
+                t->index = ka_new0(ka_theme_index, 1);
 
         *_t = t;
 
@@ -419,6 +490,302 @@ fail:
         return ret;
 }
 
+static unsigned calc_hash(const char *c) {
+        unsigned hash = 0;
+
+        for (; *c; c++)
+                hash = 31 * hash + (unsigned) *c;
+
+        return hash;
+}
+
+static void index_dir_clear(ka_index_dir *d) {
+        unsigned i;
+
+        ka_assert(d);
+
+        for (i = 0; i < d->n_slots; i++)
+                while (d->slots[i]) {
+                        ka_index_entry *e = d->slots[i];
+
+                        d->slots[i] = e->next_in_slot;
+                        ka_free(e->name);
+                        ka_free(e);
+                }
+
+        ka_free(d->slots);
+        d->slots = NULL;
+        d->n_slots = 0;
+}
+
+static void index_dir_free(ka_index_dir *d) {
+        ka_assert(d);
+
+        index_dir_clear(d);
+        ka_free(d->path);
+        ka_free(d);
+}
+
+static void theme_index_flush(ka_theme_index *idx) {
+        unsigned i;
+
+        ka_assert(idx);
+
+        for (i = 0; i < N_INDEX_HASHTABLE; i++)
+                while (idx->dirs[i]) {
+                        ka_index_dir *d = idx->dirs[i];
+
+                        idx->dirs[i] = d->next_in_slot;
+                        index_dir_free(d);
+                }
+
+        idx->n_dirs = 0;
+}
+
+static void theme_index_free(ka_theme_index *idx) {
+        ka_assert(idx);
+
+        theme_index_flush(idx);
+        ka_free(idx);
+}
+
+static unsigned suffix_flag(const char *fn, size_t *k) {
+        size_t l;
+        unsigned i;
+
+        ka_assert(fn);
+        ka_assert(k);
+
+        l = strlen(fn);
+
+        for (i = 0; i < KA_ELEMENTSOF(suffixes); i++) {
+                size_t sl = strlen(suffixes[i].suffix);
+
+                if (l > sl && ka_streq(fn + l - sl, suffixes[i].suffix)) {
+                        *k = l - sl;
+                        return suffixes[i].flag;
+                }
+        }
+
+        return 0;
+}
+
+static int index_dir_scan(ka_index_dir *d) {
+        DIR *dir;
+        struct dirent *de;
+        struct stat st;
+        time_t now;
+        ka_index_entry *list = NULL;
+        unsigned n = 0;
+        int ret;
+
+        ka_assert(d);
+
+        index_dir_clear(d);
+        d->exists = FALSE;
+        d->dirty = FALSE;
+
+        if (stat(d->path, &st) < 0) {
+
+                if (errno == ENOENT || errno == ENOTDIR)
+                        return KA_SUCCESS;
+
+                return KA_ERROR_NOTSUPPORTED;
+        }
+
+        /* Something that isn't a directory is just as absent */
+        if (!S_ISDIR(st.st_mode))
+                return KA_SUCCESS;
+
+        now = time(NULL);
+
+        if (!(dir = opendir(d->path))) {
+
+                if (errno == ENOENT || errno == ENOTDIR)
+                        return KA_SUCCESS;
+
+                return KA_ERROR_NOTSUPPORTED;
+        }
+
+        while ((de = readdir(dir))) {
+                ka_index_entry *e;
+                unsigned flag;
+                size_t k;
+
+                if (!(flag = suffix_flag(de->d_name, &k)))
+                        continue;
+
+                for (e = list; e; e = e->next_in_slot)
+                        if (strlen(e->name) == k && !strncmp(e->name, de->d_name, k))
+                                break;
+
+                if (!e) {
+                        if (!(e = ka_new0(ka_index_entry, 1))) {
+                                ret = KA_ERROR_OOM;
+                                goto fail;
+                        }
+
+                        if (!(e->name = ka_strndup(de->d_name, k))) {
+                                ka_free(e);
+                                ret = KA_ERROR_OOM;
+                                goto fail;
+                        }
+
+                        e->next_in_slot = list;
+                        list = e;
+                        n++;
+                }
+
+                e->suffixes |= flag;
+        }
+
+        closedir(dir);
+        dir = NULL;
+
+        d->n_slots = n/2 + 1;
+
+        if (!(d->slots = ka_new0(ka_index_entry*, d->n_slots))) {
+                d->n_slots = 0;
+                ret = KA_ERROR_OOM;
+                goto fail;
+        }
+
+        while (list) {
+                ka_index_entry *e = list;
+                unsigned i;
+
+                list = e->next_in_slot;
+
+                i = calc_hash(e->name) % d->n_slots;
+                e->next_in_slot = d->slots[i];
+                d->slots[i] = e;
+        }
+
+        d->exists = TRUE;
+        d->mtime = st.st_mtime;
+
+        /* If the directory was modified within the current second,
+         * another change might follow in the same second without
+         * changing the mtime, so don't trust what we read. */
+        d->dirty = st.st_mtime >= now;
+
+        return KA_SUCCESS;
+
+fail:
+
+        if (dir)
+                closedir(dir);
+
+        while (list) {
+                ka_index_entry *e = list;
+
+                list = e->next_in_slot;
+                ka_free(e->name);
+                ka_free(e);
+        }
+
+        return ret;
+}
+
+static int index_dir_validate(ka_theme_index *idx, ka_index_dir *d) {
+        struct stat st;
+
+        ka_assert(idx);
+        ka_assert(d);
+
+        /* Check each directory at most once per lookup */
+        if (d->serial == idx->serial)
+                return KA_SUCCESS;
+
+        d->serial = idx->serial;
+
+        if (stat(d->path, &st) < 0) {
+
+                if (errno != ENOENT && errno != ENOTDIR)
+                        return KA_ERROR_NOTSUPPORTED;
+
+                if (!d->exists)
+                        return KA_SUCCESS;
+
+        } else if (!S_ISDIR(st.st_mode)) {
+
+                /* Treated like a missing directory */
+                if (!d->exists)
+                        return KA_SUCCESS;
+
+        } else if (d->exists && !d->dirty && d->mtime == st.st_mtime)
+                return KA_SUCCESS;
+
+        return index_dir_scan(d);
+}
+
+static int get_index_dir(ka_theme_index *idx, const char *path, ka_index_dir **_d) {
+        ka_index_dir *d;
+        unsigned i;
+        int ret;
+
+        ka_assert(idx);
+        ka_assert(path);
+        ka_assert(_d);
+
+        i = calc_hash(path) % N_INDEX_HASHTABLE;
+
+        for (d = idx->dirs[i]; d; d = d->next_in_slot)
+                if (ka_streq(d->path, path))
+                        break;
+
+        if (d) {
+                if ((ret = index_dir_validate(idx, d)) < 0)
+                        return ret;
+
+                *_d = d;
+                return KA_SUCCESS;
+        }
+
+        /* The set of directories depends on the locales asked for, so
+         * make sure this doesn't grow without bounds */
+        if (idx->n_dirs >= N_INDEX_DIRS_MAX)
+                theme_index_flush(idx);
+
+        if (!(d = ka_new0(ka_index_dir, 1)))
+                return KA_ERROR_OOM;
+
+        if (!(d->path = ka_strdup(path))) {
+                ka_free(d);
+                return KA_ERROR_OOM;
+        }
+
+        d->serial = idx->serial;
+
+        if ((ret = index_dir_scan(d)) < 0) {
+                index_dir_free(d);
+                return ret;
+        }
+
+        d->next_in_slot = idx->dirs[i];
+        idx->dirs[i] = d;
+        idx->n_dirs++;
+
+        *_d = d;
+        return KA_SUCCESS;
+}
+
+static unsigned index_dir_lookup(ka_index_dir *d, const char *name) {
+        ka_index_entry *e;
+
+        ka_assert(d);
+        ka_assert(name);
+
+        if (!d->exists || d->n_slots <= 0)
+                return 0;
+
+        for (e = d->slots[calc_hash(name) % d->n_slots]; e; e = e->next_in_slot)
+                if (ka_streq(e->name, name))
+                        return e->suffixes;
+
+        return 0;
+}
+
 static int find_sound_for_suffix(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
@@ -468,10 +835,63 @@ static int find_sound_for_suffix(
         return ret;
 }
 
+static int find_sound_in_index(
+                ka_sound_file **f,
+                ka_sound_file_open_callback_t sfopen,
+                char **sound_path,
+                ka_theme_index *idx,
+                const char *theme_name,
+                const char *name,
+                const char *path,
+                const char *locale,
+                const char *subdir) {
+
+        char *dn;
+        ka_index_dir *d;
+        unsigned flags, i;
+        int ret;
+
+        ka_return_val_if_fail(f, KA_ERROR_INVALID);
+        ka_return_val_if_fail(sfopen, KA_ERROR_INVALID);
+        ka_return_val_if_fail(idx, KA_ERROR_INVALID);
+        ka_return_val_if_fail(name, KA_ERROR_INVALID);
+        ka_return_val_if_fail(path, KA_ERROR_INVALID);
+
+        if (!(dn = ka_sprintf_malloc("%s%s%s%s%s%s%s",
+                                     path,
+                                     theme_name ? "/" : "",
+                                     theme_name ? theme_name : "",
+                                     subdir ? "/" : "",
+                                     subdir ? subdir : "",
+                                     locale ? "/" : "",
+                                     locale ? locale : "")))
+                return KA_ERROR_OOM;
+
+        ret = get_index_dir(idx, dn, &d);
+        ka_free(dn);
+
+        if (ret < 0)
+                return ret;
+
+        if (!(flags = index_dir_lookup(d, name)))
+                return KA_ERROR_NOTFOUND;
+
+        if (flags & SUFFIX_DISABLED)
+                return KA_ERROR_DISABLED;
+
+        for (i = 0; i < KA_ELEMENTSOF(suffixes); i++)
+                if (flags & suffixes[i].flag)
+                        if ((ret = find_sound_for_suffix(f, sfopen, sound_path, theme_name, name, path, suffixes[i].suffix, locale, subdir)) != KA_ERROR_NOTFOUND)
+                                return ret;
+
+        return KA_ERROR_NOTFOUND;
+}
+
 static int find_sound_in_locale(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 const char *theme_name,
                 const char *name,
                 const char *path,
@@ -492,6 +912,14 @@ static int find_sound_in_locale(
 
         sprintf(p, "%s/sounds", path);
 
+        /* Try the directory index first, and if that doesn't work out
+         * for some reason probe the files one by one */
+        if (idx)
+                if ((ret = find_sound_in_index(f, sfopen, sound_path, idx, theme_name, name, p, locale, subdir)) != KA_ERROR_NOTSUPPORTED) {
+                        ka_free(p);
+                        return ret;
+                }
+
         if ((ret = find_sound_for_suffix(f, sfopen, sound_path, theme_name, name, p, ".disabled", locale, subdir)) == KA_ERROR_NOTFOUND)
                 if ((ret = find_sound_for_suffix(f, sfopen, sound_path,theme_name, name, p, ".oga", locale, subdir)) == KA_ERROR_NOTFOUND)
                         if ((ret = find_sound_for_suffix(f, sfopen, sound_path,theme_name, name, p, ".ogg", locale, subdir)) == KA_ERROR_NOTFOUND)
@@ -506,6 +934,7 @@ static int find_sound_for_locale(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 const char *theme_name,
                 const char *name,
                 const char *path,
@@ -522,7 +951,7 @@ static int find_sound_for_locale(
         ka_return_val_if_fail(locale, KA_ERROR_INVALID);
 
         /* First, try the locale def itself */
-        if ((ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, locale, subdir)) != KA_ERROR_NOTFOUND)
+        if ((ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, locale, subdir)) != KA_ERROR_NOTFOUND)
                 return ret;
 
         /* Then, try to truncate at the @ */
@@ -532,7 +961,7 @@ static int find_sound_for_locale(
                 if (!(t = ka_strndup(locale, (size_t) (e - locale))))
                         return KA_ERROR_OOM;
 
-                ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, t, subdir);
+                ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, t, subdir);
                 ka_free(t);
 
                 if (ret != KA_ERROR_NOTFOUND)
@@ -546,7 +975,7 @@ static int find_sound_for_locale(
                 if (!(t = ka_strndup(locale, (size_t) (e - locale))))
                         return KA_ERROR_OOM;
 
-                ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, t, subdir);
+                ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, t, subdir);
                 ka_free(t);
 
                 if (ret != KA_ERROR_NOTFOUND)
@@ -555,17 +984,18 @@ static int find_sound_for_locale(
 
         /* Then, try "C" as fallback locale */
         if (strcmp(locale, "C"))
-                if ((ret = find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, "C", subdir)) != KA_ERROR_NOTFOUND)
+                if ((ret = find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, "C", subdir)) != KA_ERROR_NOTFOUND)
                         return ret;
 
         /* Try without locale */
-        return find_sound_in_locale(f, sfopen, sound_path, theme_name, name, path, NULL, subdir);
+        return find_sound_in_locale(f, sfopen, sound_path, idx, theme_name, name, path, NULL, subdir);
 }
 
 static int find_sound_for_name(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 const char *theme_name,
                 const char *name,
                 const char *path,
@@ -579,7 +1009,7 @@ static int find_sound_for_name(
         ka_return_val_if_fail(sfopen, KA_ERROR_INVALID);
         ka_return_val_if_fail(name && *name, KA_ERROR_INVALID);
 
-        if ((ret = find_sound_for_locale(f, sfopen, sound_path, theme_name, name, path, locale, subdir)) != KA_ERROR_NOTFOUND)
+        if ((ret = find_sound_for_locale(f, sfopen, sound_path, idx, theme_name, name, path, locale, subdir)) != KA_ERROR_NOTFOUND)
                 return ret;
 
         k = strchr(name, 0);
@@ -597,7 +1027,7 @@ static int find_sound_for_name(
                 if (!(n = ka_strndup(name, (size_t) (k-name))))
                         return KA_ERROR_OOM;
 
-                if ((ret = find_sound_for_locale(f, sfopen, sound_path, theme_name, n, path, locale, subdir)) != KA_ERROR_NOTFOUND) {
+                if ((ret = find_sound_for_locale(f, sfopen, sound_path, idx, theme_name, n, path, locale, subdir)) != KA_ERROR_NOTFOUND) {
                         ka_free(n);
                         return ret;
                 }
@@ -610,6 +1040,7 @@ static int find_sound_in_subdir(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 const char *theme_name,
                 const char *name,
                 const char *locale,
@@ -627,7 +1058,7 @@ static int find_sound_in_subdir(
                 return ret;
 
         if (e) {
-                ret = find_sound_for_name(f, sfopen, sound_path, theme_name, name, e, locale, subdir);
+                ret = find_sound_for_name(f, sfopen, sound_path, idx, theme_name, name, e, locale, subdir);
                 ka_free(e);
 
                 if (ret != KA_ERROR_NOTFOUND)
@@ -647,7 +1078,7 @@ static int find_sound_in_subdir(
                         if (!(p = ka_strndup(g, k)))
                                 return KA_ERROR_OOM;
 
-                        ret = find_sound_for_name(f, sfopen, sound_path, theme_name, name, p, locale, subdir);
+                        ret = find_sound_for_name(f, sfopen, sound_path, idx, theme_name, name, p, locale, subdir);
                         ka_free(p);
 
                         if (ret != KA_ERROR_NOTFOUND)
@@ -667,6 +1098,7 @@ static int find_sound_in_profile(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 ka_theme_data *t,
                 const char *name,
                 const char *locale,
@@ -683,7 +1115,7 @@ static int find_sound_in_profile(
                 if (data_dir_matches(d, profile)) {
                         int ret;
 
-                        if ((ret = find_sound_in_subdir(f, sfopen, sound_path, d->theme_name, name, locale, d->dir_name)) != KA_ERROR_NOTFOUND)
+                        if ((ret = find_sound_in_subdir(f, sfopen, sound_path, idx, d->theme_name, name, locale, d->dir_name)) != KA_ERROR_NOTFOUND)
                                 return ret;
                 }
 
@@ -694,6 +1126,7 @@ static int find_sound_in_theme(
                 ka_sound_file **f,
                 ka_sound_file_open_callback_t sfopen,
                 char **sound_path,
+                ka_theme_index *idx,
                 ka_theme_data *t,
                 const char *name,
                 const char *locale,
@@ -708,17 +1141,17 @@ static int find_sound_in_theme(
 
         if (t) {
                 /* First, try the profile def itself */
-                if ((ret = find_sound_in_profile(f, sfopen, sound_path, t, name, locale, profile)) != KA_ERROR_NOTFOUND)
+                if ((ret = find_sound_in_profile(f, sfopen, sound_path, idx, t, name, locale, profile)) != KA_ERROR_NOTFOUND)
                         return ret;
 
                 /* Then, fall back to stereo */
                 if (!ka_streq(profile, DEFAULT_OUTPUT_PROFILE))
-                        if ((ret = find_sound_in_profile(f, sfopen, sound_path, t, name, locale, DEFAULT_OUTPUT_PROFILE)) != KA_ERROR_NOTFOUND)
+                        if ((ret = find_sound_in_profile(f, sfopen, sound_path, idx, t, name, locale, DEFAULT_OUTPUT_PROFILE)) != KA_ERROR_NOTFOUND)
                                 return ret;
         }
 
         /* And fall back to no profile */
-        return find_sound_in_subdir(f, sfopen, sound_path, t ? t->name : NULL, name, locale, NULL);
+        return find_sound_in_subdir(f, sfopen, sound_path, idx, t ? t->name : NULL, name, locale, NULL);
 }
 
 static int find_sound_for_theme(
@@ -731,6 +1164,7 @@ static int find_sound_for_theme(
                 const char *locale,
                 const char *profile) {
 
+        ka_theme_index *idx;
         int ret;
 
         ka_return_val_if_fail(f, KA_ERROR_INVALID);
@@ -746,12 +1180,15 @@ static int find_sound_for_theme(
                 if (!ka_streq(theme, FALLBACK_THEME))
                         ret = load_theme_data(t, FALLBACK_THEME);
 
+        if ((idx = *t ? (*t)->index : NULL))
+                idx->serial++;
+
         if (ret == KA_SUCCESS)
-                if ((ret = find_sound_in_theme(f, sfopen, sound_path, *t, name, locale, profile)) != KA_ERROR_NOTFOUND)
+                if ((ret = find_sound_in_theme(f, sfopen, sound_path, idx, *t, name, locale, profile)) != KA_ERROR_NOTFOUND)
                         return ret;
 
         /* Then, fall back to "unthemed" files */
-        return find_sound_in_theme(f, sfopen, sound_path, NULL, name, locale, profile);
+        return find_sound_in_theme(f, sfopen, sound_path, idx, NULL, name, locale, profile);
 }
 
 int ka_lookup_sound_with_callback(
@@ -775,25 +1212,25 @@ int ka_lookup_sound_with_callback(
         if (sound_path)
                 *sound_path = NULL;
 
-        ka_mutex_lock(cp->mutex);
-        ka_mutex_lock(sp->mutex);
+        ka_proplist_lock(cp);
+        ka_proplist_lock(sp);
 
-        if ((name = ka_proplist_gets_unlocked(sp, KA_PROP_EVENT_ID))) {
+        if ((name = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_EVENT_ID))) {
                 const char *theme, *locale, *profile;
 
-                if (!(theme = ka_proplist_gets_unlocked(sp, KA_PROP_KANBERRA_XDG_THEME_NAME)))
-                        if (!(theme = ka_proplist_gets_unlocked(cp, KA_PROP_KANBERRA_XDG_THEME_NAME)))
+                if (!(theme = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_KANBERRA_XDG_THEME_NAME)))
+                        if (!(theme = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_KANBERRA_XDG_THEME_NAME)))
                                 theme = DEFAULT_THEME;
 
-                if (!(locale = ka_proplist_gets_unlocked(sp, KA_PROP_MEDIA_LANGUAGE)))
-                        if (!(locale = ka_proplist_gets_unlocked(sp, KA_PROP_APPLICATION_LANGUAGE)))
-                                if (!(locale = ka_proplist_gets_unlocked(cp, KA_PROP_MEDIA_LANGUAGE)))
-                                        if (!(locale = ka_proplist_gets_unlocked(cp, KA_PROP_APPLICATION_LANGUAGE)))
+                if (!(locale = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_MEDIA_LANGUAGE)))
+                        if (!(locale = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_APPLICATION_LANGUAGE)))
+                                if (!(locale = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_MEDIA_LANGUAGE)))
+                                        if (!(locale = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_APPLICATION_LANGUAGE)))
                                                 if (!(locale = setlocale(LC_MESSAGES, NULL)))
                                                         locale = "C";
 
-                if (!(profile = ka_proplist_gets_unlocked(sp, KA_PROP_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
-                        if (!(profile = ka_proplist_gets_unlocked(cp, KA_PROP_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+                if (!(profile = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+                        if (!(profile = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
                                 profile = DEFAULT_OUTPUT_PROFILE;
 
 #ifdef HAVE_CACHE
@@ -829,12 +1266,12 @@ int ka_lookup_sound_with_callback(
         }
 
         if (ret == KA_ERROR_NOTFOUND || !name) {
-                if ((fname = ka_proplist_gets_unlocked(sp, KA_PROP_MEDIA_FILENAME)))
+                if ((fname = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_MEDIA_FILENAME)))
                         ret = sfopen(f, fname);
         }
 
-        ka_mutex_unlock(cp->mutex);
-        ka_mutex_unlock(sp->mutex);
+        ka_proplist_unlock(cp);
+        ka_proplist_unlock(sp);
 
         return ret;
 }
@@ -849,6 +1286,218 @@ int ka_lookup_sound(
         return ka_lookup_sound_with_callback(f, ka_sound_file_open, sound_path, t, cp, sp);
 }
 
+static int event_set_add(ka_index_entry **set, const char *name) {
+        ka_index_entry *e;
+        unsigned i;
+
+        ka_assert(set);
+        ka_assert(name);
+
+        i = calc_hash(name) % N_EVENT_SLOTS;
+
+        for (e = set[i]; e; e = e->next_in_slot)
+                if (ka_streq(e->name, name))
+                        return KA_SUCCESS;
+
+        if (!(e = ka_new0(ka_index_entry, 1)))
+                return KA_ERROR_OOM;
+
+        if (!(e->name = ka_strdup(name))) {
+                ka_free(e);
+                return KA_ERROR_OOM;
+        }
+
+        e->next_in_slot = set[i];
+        set[i] = e;
+
+        return KA_SUCCESS;
+}
+
+static int list_events_in_path(
+                ka_index_entry **set,
+                ka_theme_index *idx,
+                const char *theme_name,
+                const char *path,
+                const char *subdir) {
+
+        char *dn;
+        ka_index_dir *d;
+        unsigned i;
+        int ret;
+
+        ka_assert(set);
+        ka_assert(idx);
+        ka_assert(theme_name);
+        ka_assert(path);
+
+        if (!(dn = ka_sprintf_malloc("%s/sounds/%s%s%s",
+                                     path,
+                                     theme_name,
+                                     subdir ? "/" : "",
+                                     subdir ? subdir : "")))
+                return KA_ERROR_OOM;
+
+        ret = get_index_dir(idx, dn, &d);
+        ka_free(dn);
+
+        /* A directory we may not read is just skipped */
+        if (ret < 0)
+                return ret == KA_ERROR_NOTSUPPORTED ? KA_SUCCESS : ret;
+
+        for (i = 0; i < d->n_slots; i++) {
+                ka_index_entry *e;
+
+                for (e = d->slots[i]; e; e = e->next_in_slot)
+                        if (e->suffixes & ~SUFFIX_DISABLED)
+                                if ((ret = event_set_add(set, e->name)) < 0)
+                                        return ret;
+        }
+
+        return KA_SUCCESS;
+}
+
+static int list_events_in_subdir(
+                ka_index_entry **set,
+                ka_theme_index *idx,
+                const char *theme_name,
+                const char *subdir) {
+
+        int ret;
+        char *e = NULL;
+        const char *g;
+
+        ka_assert(set);
+        ka_assert(idx);
+        ka_assert(theme_name);
+
+        if ((ret = ka_get_data_home(&e)) < 0)
+                return ret;
+
+        if (e) {
+                ret = list_events_in_path(set, idx, theme_name, e, subdir);
+                ka_free(e);
+
+                if (ret < 0)
+                        return ret;
+        }
+
+        g = ka_get_data_dirs();
+
+        for (;;) {
+                size_t k;
+
+                k = strcspn(g, ":");
+
+                if (g[0] == '/' && k > 0) {
+                        char *p;
+
+                        if (!(p = ka_strndup(g, k)))
+                                return KA_ERROR_OOM;
+
+                        ret = list_events_in_path(set, idx, theme_name, p, subdir);
+                        ka_free(p);
+
+                        if (ret < 0)
+                                return ret;
+                }
+
+                if (g[k] == 0)
+                        break;
+
+                g += k+1;
+        }
+
+        return KA_SUCCESS;
+}
+
+static int list_events_in_profile(ka_index_entry **set, ka_theme_data *t, const char *profile) {
+        ka_data_dir *d;
+
+        ka_assert(set);
+        ka_assert(t);
+        ka_assert(profile);
+
+        for (d = t->data_dirs; d; d = d->next)
+                if (data_dir_matches(d, profile)) {
+                        int ret;
+
+                        if ((ret = list_events_in_subdir(set, t->index, d->theme_name, d->dir_name)) < 0)
+                                return ret;
+                }
+
+        return KA_SUCCESS;
+}
+
+int ka_theme_foreach_event(
+                ka_theme_data **t,
+                ka_proplist *cp,
+                ka_proplist *sp,
+                ka_theme_event_callback_t cb,
+                void *userdata) {
+
+        ka_index_entry *set[N_EVENT_SLOTS];
+        const char *theme, *profile;
+        unsigned i;
+        int ret;
+
+        ka_return_val_if_fail(t, KA_ERROR_INVALID);
+        ka_return_val_if_fail(cp, KA_ERROR_INVALID);
+        ka_return_val_if_fail(sp, KA_ERROR_INVALID);
+        ka_return_val_if_fail(cb, KA_ERROR_INVALID);
+
+        memset(set, 0, sizeof(set));
+
+        ka_proplist_lock(cp);
+        ka_proplist_lock(sp);
+
+        if (!(theme = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_KANBERRA_XDG_THEME_NAME)))
+                if (!(theme = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_KANBERRA_XDG_THEME_NAME)))
+                        theme = DEFAULT_THEME;
+
+        if (!(profile = ka_proplist_gets_atom_unlocked(sp, KA_ATOM_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+                if (!(profile = ka_proplist_gets_atom_unlocked(cp, KA_ATOM_KANBERRA_XDG_THEME_OUTPUT_PROFILE)))
+                        profile = DEFAULT_OUTPUT_PROFILE;
+
+        /* Same order as find_sound_for_theme() and find_sound_in_theme() */
+        if ((ret = load_theme_data(t, theme)) == KA_ERROR_NOTFOUND)
+                if (!ka_streq(theme, FALLBACK_THEME))
+                        ret = load_theme_data(t, FALLBACK_THEME);
+
+        if (ret == KA_SUCCESS && !(*t)->index)
+                ret = KA_ERROR_OOM;
+
+        if (ret == KA_SUCCESS) {
+                (*t)->index->serial++;
+
+                if ((ret = list_events_in_profile(set, *t, profile)) == KA_SUCCESS)
+                        if (!ka_streq(profile, DEFAULT_OUTPUT_PROFILE))
+                                ret = list_events_in_profile(set, *t, DEFAULT_OUTPUT_PROFILE);
+
+                if (ret == KA_SUCCESS)
+                        ret = list_events_in_subdir(set, (*t)->index, (*t)->name, NULL);
+        }
+
+        ka_proplist_unlock(cp);
+        ka_proplist_unlock(sp);
+
+        /* We call out only after unlocking, so that cb may look up the
+         * sounds with the same props */
+        for (i = 0; i < N_EVENT_SLOTS; i++)
+                while (set[i]) {
+                        ka_index_entry *e = set[i];
+
+                        set[i] = e->next_in_slot;
+
+                        if (ret == KA_SUCCESS)
+                                ret = cb(e->name, userdata);
+
+                        ka_free(e->name);
+                        ka_free(e);
+                }
+
+        return ret;
+}
+
 void ka_theme_data_free(ka_theme_data *t) {
         ka_assert(t);
 
@@ -863,6 +1512,9 @@ void ka_theme_data_free(ka_theme_data *t) {
                 ka_free(d);
         }
 
+        if (t->index)
+                theme_index_free(t->index);
+
         ka_free(t->name);
         ka_free(t);
 }
@@ -34,6 +34,13 @@ int ka_lookup_sound(ka_sound_file **f, char **sound_path, ka_theme_data **t, ka_
 int ka_lookup_sound_with_callback(ka_sound_file **f, ka_sound_file_open_callback_t sfopen, char **sound_path, ka_theme_data **t, ka_proplist *cp, ka_proplist *sp);
 void ka_theme_data_free(ka_theme_data *t);
 
+typedef int (*ka_theme_event_callback_t)(const char *name, void *userdata);
+
+/* Calls cb once for each event the theme and output profile selected
+ * by the props have a sound for, in no particular order. Stops at the
+ * first error cb returns and returns it. */
+int ka_theme_foreach_event(ka_theme_data **t, ka_proplist *cp, ka_proplist *sp, ka_theme_event_callback_t cb, void *userdata);
+
 int ka_get_data_home(char **e);
 const char *ka_get_data_dirs(void);
 
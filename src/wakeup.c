@@ -0,0 +1,113 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "kanberra.h"
+#include "macro.h"
+#include "wakeup.h"
+
+int ka_wakeup_init(ka_wakeup *w) {
+        ka_return_val_if_fail(w, KA_ERROR_INVALID);
+
+        w->fd[0] = w->fd[1] = -1;
+
+#if defined(HAVE_SYS_EVENTFD_H) && defined(EFD_NONBLOCK) && defined(EFD_CLOEXEC)
+        if ((w->fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) >= 0) {
+                w->fd[1] = w->fd[0];
+                return KA_SUCCESS;
+        }
+
+        /* Maybe the kernel is older than the headers */
+        if (errno != ENOSYS && errno != EINVAL)
+                return KA_ERROR_SYSTEM;
+#endif
+
+        if (pipe(w->fd) < 0) {
+                w->fd[0] = w->fd[1] = -1;
+                return KA_ERROR_SYSTEM;
+        }
+
+        if (fcntl(w->fd[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(w->fd[1], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(w->fd[0], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl(w->fd[1], F_SETFD, FD_CLOEXEC) < 0) {
+                ka_wakeup_done(w);
+                return KA_ERROR_SYSTEM;
+        }
+
+        return KA_SUCCESS;
+}
+
+void ka_wakeup_done(ka_wakeup *w) {
+        ka_return_if_fail(w);
+
+        if (w->fd[1] >= 0 && w->fd[1] != w->fd[0])
+                close(w->fd[1]);
+
+        if (w->fd[0] >= 0)
+                close(w->fd[0]);
+
+        w->fd[0] = w->fd[1] = -1;
+}
+
+void ka_wakeup_signal(ka_wakeup *w) {
+        uint64_t one = 1;
+        ssize_t r;
+
+        ka_return_if_fail(w);
+        ka_return_if_fail(w->fd[1] >= 0);
+
+        /* If the pipe is full, or the counter about to overflow, a
+         * wakeup is pending anyway */
+        if (w->fd[1] == w->fd[0])
+                r = write(w->fd[1], &one, sizeof(one));
+        else
+                r = write(w->fd[1], "x", 1);
+
+        if (r < 0)
+                return;
+}
+
+void ka_wakeup_clear(ka_wakeup *w) {
+        uint64_t buf[8];
+
+        ka_return_if_fail(w);
+        ka_return_if_fail(w->fd[0] >= 0);
+
+        /* An eventfd is reset by a single read, a pipe needs to be
+         * emptied */
+        while (read(w->fd[0], buf, sizeof(buf)) > 0)
+                if (w->fd[0] == w->fd[1])
+                        break;
+}
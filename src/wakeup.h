@@ -0,0 +1,46 @@
+/*-*- Mode: C; c-basic-offset: 8 -*-*/
+
+#ifndef fookanberrawakeuphfoo
+#define fookanberrawakeuphfoo
+
+/***
+  This file is part of libkanberra.
+
+  Copyright 2026 libkanberra contributors
+
+  libkanberra is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2.1 of the
+  License, or (at your option) any later version.
+
+  libkanberra is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with libkanberra. If not, see
+  <http://www.gnu.org/licenses/>.
+***/
+
+/* Wakes up a thread sleeping in poll(). This is an eventfd where we
+ * have one, so that it costs a single file descriptor, and a pipe
+ * otherwise. Signalling is async signal safe and never blocks, any
+ * number of signals before the next clear wake up only once. */
+
+typedef struct ka_wakeup {
+        /* Both are the same eventfd, or the ends of a pipe. -1 if
+         * not initialized. */
+        int fd[2];
+} ka_wakeup;
+
+int ka_wakeup_init(ka_wakeup *w);
+void ka_wakeup_done(ka_wakeup *w);
+
+void ka_wakeup_signal(ka_wakeup *w);
+void ka_wakeup_clear(ka_wakeup *w);
+
+/* What to poll() for POLLIN on */
+#define ka_wakeup_fd(w) ((w)->fd[0])
+
+#endif